@@ -0,0 +1,73 @@
+#ifndef AUDIOGAIN_H
+#define AUDIOGAIN_H
+#include <atomic>
+#include <memory>
+#include "FFMpegFrame.h"
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+namespace jp {
+
+/// Multiplies count samples by gain
+void gain_f32(float* samples, size_t count, float gain);
+void gain_s16(int16_t* samples, size_t count, float gain);
+void gain_s32(int32_t* samples, size_t count, float gain);
+/// U8 samples are centred on 128
+void gain_u8(uint8_t* samples, size_t count, float gain);
+
+/// Ramps the gain over frames sample frames of interleaved audio. The first frame gets start, each following frame gets step more
+void gain_ramp_f32(float* samples, size_t frames, int channels, float start, float step);
+void gain_ramp_s16(int16_t* samples, size_t frames, int channels, float start, float step);
+void gain_ramp_s32(int32_t* samples, size_t frames, int channels, float start, float step);
+void gain_ramp_u8(uint8_t* samples, size_t frames, int channels, float start, float step);
+
+/// Crossfades src into dest over frames sample frames of interleaved audio: dest becomes dest * fade out gain + src * fade in gain
+/// Like the ramps above, the first frame gets each start gain and each following frame gets its step more
+void crossfade_f32(float* dest, const float* src, size_t frames, int channels, float out_start, float out_step, float in_start, float in_step);
+void crossfade_s16(int16_t* dest, const int16_t* src, size_t frames, int channels, float out_start, float out_step, float in_start, float in_step);
+
+/// Applies volume to decoded audio in place. The gain can be changed from any thread without locking, the audio thread picks it up on the next frame and ramps to it, so changes don't click
+/// Supports U8, S16, S32 and FLT audio, packed or planar: everything an SDL device can be opened with
+class AudioGain
+{
+public:
+    AudioGain() = default;
+
+    /// Whether process can apply a gain to audio in this sample format
+    static bool is_supported(AVSampleFormat format);
+
+    /// Sets the gain (1.0 leaves the audio untouched). Safe to call from any thread, as often as you like
+    void set_gain(float gain) { target_gain.store(gain, std::memory_order_relaxed); }
+
+    float get_gain() const { return target_gain.load(std::memory_order_relaxed); }
+
+    /// Number of sample frames a gain change is spread over. 0 switches immediately
+    void set_ramp_length(int frames) { ramp_length.store(frames < 0 ? 0 : frames, std::memory_order_relaxed); }
+
+    /// Applies the gain to this frame. Only call this from the audio thread. Returns false if the sample format is not supported
+    bool process(FFMpegFrame_Ptr& frame);
+
+    /// Applies the gain to nb_samples sample frames. For planar formats, data holds one plane per channel
+    bool process(uint8_t** data, int nb_samples, int channels, AVSampleFormat format);
+
+    /// Jumps straight to the target gain, e.g. after a seek. Safe to call from any thread, the audio thread does it before the next frame it processes
+    void reset() { reset_requested.store(true, std::memory_order_release); }
+
+private:
+    std::atomic<float> target_gain{1.0f};
+    std::atomic<int> ramp_length{256};
+    std::atomic<bool> reset_requested{false};
+
+    /// These are only touched by the audio thread
+    float current_gain{1.0f};
+    float ramp_target{1.0f};
+    int ramp_remaining{0};
+};
+
+using AudioGain_Ptr = std::shared_ptr<AudioGain>;
+
+}
+
+#endif // AUDIOGAIN_H
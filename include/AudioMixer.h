@@ -0,0 +1,199 @@
+#pragma once
+#include "IAudioOutput.h"
+#include "FFMpegMediaPlayer.h"
+#include <SDL2/SDL.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace jp {
+
+	/// Adds src, scaled by a gain ramped over the block, onto dest. Stereo audio ramps the left and right gains separately (that's how pan is applied), other layouts use the left gain for every channel
+	void mix_ramp_f32(float* dest, const float* src, size_t frames, int channels, float start_left, float start_right, float step_left, float step_right);
+
+	/// Bends samples above 0.9 towards +-1 instead of cutting them off past it, so mixing many loud sources doesn't crackle. Samples within +-0.9 are left exactly as they are
+	/// The curve is fixed, each sample comes out the same whatever else is in the block
+	void soft_clip_f32(float* samples, size_t count);
+
+	/// A lock-free ring of interleaved float samples for exactly one writer and one reader thread
+	/// Write and read whole sample frames only, then every piece peek hands out holds whole frames too
+	class AudioRing {
+	public:
+		/// Room for frames sample frames of channels channels. Not thread safe, call it before either thread uses the ring
+		void allocate(size_t frames, int channels);
+
+		bool is_allocated() const { return !buffer.empty(); }
+
+		size_t available() const { return write_index.load(std::memory_order_acquire) - read_index.load(std::memory_order_relaxed); }
+		size_t space() const { return buffer.size() - (write_index.load(std::memory_order_relaxed) - read_index.load(std::memory_order_acquire)); }
+
+		/// Writes up to count samples, returns how many fit. Writer thread only
+		size_t write(const float* samples, size_t count);
+
+		/// Points at up to count readable samples without copying. The data can wrap, so this gives up to two pieces. Reader thread only
+		size_t peek(size_t count, const float*& first, size_t& first_count, const float*& second);
+
+		/// Drops count samples after peek. Reader thread only
+		void consume(size_t count) { read_index.fetch_add(count, std::memory_order_release); }
+
+		/// Samples written and read since allocate
+		size_t get_write_position() const { return write_index.load(std::memory_order_acquire); }
+		size_t get_read_position() const { return read_index.load(std::memory_order_relaxed); }
+
+	private:
+		std::vector<float> buffer{};
+		std::atomic<size_t> write_index{0};
+		std::atomic<size_t> read_index{0};
+	};
+
+	/// Time the mixer spends in the device callback
+	struct MixerStats {
+		uint64_t callbacks{0};
+		/// Microseconds, over all callbacks
+		uint64_t total_time{0};
+		uint64_t max_time{0};
+		/// Callbacks where a playing source had fewer samples ready than the device asked for
+		uint64_t underruns{0};
+		/// Microseconds of audio each callback produces
+		double period_time{0};
+
+		double get_average_time() const { return callbacks ? (double) total_time / callbacks : 0; }
+
+		/// Share of the real time budget the mixer uses, 1.0 means it can't keep up
+		double get_load() const { return period_time > 0 ? get_average_time() / period_time : 0; }
+	};
+
+	class AudioMixer;
+
+	/// The audio output a player plays into when it shares a device through an AudioMixer. Create it with AudioMixer::add_source
+	/// The player converts its audio to the mixer's format (see IAudioOutput::get_format), a feeder thread moves it into a ring the mixer reads from
+	class MixerInput : public IAudioOutput, public std::enable_shared_from_this<MixerInput> {
+	public:
+		MixerInput(FFMpegMediaPlayer_Ptr media_player, std::shared_ptr<AudioMixer> mixer) : IAudioOutput(media_player), mixer(mixer) {}
+		~MixerInput() { release(); }
+
+		bool initialize() override;
+		bool play() override;
+		bool pause() override;
+		bool stop() override;
+		void release() override;
+		void reset() override;
+
+		/// Level of this source in the mix, 1.0 leaves it as it is. Safe to call from any thread, changes are ramped over one period
+		void set_gain(float gain) { this->gain.store(gain, std::memory_order_relaxed); }
+		float get_gain() { return gain.load(std::memory_order_relaxed); }
+
+		/// Stereo position from -1 (left) to 1 (right), with constant power. Only stereo mixers pan
+		void set_pan(float pan) { this->pan.store(std::min(1.0f, std::max(-1.0f, pan)), std::memory_order_relaxed); }
+		float get_pan() { return pan.load(std::memory_order_relaxed); }
+
+	private:
+		friend class AudioMixer;
+		std::weak_ptr<AudioMixer> mixer;
+
+		AudioRing ring{};
+		std::thread feeder{};
+		std::atomic<bool> stop_feeder{false};
+		/// Set by reset, the mixer drops whatever is in the ring before reading again
+		std::atomic<bool> flush_requested{false};
+
+		/// Media time in milliseconds of the ring sample at clock_base_sample, set by the feeder from the first frame after initialize or reset
+		/// Stored before the samples are written, so the mixer sees it once it sees them
+		std::atomic<double> clock_base_pts{-1};
+		std::atomic<size_t> clock_base_sample{0};
+		std::atomic<bool> needs_clock_base{true};
+
+		std::atomic<float> gain{1.0f};
+		std::atomic<float> pan{0.0f};
+
+		/// Our slot in the mixer, -1 until initialize
+		int slot{-1};
+
+		/// The mixer's callback publishes our clock, so pause, stop and reset change it under the mixer's device lock
+		void freeze_clock_locked();
+		void clear_clock_locked();
+
+		/// Gains the last mix ended on, only touched by the mixer
+		float current_left{1.0f};
+		float current_right{1.0f};
+
+		void feed();
+	};
+
+	using MixerInput_Ptr = std::shared_ptr<MixerInput>;
+
+	/// Mixes any number of players into one SDL audio device
+	/// Every source is converted to the mixer's format by its own player, so the device callback only adds up float samples
+	class AudioMixer : public std::enable_shared_from_this<AudioMixer> {
+	public:
+		/// The format to open the device with. The device may change the rate and channel count, the samples are always float
+		AudioMixer(AudioFormat format = {48000, 2, 0, AV_SAMPLE_FMT_FLT}, int period_size = 1024) : requested_format(format), period_size(period_size) {
+			for (auto& slot : slots) slot.store(nullptr);
+		}
+		~AudioMixer() { close(); }
+
+		/// Opens the device and starts mixing. Sources can be added before or after
+		bool open();
+		void close();
+
+		/// Creates the output for this player to play into. Pass it to FFMpegMediaPlayer::set_audio_output
+		MixerInput_Ptr add_source(FFMpegMediaPlayer_Ptr player);
+
+		/// Takes a source out of the mix. Returns once the device is done with it
+		void remove_source(MixerInput* source);
+
+		/// Starts mixing a source once its ring is ready. Returns false if all slots are taken
+		bool attach_source(MixerInput* source);
+
+		/// The format sources have to deliver, valid after open
+		AudioFormat get_format() { return format; }
+
+		/// Level of the whole mix, before soft clipping
+		void set_master_gain(float gain) { master_gain.store(gain, std::memory_order_relaxed); }
+
+		MixerStats get_stats();
+		void reset_stats();
+
+		std::string get_error() { return error; }
+
+		/// The most sources mixed at once
+		static constexpr int max_sources = 32;
+
+	private:
+		friend class MixerInput;
+
+		AudioFormat requested_format{};
+		AudioFormat format{};
+		int period_size{1024};
+		SDL_AudioDeviceID device{0};
+		bool subsystem_initialized{false};
+		std::string error{};
+
+		/// Guards sources, the callback only reads slots
+		std::mutex sources_mutex{};
+		std::vector<MixerInput_Ptr> sources{};
+		std::atomic<MixerInput*> slots[max_sources];
+
+		std::atomic<float> master_gain{1.0f};
+		float current_master{1.0f};
+
+		std::atomic<uint64_t> callbacks{0};
+		std::atomic<uint64_t> total_time{0};
+		std::atomic<uint64_t> max_time{0};
+		std::atomic<uint64_t> underruns{0};
+		double period_time{0};
+
+		/// Keeps the callback out while a source's clock is changed from another thread
+		void lock_device() { if (device) SDL_LockAudioDevice(device); }
+		void unlock_device() { if (device) SDL_UnlockAudioDevice(device); }
+
+		static void audio_callback(void* opaque, uint8_t* buffer, int len);
+		/// Mixes frames sample frames into output. time is when the callback started, for the sources' clocks
+		void mix(float* output, int frames, int64_t time);
+	};
+
+	using AudioMixer_Ptr = std::shared_ptr<AudioMixer>;
+}
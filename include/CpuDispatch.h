@@ -0,0 +1,84 @@
+#ifndef CPUDISPATCH_H
+#define CPUDISPATCH_H
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/// Lets a kernel variant use instructions the rest of the binary isn't built for. Only call such a variant after checking the CPU has them
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define JP_X86_DISPATCH 1
+#define JP_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace jp {
+
+/// Instruction set levels our kernels come in, each one includes the ones before it
+enum class CpuLevel {
+    SCALAR,
+    SSE2,
+    SSE4_1,
+    AVX2,
+    AVX512
+};
+
+/// The best level this CPU (and OS) supports, detected once
+CpuLevel get_detected_cpu_level();
+
+/// The level the kernels are bound to. This is the detected level, unless it was lowered with set_cpu_level or the JAGUNMOLU_CPU_LEVEL environment variable (scalar, sse2, sse4.1, avx2 or avx512)
+CpuLevel get_cpu_level();
+
+/// Rebinds every kernel to this level, e.g. to test a code path on a newer machine. Levels the CPU doesn't support are refused and return false
+/// Only call this while no audio is being processed
+bool set_cpu_level(CpuLevel level);
+
+std::string get_cpu_level_name(CpuLevel level);
+bool parse_cpu_level(const std::string& name, CpuLevel& level);
+
+/// Every kernel that comes in per-ISA variants
+struct KernelTable {
+    void (*gain_f32)(float* samples, size_t count, float gain);
+    void (*gain_s16)(int16_t* samples, size_t count, float gain);
+    void (*s16_to_f32)(const int16_t* in, float* out, size_t count);
+    void (*f32_to_s16)(const float* in, int16_t* out, size_t count);
+    void (*normalize_u8_f32)(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels);
+};
+
+/// The kernels bound to the current level. The public kernels (gain_f32, s16_to_f32...) call through this
+const KernelTable& get_kernels();
+
+/// The kernels of a particular level, whether or not it's the current one. Levels above the detected one fall back to it
+KernelTable get_kernel_table(CpuLevel level);
+
+/// The variants behind the table, defined next to the public kernels
+namespace simd {
+void gain_f32_scalar(float* samples, size_t count, float gain);
+void gain_f32_sse2(float* samples, size_t count, float gain);
+void gain_f32_avx2(float* samples, size_t count, float gain);
+void gain_f32_avx512(float* samples, size_t count, float gain);
+
+void gain_s16_scalar(int16_t* samples, size_t count, float gain);
+void gain_s16_sse2(int16_t* samples, size_t count, float gain);
+void gain_s16_sse41(int16_t* samples, size_t count, float gain);
+void gain_s16_avx2(int16_t* samples, size_t count, float gain);
+void gain_s16_avx512(int16_t* samples, size_t count, float gain);
+
+void s16_to_f32_scalar(const int16_t* in, float* out, size_t count);
+void s16_to_f32_sse2(const int16_t* in, float* out, size_t count);
+void s16_to_f32_sse41(const int16_t* in, float* out, size_t count);
+void s16_to_f32_avx2(const int16_t* in, float* out, size_t count);
+void s16_to_f32_avx512(const int16_t* in, float* out, size_t count);
+
+void f32_to_s16_scalar(const float* in, int16_t* out, size_t count);
+void f32_to_s16_sse2(const float* in, int16_t* out, size_t count);
+void f32_to_s16_avx2(const float* in, int16_t* out, size_t count);
+void f32_to_s16_avx512(const float* in, int16_t* out, size_t count);
+
+void normalize_u8_f32_scalar(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels);
+void normalize_u8_f32_sse2(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels);
+void normalize_u8_f32_avx2(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels);
+void normalize_u8_f32_avx512(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels);
+}
+
+}
+
+#endif // CPUDISPATCH_H
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <vector>
+#include <atomic>
 #include "FFMpegPacket.h"
 #include "FFMpegFrame.h"
 
@@ -13,11 +14,39 @@ extern "C" {
 
 namespace jp {
     enum class DecoderType { DECODER_TYPE_AUDIO, DECODER_TYPE_VIDEO, DECODER_TYPE_SUBTITLE };
+    
+    /// How the codec spreads its work across threads. Frame threading decodes several frames at once (higher throughput, adds latency of one frame per thread), slice threading splits each frame (lower latency, only for codecs/streams that have slices)
+    enum class DecoderThreadType { THREAD_TYPE_AUTO, THREAD_TYPE_FRAME, THREAD_TYPE_SLICE, THREAD_TYPE_NONE };
+    
+    struct DecoderThreadingPolicy {
+        DecoderThreadType type{DecoderThreadType::THREAD_TYPE_AUTO};
+        
+        /// Number of threads the codec may use. 0 shares the cores between the decoders open with an automatic count at the time this one opens, counting itself
+        int thread_count{0};
+        
+        /// Upper bound for the automatic thread count. Codecs rarely scale past 16 threads
+        int max_threads{16};
+    };
+    
     struct DecoderParams {
         AVCodec* codec;
         AVCodecContext* codec_context;
     };
     
+    /// Decode time statistics of a single decoder. Times are in microseconds
+    struct DecoderStats {
+        uint64_t packets{0};
+        uint64_t frames{0};
+        uint64_t total_decode_time{0};
+        uint64_t max_decode_time{0};
+        
+        /// The thread count and type the codec actually ended up with after opening
+        int thread_count{1};
+        DecoderThreadType thread_type{DecoderThreadType::THREAD_TYPE_NONE};
+        
+        double get_average_decode_time() const { return packets ? (double)total_decode_time / packets : 0.0; }
+    };
+    
     class FFMpegDemuxer;
     
     class FFMpegDecoder {
@@ -34,6 +63,25 @@ namespace jp {
         /// Flush this decoder and returns its buffered frames
         std::vector<FFMpegFrame_Ptr> flush();
         
+        /// Decodes this packet and appends the decoded frames to the output buffer. Returns the number of frames appended
+        /// Reuse the same buffer between calls (clearing it when you're done with its frames) and the decode loop won't allocate
+        /// If the packet is rejected, the error string is set and the frames decoded until then are kept
+        int decode(const FFMpegPacket_Ptr& packet, FFMpegFrameBuffer& output);
+        
+        /// Decodes all the packets in order and appends the frames to the output buffer. Packets the decoder rejects are skipped. Returns the number of frames appended
+        int decode(const std::vector<FFMpegPacket_Ptr>& packets, FFMpegFrameBuffer& output);
+        
+        /// Flushes this decoder into the output buffer. Returns the number of frames appended
+        int flush(FFMpegFrameBuffer& output);
+        
+        /// Drops everything buffered in the codec (e.g. after a seek) so it can take packets again after a flush
+        void reset_buffers();
+        
+        /// Makes the codec skip everything but keyframes, so a jump through the file (thumbnails, scrubbing) only pays for the pictures it shows
+        void set_keyframes_only(bool enabled) {
+            if (params.codec_context) params.codec_context->skip_frame = enabled ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+        }
+        
         std::string get_error() { return error; }
         
         void release();
@@ -45,6 +93,17 @@ namespace jp {
         
         DecoderType getType() { return type; }
         
+        /// Returns a snapshot of the decode time statistics of this decoder
+        DecoderStats get_stats();
+        
+        void reset_stats();
+        
+        /// Applies the threading policy to the codec context. This has to be called before the codec is opened, libavcodec ignores it afterwards
+        static void apply_threading_policy(AVCodecContext* codec_context, const AVCodec* codec, const DecoderThreadingPolicy& policy);
+        
+        /// Decoders open with an automatic thread count, the ones the next automatic count shares the cores with
+        static int get_active_decoders() { return active_decoders; }
+        
     private:
         FFMpegDecoder(DecoderType type) : type(type) {}
         friend class FFMpegDemuxer;
@@ -52,6 +111,23 @@ namespace jp {
         std::string error;
         DecoderParams params{};
         bool finished{false};
+        
+        /// Counted in active_decoders until released, for decoders opened with an automatic thread count
+        bool counted_active{false};
+        void register_active();
+        
+        /// Sends the packet (nullptr flushes), draining frames whenever the decoder won't take more input. Returns the number of frames appended to output
+        int send_packet(AVPacket* packet, FFMpegFrameBuffer& output);
+        int receive_frames(FFMpegFrameBuffer& output);
+        void set_error(int code);
+        
+        void record_decode_time(uint64_t micros, size_t frames);
+        std::atomic<uint64_t> stat_packets{0};
+        std::atomic<uint64_t> stat_frames{0};
+        std::atomic<uint64_t> stat_total_time{0};
+        std::atomic<uint64_t> stat_max_time{0};
+        
+        static std::atomic<int> active_decoders;
     };
     
     using FFMpegDecoder_Ptr = std::shared_ptr<FFMpegDecoder>;
@@ -2,6 +2,7 @@
 #include "FFMpegDecoder.h"
 #include "FFMpegIOContext.h"
 #include "FFMpegStream.h"
+#include <map>
 
 extern "C" {
 	#include <libavformat/avformat.h>
@@ -10,12 +11,60 @@ extern "C" {
 }
 
 namespace jp {
+	using Metadata = std::map<std::string, std::string>;
+	
+	/// How much work opening a file does before the first packet. The defaults do what libavformat does on its own
+	struct StartupOptions {
+		/// Bytes avformat may read to find the format and stream parameters (probesize), and microseconds of media it may analyse (max_analyze_duration). 0 keeps libavformat's defaults of 5MB and 5s
+		int64_t probe_size{0};
+		int64_t analyze_duration{0};
+		/// Opens the audio and video decoders at the same time
+		bool parallel_decoders{false};
+		/// Starts demuxing with the packets read while probing, instead of seeking back to the start and reading them again
+		bool reuse_probe_packets{false};
+		
+		/// Bounded probing, parallel decoder opening and packet reuse. Streams whose parameters only show up deep into the file (e.g. the frame rate of some MPEG-TS captures) may come out less accurate
+		static StartupOptions fast() { return StartupOptions{256 * 1024, 500000, true, true}; }
+	};
+	
+	/// Microseconds spent in each phase of getting media from set_media to its first frames
+	struct StartupTimings {
+		/// avformat_open_input
+		uint64_t open_input{0};
+		/// avformat_find_stream_info
+		uint64_t find_stream_info{0};
+		/// Opening the decoders, both of them when they open in parallel
+		uint64_t open_decoders{0};
+		/// Building the player's filter graphs
+		uint64_t filter_graphs{0};
+		/// Initializing the outputs in set_media. Outputs initialized lazily on play aren't counted
+		uint64_t outputs{0};
+		/// From the start of set_media to the first decoded audio and video frames handed to the outputs, 0 until they are
+		uint64_t first_audio_frame{0};
+		uint64_t first_video_frame{0};
+		
+		/// Until the first frame of either stream
+		uint64_t get_time_to_first_frame() const {
+			if (!first_audio_frame || !first_video_frame) return first_audio_frame ? first_audio_frame : first_video_frame;
+			return first_audio_frame < first_video_frame ? first_audio_frame : first_video_frame;
+		}
+	};
+	
 	class FFMpegDemuxer {
 	public:
 		FFMpegDemuxer(FFMpegIOContext_Ptr& context);
 		~FFMpegDemuxer() { release(); }
 
 		bool initialize();
+		
+		/// Reads just enough of the file to know its streams, duration and tags, without opening a decoder. Only probe_size bytes are read
+		/// Stream info is only searched for when the headers leave a stream's parameters or the duration out (raw AAC, MPEG-TS), and within the same budget
+		/// A probed demuxer doesn't hand out packets, initialize it to play the file
+		bool probe(int64_t probe_size = 64 * 1024);
+		bool is_probed() { return probed; }
+		
+		/// The container's tags, plus the audio and video streams' tags the container doesn't have (e.g. Vorbis comments in Ogg)
+		Metadata get_metadata();
         bool has_audio() { return has_audio_stream; }
         bool has_video() { return has_video_stream; }
         FFMpegPacket_Ptr get_next_packet();
@@ -27,7 +76,8 @@ namespace jp {
         FFMpegStream_Ptr get_audio_stream() { return audio_stream; }
         FFMpegStream_Ptr get_video_stream() { return video_stream; }
         
-        uint64_t get_duration() { return format_context->duration; }
+        /// In AV_TIME_BASE units. Falls back to the longest stream when the container has no duration of its own
+        uint64_t get_duration();
         double get_global_time_base() { return 1.0 / (double)AV_TIME_BASE; }
         
         std::string get_error() { return error; }
@@ -37,6 +87,27 @@ namespace jp {
         /// Seek to specified position. This should be in seconds
         bool seek(uint64_t position);
         
+        /// Times of the video keyframes the demuxer knows about, in milliseconds from the start, in order. Containers with an index in their headers (MP4, Matroska cues) list them all after probe or initialize, others list none until they've been read through
+        std::vector<uint64_t> get_keyframe_times();
+        
+        /// Seeks the video stream to the keyframe nearest to this position (in milliseconds), whether it's before or after it
+        bool seek_to_keyframe(uint64_t position);
+        
+        /// Leaves the audio stream out: its decoder isn't opened and libavformat drops its packets. This takes effect the next time the demuxer is initialized
+        void set_audio_enabled(bool enabled) { audio_enabled = enabled; }
+        
+        /// Sets the threading policy for the decoder of this type. This takes effect the next time the demuxer is initialized
+        void set_threading_policy(DecoderType type, DecoderThreadingPolicy policy) {
+            if (type == DecoderType::DECODER_TYPE_AUDIO) audio_threading = policy;
+            else if (type == DecoderType::DECODER_TYPE_VIDEO) video_threading = policy;
+        }
+        
+        /// How the next initialize opens the file
+        void set_startup_options(StartupOptions options) { startup_options = options; }
+        
+        /// The parse phases of the last initialize
+        StartupTimings get_startup_timings() { return startup_timings; }
+        
         void reset() {
             if (!seek(0)) {
                 fprintf(stderr, "Demuxer couldn't seek back to the beginning...\n");
@@ -58,13 +129,34 @@ namespace jp {
         FFMpegDecoder_Ptr video_decoder{nullptr};
 		std::string error;
 		
+		StartupOptions startup_options{};
+		StartupTimings startup_timings{};
+		
+		/// Allocates the format context and reads the headers, from the start of the file
+		bool open_input(int64_t probe_size, int64_t analyze_duration);
+		
+		/// Picks the best audio and video streams. Returns false if there is neither
+		bool find_streams();
+		
+		/// Whether the headers gave the codec, sample rate and channels or dimensions of each stream and the duration, so avformat_find_stream_info can be skipped
+		bool has_stream_parameters();
+		
+		/// Opens the decoder for a stream. Returns false and sets error if it can't
+		static bool open_decoder(DecoderType type, FFMpegStream_Ptr& stream, AVCodec* codec, const DecoderThreadingPolicy& threading, AVCodecContext*& codec_context, FFMpegDecoder_Ptr& decoder, std::string& error);
+		
+        /// Audio codecs hardly benefit from threads, so audio stays single-threaded unless asked otherwise
+        DecoderThreadingPolicy audio_threading{DecoderThreadType::THREAD_TYPE_NONE, 1};
+        DecoderThreadingPolicy video_threading{};
+		
         FFMpegStream_Ptr audio_stream{nullptr};
         FFMpegStream_Ptr video_stream{nullptr};
         FFMpegStream_Ptr subtitle_stream{nullptr};
 		
+		bool audio_enabled{true};
 		bool has_audio_stream{false};
 		bool has_video_stream{false};
 		bool initialized{false};
+		bool probed{false};
 		bool finished{true};
 	};
 	
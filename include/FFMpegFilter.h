@@ -27,12 +27,14 @@ public:
     /// Gets a property from this filter. Returns an empty string if the filter's property does not have the specified key
     std::string get_property(std::string key);
     
-    ~FFMpegFilter() {
-        avfilter_free(filter_context);
-    }
+    /// The filter context is owned by the graph that allocated it, so it's freed with the graph
+    ~FFMpegFilter() = default;
     
     std::string get_name() { return name; }
     
+    /// Returns the properties joined the way avfilter_init_str expects them (key=value:key=value)
+    std::string get_arguments();
+    
 private:
     friend class FFMpegFilterGraph;
     FFMpegFilter();
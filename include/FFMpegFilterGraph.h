@@ -2,6 +2,12 @@
 #define FFMPEGFILTERGRAPH_H
 #include "FFMpegFilter.h"
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <map>
+#include <set>
 #include "FFMpegFrame.h"
 
 extern "C" {
@@ -11,9 +17,31 @@ extern "C" {
 
 namespace jp {
 
+/// How a filter graph spreads its work over threads
+struct FilterGraphThreading {
+    /// Threads each filter that supports slice threading (scale, yadif, most colour filters) splits a frame across. 0 uses every core, 1 keeps everything on the thread feeding the graph
+    int threads{0};
+    /// Runs the description and every filter in a graph of their own, so get_filter_timings can tell them apart. Frames are handed between the graphs by reference
+    /// Format conversions can't be merged across filters this way, so only turn it on to find out which filter is slow
+    bool per_filter_timing{false};
+};
+
+/// Time spent in one stage of a filter graph: the whole graph, or a single filter with per_filter_timing
+struct FilterTiming {
+    /// The filters in this stage, comma separated
+    std::string name{};
+    /// Frames that came out of this stage
+    uint64_t frames{0};
+    /// Microseconds spent adding frames to and pulling frames out of this stage
+    uint64_t total_time{0};
+    
+    double get_average_time() const { return frames ? (double) total_time / frames : 0; }
+};
+
 /// This class contains the filters for a particular filter graph
 /// After adding and removing filters from this class, make sure to call configure, so that the filters can be linked. You can also move the filters around the chain, so that it is processed as you'd like. Filters are linked according to the order of insertion into the list
 /// The filter graph always contain a filter at the beginning (the source filter) and at the end (the sink filter)
+/// Calling configure again after frames have started flowing rebuilds the graph on a background thread. The thread feeding the graph swaps the new graph in at the next frame, so playback doesn't stop
 class FFMpegFilterGraph
 {
 public:
@@ -43,59 +71,199 @@ public:
     FFMpegFilter_Ptr get_filter(std::string name);
     
     /// Configures the filter graph and links the filters. Returns true if the graph has been configured and false otherwise
+    /// If the graph has been configured before and the chain changed since, this starts a rebuild in the background (see reconfigure) and returns right away
     bool configure();
     
+    /// Rebuilds the graph from the current filter chain on a background thread. The new graph replaces the running one at the next frame boundary (see apply_pending_configuration)
+    /// Call this after changing filter properties, the chain itself is tracked by add_filter/remove_filter/move_filter. Returns false if the graph can't be rebuilt at all
+    bool reconfigure();
+    
+    /// Swaps in a graph built by reconfigure, if one is ready. Frames still inside the old graph are flushed out and returned by get_frame before the new graph's frames
+    /// This has to be called from the thread feeding the graph, between frames. add_frame does it for you. Returns true if a new graph was swapped in
+    bool apply_pending_configuration();
+    
+    /// Sets a filtergraph description (e.g. "yadif,scale=1280:-2" or "volume=0.5,aecho=0.8:0.9:40:0.4") to run on the frames. It is placed between the source and the filters added with add_filter. An empty string removes it
+    /// Like add_filter, this takes effect on the next configure. The description is parsed and validated there
+    bool set_description(std::string description);
+    
+    std::string get_description() { return description; }
+    
+    /// Sets how the graph is threaded. Audio graphs default to one thread, video graphs to every core. Like add_filter, this takes effect on the next configure
+    void set_threading(FilterGraphThreading threading);
+    
+    FilterGraphThreading get_threading() { return threading; }
+    
+    /// Time spent in each stage of the running graph since it was swapped in or the timings were reset. Safe to call from any thread
+    std::vector<FilterTiming> get_filter_timings();
+    void reset_filter_timings();
+    
+    /// Configured graphs are cached by their description, filter chain and input format. Opening another graph with the same setup takes a ready graph from the cache and skips parsing and format negotiation
+    /// A setup opened a second time gets a spare graph built in the background, which is rebuilt whenever it's taken. Setting the size to 0 disables the cache
+    static void set_cache_size(size_t size);
+    static void clear_cache();
+    
     /// Return the set error message by the filter graph
     std::string get_error() { return error; }
     
     FFMpegFilter_Ptr create_filter(std::string name);
     
-    bool get_frame(FFMpegFrame_Ptr frame) {
-        int error;
-        error = av_buffersink_get_frame(output->filter_context, frame->internal);
-        if (error < 0) {
-            if (error == AVERROR(EAGAIN)) {
-                fprintf(stderr, "Need more input frames to get this thing out!\n");
-            } else if (error == AVERROR_EOF) {
-                fprintf(stderr, "End of file from the filter graph!\n");
-            }
-        }
-        return error >= 0;
+    /// Gets the next filtered frame into this frame. Returns false if the graph needs more input or has reached the end
+    bool get_frame(FFMpegFrame_Ptr frame);
+    
+    size_t get_filters_size() {
+        std::lock_guard<std::mutex> lock(filters_mutex);
+        return filters.size();
+    }
+    std::vector<FFMpegFilter_Ptr> get_filters() {
+        std::lock_guard<std::mutex> lock(filters_mutex);
+        return filters;
     }
     
-    size_t get_filters_size() { return filters.size(); }
-    auto get_filters() { return filters; }
+    /// Adds a frame to the graph. This takes the frame's data, the frame is left blank. Passing nullptr signals the end of the stream
+    /// Frames added before the first configure are held back and go through the graph once it's configured, get_frame has nothing until then. After a failed configure, frames are rejected
+    bool add_frame(FFMpegFrame_Ptr frame);
     
-    bool add_frame(FFMpegFrame_Ptr frame) {
-        if (!initialized) return false;
-        auto value = frame ? frame->internal : nullptr;
-        return av_buffersrc_add_frame(input->filter_context, value) >= 0;
-    }
+    /// Whether the graph has no filter that touches the frames, so frames are handed from add_frame to get_frame by reference without going through libavfilter
+    bool is_passthrough() { return passthrough; }
     
-    bool send_command(FFMpegFilter_Ptr filter, std::string value) {
-        char response[2048];
-        int result;
-        if ((result = avfilter_graph_send_command(graph_internal, filter->get_name().c_str(), filter->get_name().c_str(), value.c_str(), response, 2048, 0) < 0)) {
-            fprintf(stderr, "Unable to send command! Response: %s", response);
-            fprintf(stderr, "AVERROR(ENOSYS)?: %s", av_make_error_string(response, 2048, result));
-        } else {
-            fprintf(stderr, "Sent command! Response: %s\n", response);
-        }
-        
-        return false;
-    }
+    /// Whether get_frame has frames ready without another add_frame, e.g. what a replaced graph was flushed of. The feeding thread should take these before adding more, or they stay queued up as extra latency
+    bool has_queued_frames() { return !queued_frames.empty(); }
+    
+    /// Sends a command to the filter in the running graph. Returns true if the filter took it
+    bool send_command(FFMpegFilter_Ptr filter, std::string value);
     
     bool is_initialized() { return initialized; }
 private:
     friend class FFMpegFilter;
     std::string error{};
+    /// Guards filters, the chain is changed by the user while get_filters may be called from anywhere
+    std::mutex filters_mutex{};
     std::vector<FFMpegFilter_Ptr> filters{};
     AVFilterGraph* graph_internal{nullptr};
     bool initialized{false};
     FFMpegFilter_Ptr input{nullptr};
     FFMpegFilter_Ptr output{nullptr};
     AVFilterLink* link{};
-    bool configured{false};
+    /// Written by the thread feeding the graph when it swaps a graph in, read by the thread configuring it
+    std::atomic<bool> configured{false};
+    
+    /// Whether every filter in the chain leaves frames untouched
+    bool is_identity_chain();
+    
+    std::atomic<bool> passthrough{false};
+    bool passthrough_eof{false};
+    
+    /// Frames waiting to come out of get_frame without going through libavfilter: everything in pass-through mode, and what was flushed out of a replaced graph
+    /// When a graph replaces pass-through mode, these have not been filtered yet and are fed into the new graph instead
+    std::deque<AVFrame*> queued_frames{};
+    std::vector<AVFrame*> free_frames{};
+    AVFrame* get_free_frame();
+    
+    /// Frames added before the first configure, waiting for the graph they go through. nullptr marks the end of the stream
+    std::deque<AVFrame*> held_frames{};
+    bool configure_failed{false};
+    
+    /// Hands the held back frames out as they are, for pass-through mode
+    void pass_held_frames();
+    
+    /// Feeds frames that were waiting (held back, or queued in pass-through mode) into the graph just swapped in. Returns false and sets error if the graph rejected any
+    bool feed_waiting_frames(std::deque<AVFrame*>& frames);
+    
+    /// Has the chain changed since the graph was last built?
+    std::atomic<bool> dirty{false};
+    
+    std::string description{};
+    FilterGraphThreading threading{};
+    
+    /// A filter in the chain being rebuilt, with its properties copied when the rebuild started
+    struct FilterTemplate {
+        FFMpegFilter_Ptr filter;
+        std::string arguments;
+    };
+    
+    /// Everything needed to build this graph, copied so it can be built on another thread
+    struct GraphTemplate {
+        const AVFilter* input_filter{nullptr};
+        std::string input_name{};
+        std::string input_arguments{};
+        const AVFilter* output_filter{nullptr};
+        std::string output_name{};
+        std::string output_arguments{};
+        std::string description{};
+        std::vector<FilterTemplate> chain{};
+        FilterGraphThreading threading{};
+        
+        /// Graphs built from templates with the same key are interchangeable
+        std::string get_key() const;
+    };
+    GraphTemplate make_template();
+    
+    /// One libavfilter graph. A graph normally runs as a single stage, with per_filter_timing every filter gets its own, fed from the previous stage's sink
+    struct FilterStage {
+        AVFilterGraph* graph{nullptr};
+        AVFilterContext* input{nullptr};
+        AVFilterContext* output{nullptr};
+        std::string name{};
+    };
+    
+    /// A fully configured graph waiting to be swapped in. No stages means switching to pass-through mode
+    struct PendingGraph {
+        std::vector<FilterStage> stages{};
+        std::vector<std::pair<FFMpegFilter_Ptr, AVFilterContext*>> filters{};
+        /// The first libavfilter error building it ran into, 0 if there was none
+        int result{0};
+    };
+    
+    /// The running stages, first to last
+    std::vector<FilterStage> stages{};
+    
+    struct StageTimer {
+        std::atomic<uint64_t> frames{0};
+        std::atomic<uint64_t> total_time{0};
+    };
+    /// Guards stages and stage_timers against get_filter_timings and send_command while a graph is swapped in
+    std::mutex timing_mutex{};
+    std::unique_ptr<StageTimer[]> stage_timers{};
+    
+    /// Pulls a frame out of a stage, feeding it from the stages before it as needed
+    int pull_frame(size_t stage, AVFrame* frame);
+    
+    /// Frees the stages' graphs, along with every filter context in them
+    static void free_stages(std::vector<FilterStage>& stages);
+    
+    /// Builds one stage running the description (if any) and chain[first, last)
+    static bool build_stage(const GraphTemplate& graph_template, const std::string& input_arguments, const std::string& output_arguments, bool with_description, size_t first, size_t last, PendingGraph* pending);
+    
+    /// The source arguments for a stage fed by this sink
+    static std::string get_stage_arguments(AVFilterContext* sink, bool video);
+    
+    std::thread builder{};
+    std::atomic<PendingGraph*> pending_graph{nullptr};
+    /// Returns null if it can't be built, with the libavfilter error in result
+    static PendingGraph* build_graph(const GraphTemplate& graph_template, int& result);
+    void publish_graph(PendingGraph* graph);
+    static void free_pending_graph(PendingGraph* graph);
+    
+    /// Takes a graph for this template from the cache, or builds one if there is none
+    /// restock says whether a spare should be prepared now: the cached one was taken, or this setup was built not long ago already
+    static PendingGraph* acquire_graph(const GraphTemplate& graph_template, bool& restock);
+    
+    /// Builds a spare graph for this template into the cache, unless there is one already
+    static void prepare_cached_graph(const GraphTemplate& graph_template);
+    
+    static std::mutex cache_mutex;
+    static std::map<std::string, PendingGraph*> graph_cache;
+    /// Cached keys from oldest to newest, the oldest goes first when the cache is full
+    static std::deque<std::string> cache_order;
+    /// Templates libavfilter rejected as invalid when parsing or configuring them
+    static std::set<std::string> invalid_templates;
+    /// Keys built without a spare lately, oldest first and at most cache_size of them. A key that comes back gets a spare from then on
+    static std::deque<std::string> missed_templates;
+    static size_t cache_size;
+    
+    /// The graph new filters are allocated in, until the first configure. Filters created after that get no context of their own, FFMpegFilter::initialize checks their arguments in a scratch graph
+    /// Nothing but the graphs built from templates holds a filter context once frames may be flowing, so there's nothing to clean up after a swap
+    AVFilterGraph* get_allocation_graph();
 };
 
 using FFMpegFilterGraph_Ptr = std::shared_ptr<FFMpegFilterGraph>;
@@ -1,12 +1,15 @@
 #pragma once
 #include "IFrame.h"
 #include <memory>
+#include <vector>
 
 namespace jp {
     class FFMpegDecoder;
     class FFMpegResampler;
     class FFMpegFilterGraph;
     class FFMpegMediaPlayer;
+    class FFMpegFrameBuffer;
+    class FrameReader;
     class FFMpegFrame : public IFrame {
     public:
         int get_width() { return internal->width; }
@@ -57,14 +60,65 @@ namespace jp {
         /// Whether the frame is a valid frame
         bool is_valid() { return internal != nullptr; }
         
+        /// Makes sure nobody else shares this frame's data, copying it if needed, so it can be modified in place
+        bool make_writable() { return av_frame_make_writable(internal) >= 0; }
+        
     private:
         FFMpegFrame() { internal = av_frame_alloc(); }
         friend class FFMpegDecoder;
         friend class FFMpegResampler;
         friend class FFMpegFilterGraph;
         friend class FFMpegMediaPlayer;
+        friend class FFMpegFrameBuffer;
+        friend class FrameReader;
         AVFrame* internal;
     };
     
     using FFMpegFrame_Ptr = std::shared_ptr<FFMpegFrame>;
+    
+    /// A reusable list of frames for the decoders to write into. The frames stay allocated between calls, so a decode loop reusing the same buffer does not allocate once it has warmed up
+    /// Only the first size() frames are valid. Clearing the buffer keeps the frames around for the next call
+    /// If you keep a frame returned from this buffer (i.e. its pointer is still held somewhere when the slot is reused), the buffer leaves it alone and allocates a new frame for that slot instead
+    class FFMpegFrameBuffer {
+    public:
+        FFMpegFrameBuffer() = default;
+        
+        /// Preallocates capacity frames
+        explicit FFMpegFrameBuffer(size_t capacity) { reserve(capacity); }
+        
+        void reserve(size_t capacity) {
+            while (frames.size() < capacity) frames.emplace_back(new FFMpegFrame());
+        }
+        
+        /// Number of valid frames in this buffer
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        
+        /// Number of frames allocated by this buffer
+        size_t capacity() const { return frames.size(); }
+        
+        const FFMpegFrame_Ptr& operator[](size_t index) const { return frames[index]; }
+        
+        /// Marks all frames as invalid. The frame data is released lazily when the slot gets reused
+        void clear() { count = 0; }
+        
+        /// Returns the next free frame, ready to be written into, and counts it as valid. Call discard_last if nothing was written into it after all
+        AVFrame* next_frame() {
+            if (count == frames.size()) {
+                frames.emplace_back(new FFMpegFrame());
+            } else if (frames[count].use_count() > 1) {
+                // Someone still holds this frame, leave it to them
+                frames[count].reset(new FFMpegFrame());
+            } else {
+                av_frame_unref(frames[count]->internal);
+            }
+            return frames[count++]->internal;
+        }
+        
+        void discard_last() { if (count) av_frame_unref(frames[--count]->internal); }
+        
+    private:
+        std::vector<FFMpegFrame_Ptr> frames{};
+        size_t count{0};
+    };
 }
@@ -13,7 +13,8 @@ namespace jp {
     class FFMpegIOContext {
     public:
     	FFMpegIOContext() = default;
-        ~FFMpegIOContext() { avio_context_free(&io_context); }
+        /// Closes the file too. Freeing just the AVIOContext would leave its file descriptor open
+        ~FFMpegIOContext() { avio_closep(&io_context); }
     	/// Opens the file path with the specified open mode
         bool open(std::string path, OpenMode open_mode);
         
@@ -46,7 +47,7 @@ namespace jp {
     	AVIOContext* get_context_internal() { return io_context; }
     
     private:
-    	AVIOContext* io_context;
+    	AVIOContext* io_context{nullptr};
     	std::string error{};
     	std::string path;
     	
@@ -7,11 +7,47 @@ extern "C" {
 }
 
 namespace jp {
-    using Metadata = std::map<std::string, std::string>;
+	/// Everything probe finds out about a file, copied out so the file can be closed
+	struct MediaSummary {
+		std::string path{};
+		/// Milliseconds
+		uint64_t duration{0};
+		uint64_t bitrate{0};
+		
+		bool has_audio{false};
+		int sample_rate{0};
+		int channels{0};
+		uint64_t channel_layout{0};
+		/// Only known once a decoder has run or the headers give it (e.g. PCM), otherwise AV_SAMPLE_FMT_NONE after probe
+		AVSampleFormat sample_format{AV_SAMPLE_FMT_NONE};
+		
+		bool has_video{false};
+		int width{0};
+		int height{0};
+		/// Likewise AV_PIX_FMT_NONE after probe for most compressed codecs
+		AVPixelFormat pixel_format{AV_PIX_FMT_NONE};
+		double frame_rate{0};
+		/// The video is a still picture, e.g. an album cover
+		bool attached_pic{false};
+		/// Keyframes in the video stream's index, 0 if the headers have none
+		int keyframes{0};
+		
+		Metadata metadata{};
+	};
+	
 	class FFMpegMedia {
 	public:
 		FFMpegMedia(FFMpegIOContext_Ptr& context);
 		bool parse();
+		
+		/// Fills in the duration, stream info and metadata from the container headers, without opening any decoder. Meant for library scans
+		/// The getters below work on probed media. To play it, parse it (the player does this itself for media that isn't parsed)
+		bool probe(int64_t probe_size = 64 * 1024);
+		
+		bool is_probed() const { return probed; }
+		
+		/// Copies out what probe or parse found. Empty if neither has succeeded
+		MediaSummary get_summary();
 		uint64_t get_sample_rate();
         uint64_t get_bitrate();
         uint64_t get_channels();
@@ -84,6 +120,20 @@ namespace jp {
 		
 		std::string get_error() { return error; }
 		
+		/// How parse opens the file (probing limits, parallel decoder opening). Call this before parse
+		void set_startup_options(StartupOptions options) { startup_options = options; }
+		
+		/// How long the phases of the last parse took. Only the parse phases are filled in
+		StartupTimings get_startup_timings() { return demuxer ? demuxer->get_startup_timings() : StartupTimings{}; }
+		
+		/// Leaves the audio stream out of parse, for users that only want pictures. Call this before parse
+		void set_audio_enabled(bool enabled) { audio_enabled = enabled; }
+		
+		/// Sets the threading policy used when opening the decoder of this type. Call this before parse
+		void set_threading_policy(DecoderType type, DecoderThreadingPolicy policy) {
+		    threading_policies[type] = policy;
+		}
+		
     private:
         FFMpegIOContext_Ptr context{nullptr};
         FFMpegDemuxer_Ptr demuxer{nullptr};
@@ -91,8 +141,12 @@ namespace jp {
         std::string path{};
         uint64_t duration{};
         bool parsed{};
+        bool probed{};
         std::string error;
         Metadata metadata{};
+        std::map<DecoderType, DecoderThreadingPolicy> threading_policies{};
+        StartupOptions startup_options{};
+        bool audio_enabled{true};
 	};
 	
 	using FFMpegMedia_Ptr = std::shared_ptr<FFMpegMedia>;
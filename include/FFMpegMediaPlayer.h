@@ -9,7 +9,16 @@
 #include <algorithm>
 #include <mutex>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <chrono>
 #include "SubtitleManager.h"
+#include "AudioGain.h"
+#include "FFMpegResampler.h"
+
+extern "C" {
+#include <libavutil/audio_fifo.h>
+}
 
 namespace jp {
     enum class MediaResult { RESULT_SUCCESS, RESULT_ERROR };
@@ -40,34 +49,91 @@ namespace jp {
         bool is_released() const { return released; }
         
         /// Sets the volume. The current volume is always 1.0 when starting
-        void set_volume(double volume) {
-            auto filters = filter_graph->get_filters();
-            std::for_each(filters.begin(), filters.end(), [&](FFMpegFilter_Ptr filter) {
-                if (filter->get_name() == "volume") {
-                    filter->set_property("volume", std::to_string(volume));
-                    filter_graph->send_command(filter, std::to_string(volume));
-                }
-            });
+        /// This is lock-free and can be called from any thread, the audio thread ramps to the new volume so it doesn't click
+        void set_volume(double volume) { audio_gain.set_gain(volume); }
+        
+        double get_volume() { return audio_gain.get_gain(); }
+        
+        /// The filter graphs of the current media. Filters added to them while playing take effect after calling configure on the graph, without interrupting playback
+        FFMpegFilterGraph_Ptr get_audio_filter_graph() { return filter_graph; }
+        FFMpegFilterGraph_Ptr get_video_filter_graph() { return video_filter_graph; }
+        
+        /// Filtergraph descriptions applied to the audio and video of every media set after this call (e.g. "yadif,hflip"). Use the filter graph getters above to change the current media
+        void set_audio_filter_description(std::string description) { audio_filter_description = description; }
+        void set_video_filter_description(std::string description) { video_filter_description = description; }
+        
+        /// Threading of the video filter graph of every media set after this call. Filters use every core by default
+        void set_video_filter_threading(FilterGraphThreading threading) { video_filter_threading = threading; }
+        
+        bool has_media() { return get_current_media() != nullptr; }
+        
+        /// Queues media to play after the current one. Near the end of the current media, the next one is parsed and its first audio frames decoded on a background thread
+        /// Media with audio following media with audio is spliced in without a gap, reusing the outputs (and the audio filter graph when the audio formats match). Media with video (other than cover art) needs its outputs set up again, see set_next_media_callback
+        void enqueue_media(FFMpegMedia_Ptr media);
+        
+        /// Called on the playlist thread once the current media has ended and the next one can't be spliced in. The outputs (e.g. an SDL window) have to be set up again on the thread that owns them,
+        /// so the callback only hands the switch over to that thread (e.g. with SDL_PushEvent), which then calls play_next
+        void set_next_media_callback(std::function<void()> callback) { next_media_callback = callback; }
+        
+        /// Switches to the media next_media_callback announced, with set_media and play. Call it on the thread that set up the outputs
+        MediaResult play_next();
+        
+        /// Drops the queued media, including one already prepared but not playing yet
+        void clear_playlist();
+        
+        /// Media waiting in the playlist, not counting one already prepared
+        size_t get_playlist_size();
+        
+        /// How long before the end of the current media the next one is prepared, in milliseconds
+        void set_preload_time(uint64_t millis) { preload_time = millis; }
+        
+        /// Fades spliced media in over the last millis milliseconds of the media before it, instead of starting it when that one ends. 0 (the default) splices without a gap or an overlap
+        /// Only the overlap is decoded ahead, so memory use grows with the fade length, not the media. Outputs that don't take packed S16 or float audio get a plain splice
+        /// The fade starts once the demuxer has reached the end of the media, so it ends with its audio even when the reported duration is off. A fade longer than the packets queued ahead gets shorter
+        void set_crossfade(uint64_t millis) { crossfade_time = millis; }
+        uint64_t get_crossfade() { return crossfade_time; }
+        
+        /// Fast start gets to the first frame sooner: media parsed by set_media probes less of the file and opens its decoders in parallel (see StartupOptions::fast), the video filter graph builds while the audio device opens, and the video output is initialized on the first play
+        /// A first frame later than budget milliseconds after set_media is logged
+        void set_fast_start(bool enabled, uint64_t budget = 250) {
+            fast_start = enabled;
+            startup_budget = budget;
         }
+        bool is_fast_start() { return fast_start; }
         
-        bool has_media() { return current_media != nullptr; }
+        /// How long the phases of the last set_media took, including parsing if the media wasn't parsed yet. The first frame times fill in once decoding gets there
+        StartupTimings get_startup_timings();
+        
+        /// Called when media from the playlist starts playing. Spliced media is announced from the audio thread, keep the callback short
+        void set_media_changed_callback(std::function<void(FFMpegMedia_Ptr)> callback) { media_changed_callback = callback; }
         
         /// Returns the current playback position in milliseconds
         uint64_t get_position() const { return current_position; }
         
         uint64_t get_duration() const {
-            if (!current_media) return 0;
-            return current_media->get_duration();
+            auto media = std::atomic_load(&current_media);
+            if (!media) return 0;
+            return media->get_duration();
         }
         
-        uint64_t get_sample_rate() { return current_media->get_sample_rate(); }
-        uint64_t get_channels() { return current_media->get_channels(); }
-        uint64_t get_channel_layout() { return current_media->get_channel_layout(); }
+        uint64_t get_sample_rate() { return get_current_media()->get_sample_rate(); }
+        uint64_t get_channels() { return get_current_media()->get_channels(); }
+        uint64_t get_channel_layout() { return get_current_media()->get_channel_layout(); }
         
         uint64_t get_last_audio_pts() { return last_audio_pts; }
+        
+        /// The media time in milliseconds being heard right now, from the audio output's clock. Falls back to the last audio pts for outputs that don't keep one
+        double get_audio_clock() {
+            if (audio_output) {
+                double clock = audio_output->get_clock();
+                if (clock >= 0) return clock;
+            }
+            return last_audio_pts;
+        }
         uint64_t get_last_video_pts() { return last_video_pts; }
         
-        FFMpegMedia_Ptr get_current_media() { return current_media; }
+        /// Safe to call from any thread, the audio thread moves on to the next media when splicing
+        FFMpegMedia_Ptr get_current_media() { return std::atomic_load(&current_media); }
         
         void set_last_audio_pts(uint64_t pts) {
             last_audio_pts = pts;
@@ -75,7 +141,7 @@ namespace jp {
         
         void set_last_video_pts(uint64_t pts) {
             last_video_pts = pts;
-            current_position = pts * current_media->get_demuxer()->get_video_stream()->get_time_base() * 1000;
+            current_position = pts * get_current_media()->get_demuxer()->get_video_stream()->get_time_base() * 1000;
         }
         
         void start_demuxer_thread();
@@ -169,7 +235,10 @@ namespace jp {
         /**
          * @brief Destroy the FFMpegMediaPlayer object (Am I really supposed to document a destructor?)
          */
-        ~FFMpegMediaPlayer() { release(); }
+        ~FFMpegMediaPlayer() {
+            release();
+            av_audio_fifo_free(fade_fifo);
+        }
     private:
         /**
          * @brief are we currently playing media?
@@ -193,9 +262,25 @@ namespace jp {
          */
         std::thread demuxer_thread;
         /**
-         * @brief Audio frame queue (contains uncompressed audio frames)
+         * @brief Decoded audio frames not handed to the output yet. Reused between packets so decoding doesn't allocate
+         */
+        FFMpegFrameBuffer audio_decoded{8};
+        size_t audio_decoded_index{0};
+        
+        /**
+         * @brief Set by seek_to, the audio thread drops what it had decoded, a fade and a splice in progress before taking the next frame. Only the audio thread touches those
          */
-        moodycamel::ConcurrentQueue<FFMpegFrame_Ptr> audio_frame_queue;
+        std::atomic_bool audio_clear{false};
+        
+        /**
+         * @brief Audio thread only: the timestamp of the last decoded frame put into the filter graph
+         */
+        int64_t audio_pts{0};
+        
+        /**
+         * @brief Reusable buffer for the decoded video frames
+         */
+        FFMpegFrameBuffer video_decoded{4};
         
         /**
          * @brief Audio packet queue (contains compressed audio frames)
@@ -208,7 +293,7 @@ namespace jp {
         moodycamel::ConcurrentQueue<FFMpegPacket_Ptr> video_packet_queue{200};
         
         /**
-         * @brief Current media played by this media player
+         * @brief Current media played by this media player. Replaced by the audio thread when splicing, so only ever stored and loaded with std::atomic_store and std::atomic_load
          */
         FFMpegMedia_Ptr current_media{nullptr};
 
@@ -222,6 +307,28 @@ namespace jp {
          */
         FFMpegFilterGraph_Ptr filter_graph{nullptr};
 
+        /**
+         * @brief User filtergraph descriptions for the audio and video filter graphs
+         */
+        std::string audio_filter_description{};
+        std::string video_filter_description{};
+
+        /**
+         * @brief Threading policy for the video filter graph
+         */
+        FilterGraphThreading video_filter_threading{};
+
+        /**
+         * @brief Converts the filtered audio to the output's sample format when nothing else needs changing, and the frame it converts into
+         */
+        FFMpegResampler_Ptr audio_converter{nullptr};
+        FFMpegFrame_Ptr audio_converted{nullptr};
+
+        /**
+         * @brief Applies the volume to the filtered audio
+         */
+        AudioGain audio_gain{};
+
         /**
          * @brief The video filter graph
          */
@@ -241,6 +348,11 @@ namespace jp {
          * @brief Do we need to flush the buffered data?
          */
         std::atomic_bool demuxer_clear{false};
+        
+        /**
+         * @brief Stops the demuxer thread without releasing the player, so set_media can swap the media under it. The outputs' threads stop waiting for packets while it's set
+         */
+        std::atomic_bool demuxer_quit{false};
 
         /**
          * @brief Are we buffering?
@@ -285,6 +397,180 @@ namespace jp {
          * @brief Responsible for parsing and managing subtitles
          */
         std::shared_ptr<SubtitleManager> subtitle_manager{new SubtitleManager};
+        
+        /**
+         * @brief Fast start mode, and the time to first frame it aims for in milliseconds
+         */
+        bool fast_start{false};
+        uint64_t startup_budget{250};
+        
+        /**
+         * @brief The phases of the last set_media, when it started, and when the first frames came out (in microseconds after that, 0 until they do)
+         */
+        StartupTimings startup_timings{};
+        std::chrono::steady_clock::time_point startup_start{};
+        std::atomic<uint64_t> first_audio_frame{0};
+        std::atomic<uint64_t> first_video_frame{0};
+        
+        /**
+         * @brief Records the time to this first frame, unless it has been recorded since the last set_media
+         */
+        void record_first_frame(std::atomic<uint64_t>& first_frame);
+        
+        /**
+         * @brief Builds the video filter graph for this media. Only touches video_filter_graph, so it can run alongside the audio setup
+         */
+        bool build_video_graph(FFMpegMedia_Ptr media, std::string& error);
+        
+        /**
+         * @brief The format the audio output accepted, which the audio of every media is converted to
+         */
+        AudioFormat audio_output_format{};
+        
+        /**
+         * @brief The media the demuxer thread reads from. It moves on to the next media ahead of the decoders when splicing
+         */
+        FFMpegMedia_Ptr demux_media{nullptr};
+        
+        /**
+         * @brief The media the video decoder and filter graph belong to. Video packets of spliced media are dropped
+         */
+        FFMpegMedia_Ptr video_media{nullptr};
+        
+        /**
+         * @brief The next media, parsed and with its first audio frames decoded, ready to take over from the current one
+         */
+        struct PreparedMedia {
+            FFMpegMedia_Ptr media{nullptr};
+            /// Whether the audio thread can switch to it without a gap. Otherwise the playlist thread calls set_media once the current media ends
+            bool spliceable{false};
+            FFMpegDecoder_Ptr audio_decoder{nullptr};
+            /// Null keeps the running graph and converter, the audio formats match
+            FFMpegFilterGraph_Ptr filter_graph{nullptr};
+            FFMpegResampler_Ptr audio_converter{nullptr};
+            /// The first decoded frames, not filtered yet. With a crossfade, this covers the overlap
+            FFMpegFrameBuffer decoded{};
+            /// Frames the crossfade has already put through filter_graph
+            size_t decoded_index{0};
+            /// Where the audio of the media before it ends, in milliseconds. Set by the demuxer thread when it takes this to splice it in, 0 if the packets had no timestamps
+            double previous_end{0};
+        };
+        using PreparedMedia_Ptr = std::shared_ptr<PreparedMedia>;
+        
+        /**
+         * @brief The playlist, and the thread preparing its media
+         */
+        std::deque<FFMpegMedia_Ptr> playlist{};
+        std::mutex playlist_mutex{};
+        std::condition_variable playlist_condition{};
+        std::thread playlist_thread;
+        uint64_t preload_time{10000};
+        /// Bumped by clear_playlist, so media being prepared at that moment is dropped
+        uint64_t playlist_generation{0};
+        std::function<void(FFMpegMedia_Ptr)> media_changed_callback{};
+        std::function<void()> next_media_callback{};
+        
+        /**
+         * @brief Media that can't be spliced in, waiting for the owner's thread to switch to it with play_next
+         */
+        FFMpegMedia_Ptr next_media{nullptr};
+        
+        /**
+         * @brief Prepared by the playlist thread, until the demuxer thread takes it to splice it in
+         */
+        PreparedMedia_Ptr prepared_media{nullptr};
+        
+        /**
+         * @brief Taken by the demuxer thread, until the audio thread reaches the end of the current media and switches to it
+         */
+        PreparedMedia_Ptr splicing_media{nullptr};
+        
+        /**
+         * @brief Demuxer thread only (or under demuxer_wake_mutex): where the audio demuxed so far of demux_media ends, in milliseconds
+         */
+        double demuxed_audio_end{0};
+        
+        /**
+         * @brief Audio thread only: the decoder has been flushed at the end marker, switch once its frames are out
+         */
+        bool splice_pending{false};
+        
+        /**
+         * @brief Audio thread only: what the replaced filter graph still held at a splice, played before the next media
+         */
+        std::deque<FFMpegFrame_Ptr> audio_tail{};
+        
+        /**
+         * @brief The crossfade length in milliseconds
+         */
+        std::atomic<uint64_t> crossfade_time{0};
+        
+        /**
+         * @brief Audio thread only: the media fading in while the current one still plays, its filtered audio waiting to be mixed in, and how far into the fade we are (in sample frames)
+         * Always splicing_media, the fade only starts once the demuxer knows where the current media's audio ends. It carries on after the splice for whatever the filter graph still held back
+         */
+        PreparedMedia_Ptr fading_media{nullptr};
+        AVAudioFifo* fade_fifo{nullptr};
+        FFMpegFrame_Ptr fade_converted{nullptr};
+        std::vector<uint8_t> fade_buffer{};
+        int64_t fade_position{0};
+        int64_t fade_length{0};
+        
+        /**
+         * @brief Audio thread only: mixes the fading in media into this filtered frame of the current media, or continues fading in the current media after a splice
+         */
+        void crossfade(FFMpegFrame_Ptr& frame, double pts);
+        
+        /**
+         * @brief Audio thread only: puts the next decoded frame of the fading in media through its graph into fade_fifo. Returns false once the overlap has run out
+         */
+        bool fill_fade_fifo();
+        
+        /**
+         * @brief Audio thread only: drops a fade in progress, after a seek
+         */
+        void cancel_crossfade();
+        
+        /**
+         * @brief Set once the current media has played out
+         */
+        std::atomic_bool end_of_media{false};
+        
+        /**
+         * @brief Builds the audio filter graph converting this media to the output's format. When only the sample format differs, the graph passes frames through and converter does the conversion
+         */
+        bool build_audio_graph(FFMpegMedia_Ptr media, FFMpegFilterGraph_Ptr& graph, FFMpegResampler_Ptr& converter);
+        
+        static AudioFormat get_source_format(FFMpegMedia_Ptr media);
+        
+        /**
+         * @brief Stops everything reading the current media: the demuxer thread, then the outputs' threads (through release). set_media restarts them for the new media
+         */
+        void stop_playback_threads(FFMpegMedia_Ptr media);
+        
+        void playlist_func();
+        
+        /**
+         * @brief Parses the media and decodes its first audio frames. Returns null if it can't be played at all
+         */
+        PreparedMedia_Ptr prepare_media(FFMpegMedia_Ptr media);
+        
+        /**
+         * @brief Called by the demuxer thread at the end of its media. Marks the end in the audio queue and moves on to the prepared media, if it can be spliced in
+         */
+        bool splice_next_media(std::unique_lock<std::mutex>& lock);
+        
+        /**
+         * @brief Called by the audio thread once the current media is fully decoded, switches the audio path over to the spliced media
+         * Returns false, leaving the splice for the next frame, while seek_to holds splice_mutex
+         */
+        bool splice_prepared_media();
+        
+        /**
+         * @brief Held by seek_to, and by the audio thread from taking splicing_media until current_media is the spliced media, so a seek never lands on the media being switched away from
+         * The audio thread only ever tries to take it
+         */
+        std::mutex splice_mutex{};
     };
     
     using FFMpegMediaPlayer_Ptr = std::shared_ptr<FFMpegMediaPlayer>;
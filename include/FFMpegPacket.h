@@ -34,6 +34,9 @@ namespace jp {
         bool is_video_packet() { return video_packet; }
         bool is_subtitle_packet() { return subtitle_packet; }
         
+        /// Whether the packet starts a keyframe, which decodes without any packet before it
+        bool is_keyframe() { return internal->flags & AV_PKT_FLAG_KEY; }
+        
         uint64_t get_bytes() { return internal->size; }
         
         uint8_t* get_data() { return internal->data; }
@@ -8,9 +8,13 @@ extern "C" {
 
 #include <memory>
 #include "FFMpegFrame.h"
+#include "SampleConversion.h"
 
 namespace jp {
 
+/// Converts audio between sample rates, channel layouts and sample formats
+/// Conversions that keep the rate and layout and only change the sample format (e.g. decoder FLTP to device S16) skip swresample and run the kernel get_sample_converter picks for the stream
+/// Everything else goes through swresample, which may hold samples back between calls (see get_delay). Pass nullptr at the end of the stream to flush them out
 class FFMpegResampler
 {
 public:
@@ -24,10 +28,31 @@ public:
     
     /// Resamples the given frame and returns the resampled frame
     /// Note that this will return nullptr when invalid frames are provided
+    /// This allocates a new frame on every call, use the overload taking an output frame in playback loops
     FFMpegFrame_Ptr resample(FFMpegFrame_Ptr& frame);
+    
+    /// Resamples the given frame into output, reusing output's buffers when they're big enough. A null output gets a new frame. Passing a null frame flushes the samples swresample held back
+    /// Returns the number of samples written (0 when there was nothing to flush) or a negative AVERROR
+    int resample(const FFMpegFrame_Ptr& frame, FFMpegFrame_Ptr& output);
+    
+    /// Converts in_samples samples from input into output, which must have room for out_capacity samples (see get_max_output_samples). Planar formats take one pointer per channel
+    /// A null input flushes. Returns the number of samples written or a negative AVERROR
+    int convert(uint8_t** output, int out_capacity, const uint8_t** input, int in_samples);
+    
+    /// The most samples converting in_samples more can write
+    int get_max_output_samples(int in_samples);
+    
+    /// Samples, at the output rate, held back by swresample. Always 0 on the fast path
+    int64_t get_delay();
+    
+    /// Drops the samples held back, e.g. after a seek
+    void reset();
 
     bool is_initialized() { return initialized; }
     
+    /// Whether this conversion skips swresample
+    bool is_fast_path() { return fast_path; }
+    
 private:
     SwrContext* resampler_context{};
 	int64_t in_channel_layout{0};
@@ -36,9 +61,16 @@ private:
     int64_t out_channel_layout{0};
     int64_t out_sample_rate{0};
     AVSampleFormat out_sample_fmt{};
+    int channels{0};
 
     bool initialized{false};
+    bool fast_path{false};
+    
+    /// The kernel used on the fast path, picked once in initialize
+    SampleConverter converter{nullptr};
     
+    /// Makes sure output can take samples samples in the output format
+    bool prepare_output(FFMpegFrame_Ptr& output, int samples);
 };
 
 using FFMpegResampler_Ptr = std::shared_ptr<FFMpegResampler>;
@@ -15,6 +15,9 @@ namespace jp {
         
         int get_number_of_frames() { return internal->nb_frames; }
         
+        /// Timestamp of the first frame, in the time_base. AV_NOPTS_VALUE if unknown
+        int64_t get_start_time() { return internal->start_time; }
+        
         /// This value must be multiplied by the time_base to get the duration in seconds
         int get_duration() { return internal->duration; }
         
@@ -45,6 +48,15 @@ namespace jp {
         
         bool is_attached_pic() { return attached_pic; }
         
+        /// Keyframes in the seek index the demuxer has built so far. Containers with an index in their headers (MP4, Matroska cues) have it all after opening
+        int get_keyframe_count() {
+            int count = 0;
+            for (int i = 0; i < internal->nb_index_entries; i++) {
+                if (internal->index_entries[i].flags & AVINDEX_KEYFRAME) count++;
+            }
+            return count;
+        }
+        
     private:
         friend class FFMpegDemuxer;
         FFMpegStream() = default;
@@ -0,0 +1,87 @@
+#pragma once
+#include "FrameReader.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace jp {
+
+	/// Turns count bytes into floats, each multiplied by its channel's scale plus its channel's bias. The channels are interleaved (1 for a plane), at most 4, and count is a multiple of them
+	void normalize_u8_f32(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels);
+
+	enum class TensorLayout { TENSOR_LAYOUT_NCHW, TENSOR_LAYOUT_NHWC };
+	enum class TensorType { TENSOR_TYPE_UINT8, TENSOR_TYPE_FLOAT32 };
+
+	struct TensorOptions {
+		/// Frames in a batch, and the size each is resized to. Pictures are stretched to it, their aspect ratio isn't kept
+		int batch_size{8};
+		int width{224};
+		int height{224};
+		/// The channels are always RGB
+		TensorLayout layout{TensorLayout::TENSOR_LAYOUT_NCHW};
+		TensorType type{TensorType::TENSOR_TYPE_FLOAT32};
+		/// Float tensors get (value / 255 - mean) / stddev for each channel, uint8 tensors keep the values as they are
+		float mean[3]{0, 0, 0};
+		float stddev[3]{1, 1, 1};
+		/// Frames to take per second, see FrameReaderOptions. 0 takes every frame
+		double fps{0};
+		/// Workers converting frames. 0 uses every core. There's never more than one per frame in a batch
+		int threads{0};
+	};
+
+	/// Decodes a video straight into batches for inference, in a tensor the caller owns
+	/// swscale converts and resizes each frame right into its slot for uint8 tensors, and into a scratch picture normalize_u8_f32 turns into the slot for float ones. There's no FFMpegFrame in between
+	/// The workers convert the frames of a batch while the next ones decode
+	class FrameBatcher {
+	public:
+		FrameBatcher(FFMpegMedia_Ptr media, TensorOptions options = TensorOptions{});
+		~FrameBatcher();
+
+		/// Bytes of one frame, and of a whole batch (which the tensor passed to next_batch has to hold)
+		size_t get_frame_size();
+		size_t get_tensor_size() { return get_frame_size() * options.batch_size; }
+
+		/// Fills the tensor with the next batch_size frames and their times (in milliseconds). Blocks until they're all in
+		/// Returns how many frames there are, fewer than batch_size at the end of the video, leaving the rest of the tensor as it was. 0 means the video is over or something failed, is_finished tells which
+		int next_batch(void* tensor, std::vector<double>& times);
+		int next_batch(void* tensor);
+
+		bool is_finished() { return reader.is_finished(); }
+		std::string get_error() { return error; }
+
+	private:
+		/// A frame and the slot it goes to
+		struct Job {
+			FFMpegFrame_Ptr frame;
+			uint8_t* destination;
+		};
+
+		TensorOptions options{};
+		FrameReader reader;
+		std::string error{};
+		/// normalize_u8_f32's factors for mean and stddev
+		float scale[3];
+		float bias[3];
+
+		std::vector<std::thread> workers{};
+		std::mutex mutex{};
+		std::condition_variable condition{};
+		std::condition_variable done_condition{};
+		/// The jobs of the current batch, reserved up front so adding one never moves those being converted. Workers only read them, the frames are let go once the batch is done
+		std::vector<Job> batch{};
+		size_t next_job{0};
+		size_t done_jobs{0};
+		int failed{0};
+		bool quit{false};
+
+		void run();
+
+		/// Converts one frame into its slot, with the worker's own scaler and scratch picture
+		bool convert(const Job& job, SwsContext*& scaler, std::vector<uint8_t>& scratch);
+	};
+
+	using FrameBatcher_Ptr = std::shared_ptr<FrameBatcher>;
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include "FFMpegMedia.h"
+#include "FFMpegResampler.h"
+
+#include <deque>
+#include <string>
+#include <utility>
+
+extern "C" {
+	#include <libswscale/swscale.h>
+}
+
+namespace jp {
+
+	struct FrameReaderOptions {
+		/// Which streams to read. A stream the media doesn't have is left out
+		bool video{true};
+		bool audio{true};
+		/// Pixel format and size of the video frames. AV_PIX_FMT_NONE and 0 keep the decoder's. When only one of width and height is 0 it follows the aspect ratio
+		AVPixelFormat pixel_format{AV_PIX_FMT_NONE};
+		int width{0};
+		int height{0};
+		/// Video rows (linesizes) come out a multiple of this many bytes. 1 packs them with no padding, 0 takes whatever the decoder gives
+		int alignment{0};
+		/// Video frames to keep per second, e.g. 1 for a frame every second. 0 keeps every frame
+		double fps{0};
+		/// Sample format, rate and channels of the audio frames. AV_SAMPLE_FMT_NONE and 0 keep the decoder's
+		AVSampleFormat sample_format{AV_SAMPLE_FMT_NONE};
+		int sample_rate{0};
+		int channels{0};
+	};
+
+	/// A frame handed out by FrameReader
+	struct DecodedFrame {
+		DecoderType type{DecoderType::DECODER_TYPE_VIDEO};
+		FFMpegFrame_Ptr frame{nullptr};
+		/// Presentation time in milliseconds, on the same clock for audio and video
+		double time{0};
+	};
+
+	/// Pulls decoded frames straight out of media, as fast as they decode, for analysis and ML pipelines
+	/// There are no output threads, buffering thresholds or sync sleeps like in FFMpegMediaPlayer: next decodes on the caller's thread until it has a frame, audio and video together in presentation order
+	/// Frames are converted as they're handed out, into frames the reader reuses once the caller lets go of them. Holding on to a frame is fine, the next one just gets allocated
+	class FrameReader {
+	public:
+		FrameReader(FFMpegMedia_Ptr media, FrameReaderOptions options = FrameReaderOptions{});
+		~FrameReader();
+
+		/// Parses the media if it isn't yet, leaving its audio out when it isn't wanted. next does this itself the first time
+		bool initialize();
+
+		/// Gets the next frame. Returns false at the end of the media or on an error, is_finished tells which
+		bool next(DecodedFrame& frame);
+
+		bool is_finished() { return finished; }
+		std::string get_error() { return error; }
+
+	private:
+		/// One stream being read
+		struct StreamState {
+			bool enabled{false};
+			DecoderType type{DecoderType::DECODER_TYPE_VIDEO};
+			FFMpegStream_Ptr stream{nullptr};
+			FFMpegDecoder_Ptr decoder{nullptr};
+			/// Frames decoded ahead, waiting for the other stream to catch up, with their times
+			FFMpegFrameBuffer decoded{};
+			std::deque<std::pair<double, FFMpegFrame_Ptr>> queue{};
+			/// The time of the last frame and its duration, for frames without a timestamp
+			double last_time{0};
+			double last_duration{0};
+			/// The decoder has been flushed at the end of the media, so nothing more comes but the queue
+			bool flushed{false};
+			/// The last converted frame, reused unless the caller still holds it
+			FFMpegFrame_Ptr output{nullptr};
+		};
+
+		FFMpegMedia_Ptr media{nullptr};
+		FrameReaderOptions options{};
+		std::string error{};
+		bool initialized{false};
+		bool finished{false};
+
+		StreamState video{};
+		StreamState audio{};
+
+		SwsContext* scaler{nullptr};
+		FFMpegResampler_Ptr resampler{nullptr};
+		/// The resampler has given back the samples it held at the end
+		bool resampler_flushed{false};
+		/// The time the next video frame is due when sampling by fps, -1 before the first
+		double next_sample_time{-1};
+
+		/// Decodes the next packet into the queues, or flushes the decoders into them at the end
+		void read_packet();
+		void queue_frames(StreamState& state);
+
+		/// Converts the frame as the options ask, into the stream's output frame unless it's fine as it is. Returns false and sets error if it can't
+		bool convert_video(const FFMpegFrame_Ptr& frame, FFMpegFrame_Ptr& output);
+		/// Same for audio. Returns the samples in output, which swresample may leave at 0, or a negative number and sets error if it can't
+		int convert_audio(const FFMpegFrame_Ptr& frame, FFMpegFrame_Ptr& output);
+
+		/// Whether this video frame is kept when sampling by fps
+		bool sample(double time);
+	};
+
+	using FrameReader_Ptr = std::shared_ptr<FrameReader>;
+}
@@ -2,16 +2,39 @@
 #include <memory>
 #include <string>
 #include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cassert>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+}
 
 namespace jp {
 
 	class FFMpegMediaPlayer;
 
+	/// The layout of the audio an output plays. Zero fields (and AV_SAMPLE_FMT_NONE) mean "whatever the media has"
+	struct AudioFormat {
+		int sample_rate{0};
+		int channels{0};
+		uint64_t channel_layout{0};
+		/// Always packed (interleaved) for an opened output
+		AVSampleFormat sample_format{AV_SAMPLE_FMT_NONE};
+
+		bool operator==(const AudioFormat& other) const {
+			return sample_rate == other.sample_rate && channels == other.channels && channel_layout == other.channel_layout && sample_format == other.sample_format;
+		}
+		bool operator!=(const AudioFormat& other) const { return !(*this == other); }
+	};
+
 	class IAudioOutput {
 	public:
 		IAudioOutput(std::shared_ptr<FFMpegMediaPlayer> media_player) : media_player(media_player) {}
 
 		/// Initialize the audio output
+		/// The output asks the device for the preferred format, filling the blanks from the media, and keeps whatever the device accepted in get_format. The player converts the audio to that format before handing it over
 		virtual bool initialize() = 0;
 		virtual bool play() = 0;
 		virtual bool pause() = 0;
@@ -20,14 +43,111 @@ namespace jp {
 		std::string get_error() { return error; }
         virtual void reset() = 0;
         bool is_buffering() { return buffering; }
+
+		/// The format to ask the device for on the next initialize. Defaults to native float at the media's rate and channel count, so nothing is converted to 16 bits and back
+		void set_preferred_format(AudioFormat format) { preferred_format = format; }
+		AudioFormat get_preferred_format() { return preferred_format; }
+
+		/// The format the device accepted. Only valid after initialize succeeded
+		AudioFormat get_format() { return format; }
+
+		/// Microseconds on the monotonic clock the audio clock is timestamped with
+		static int64_t get_monotonic_time() {
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		/// The media time in milliseconds being heard at this point on the monotonic clock, or -1 before the output has played anything
+		/// Worked out from the samples handed to the device minus the device latency, so it follows the speaker rather than the decoder. Safe to call from any thread
+		double get_clock(int64_t time);
+		double get_clock() { return get_clock(get_monotonic_time()); }
+
+		/// Milliseconds between handing samples to the device and hearing them
+		double get_latency() { return device_latency.load(std::memory_order_relaxed) + latency_offset.load(std::memory_order_relaxed); }
+
+		/// Latency the device adds that can't be queried (e.g. a Bluetooth sink or a receiver), in milliseconds
+		void set_latency_offset(double offset) { latency_offset.store(offset, std::memory_order_relaxed); }
+		double get_latency_offset() { return latency_offset.load(std::memory_order_relaxed); }
 		
 	protected:
+		/// Publishes the clock from the audio thread: position was heard at time, and it runs until limit, where the samples handed over so far end
+		/// A clock that isn't running stays at position, e.g. while paused
+		/// There must only ever be one writer at a time. Outputs call this, freeze_clock and clear_clock from other threads only while the audio thread is held off (e.g. under the device lock)
+		void publish_clock(double position, int64_t time, double limit, bool running);
+
+		/// Stops the clock where it is now
+		void freeze_clock() {
+			double position = get_clock();
+			if (position >= 0) publish_clock(position, get_monotonic_time(), position, false);
+		}
+
+		/// Forgets the clock, e.g. after a seek
+		void clear_clock() { publish_clock(-1, 0, -1, false); }
+
 		std::shared_ptr<FFMpegMediaPlayer> media_player;
 		std::string error;
 		std::atomic_bool is_playing{false};
         std::atomic_bool buffering{false};
+		AudioFormat preferred_format{0, 0, 0, AV_SAMPLE_FMT_FLT};
+		AudioFormat format{};
+
+		/// Milliseconds of audio buffered between handing it over and hearing it, set by the output once it knows
+		std::atomic<double> device_latency{0};
+		std::atomic<double> latency_offset{0};
+
+	private:
+		/// A sequence lock: odd while the audio thread is writing the fields below
+		std::atomic<uint32_t> clock_sequence{0};
+		std::atomic<double> clock_position{-1};
+		std::atomic<int64_t> clock_time{0};
+		std::atomic<double> clock_limit{-1};
+		std::atomic<bool> clock_running{false};
+#ifndef NDEBUG
+		/// Set while publish_clock runs, to catch a second writer
+		std::atomic<bool> clock_writing{false};
+#endif
 	};
 
+	inline void IAudioOutput::publish_clock(double position, int64_t time, double limit, bool running) {
+#ifndef NDEBUG
+		bool writing = clock_writing.exchange(true, std::memory_order_acquire);
+		assert(!writing && "publish_clock called from two threads at once");
+#endif
+		uint32_t sequence = clock_sequence.load(std::memory_order_relaxed);
+		assert(!(sequence & 1) && "publish_clock entered while another write was in progress");
+		clock_sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		clock_position.store(position, std::memory_order_relaxed);
+		clock_time.store(time, std::memory_order_relaxed);
+		clock_limit.store(limit, std::memory_order_relaxed);
+		clock_running.store(running, std::memory_order_relaxed);
+		clock_sequence.store(sequence + 2, std::memory_order_release);
+#ifndef NDEBUG
+		clock_writing.store(false, std::memory_order_release);
+#endif
+	}
+
+	inline double IAudioOutput::get_clock(int64_t time) {
+		double position, limit;
+		int64_t published;
+		bool running;
+		uint32_t sequence;
+		do {
+			sequence = clock_sequence.load(std::memory_order_acquire);
+			position = clock_position.load(std::memory_order_relaxed);
+			published = clock_time.load(std::memory_order_relaxed);
+			limit = clock_limit.load(std::memory_order_relaxed);
+			running = clock_running.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while ((sequence & 1) || sequence != clock_sequence.load(std::memory_order_relaxed));
+
+		if (position < 0 && limit < 0) return -1;
+		if (!running) return std::max(position, 0.0);
+
+		// Runs in real time from the last callback, but never past what the device was given (an underrun stops the clock)
+		// Right after starting, the device is still playing silence, which counts as the start of the media
+		return std::max(std::min(position + (time - published) / 1000.0, limit), 0.0);
+	}
+
 	using AudioOutput_Ptr = std::shared_ptr<IAudioOutput>;
 
 }
@@ -0,0 +1,82 @@
+#pragma once
+#include "FFMpegMedia.h"
+
+#include <mutex>
+#include <unordered_map>
+
+namespace jp {
+
+	/// A file of MediaSummary entries, keyed by path and checked against the file's size and modification time
+	/// The cache file is memory mapped, opening it only walks the entry headers and lookups decode straight from the mapping
+	/// New entries stay in memory until save, which writes a fresh file next to the old one and renames it over, so a crash never leaves a half written cache
+	/// All functions are thread safe, so a MediaScanner's workers can share one cache
+	class MediaCache {
+	public:
+		MediaCache() = default;
+		~MediaCache() { close(); }
+
+		MediaCache(const MediaCache&) = delete;
+		MediaCache& operator=(const MediaCache&) = delete;
+
+		/// Maps the cache file. A missing file, or one written by another version or damaged, starts an empty cache that save replaces
+		/// Returns false only if the file exists but can't be read
+		bool open(std::string path);
+
+		/// Writes every entry to the cache file and maps the new file. Returns false if it can't be written, the old file is left alone then
+		bool save();
+
+		/// Unmaps the cache file and drops the entries that weren't saved
+		void close();
+
+		/// Fills summary from the cache if the path has an entry and the file's size and modification time still match it
+		/// Only the file's attributes are read, never the file
+		bool lookup(const std::string& path, MediaSummary& summary);
+
+		/// Adds or replaces the entry for the summary's path, stamped with the file's current size and modification time
+		/// Returns false if the file can't be found
+		bool store(const MediaSummary& summary);
+
+		/// Drops the entry for this path
+		void remove(const std::string& path);
+
+		/// Returns the summary of this file, from the cache if it's up to date, and otherwise by probing the file and storing the result
+		bool get_summary(const std::string& path, MediaSummary& summary, int64_t probe_size = 64 * 1024);
+
+		/// Entries, saved or not
+		size_t size();
+
+		std::string get_error() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return error;
+		}
+
+		/// The file's size and modification time (in nanoseconds), which tell whether it changed since something was derived from it
+		static bool get_file_stamp(const std::string& path, uint64_t& size, int64_t& modified);
+
+	private:
+		std::mutex mutex{};
+		std::string path{};
+		std::string error{};
+
+		const uint8_t* mapping{nullptr};
+		size_t mapping_size{0};
+
+		/// Offsets of the entries in the mapping, by path
+		std::unordered_map<std::string, size_t> mapped_entries{};
+		/// Entries stored since the last save, already encoded. These take over the mapped entry of the same path
+		std::unordered_map<std::string, std::string> pending_entries{};
+
+		void unmap();
+
+		/// Indexes the entries of the mapped file. Stops at the first damaged entry
+		void index_mapping();
+
+		/// The encoded entry of this path, wherever it is. Returns false if there is none
+		bool find_entry(const std::string& path, const uint8_t*& data, size_t& size);
+
+		static std::string encode_entry(const MediaSummary& summary, uint64_t file_size, int64_t modified);
+		static bool decode_entry(const uint8_t* data, size_t size, MediaSummary& summary, uint64_t& file_size, int64_t& modified);
+	};
+
+	using MediaCache_Ptr = std::shared_ptr<MediaCache>;
+}
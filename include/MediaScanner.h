@@ -0,0 +1,107 @@
+#pragma once
+#include "FFMpegMedia.h"
+#include "MediaCache.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace jp {
+
+	/// How a scan spreads its work
+	struct ScannerOptions {
+		/// Files being opened and read ahead at once. Spinning disks and network shares do best with a few, SSDs take more. 0 picks 4
+		int io_threads{4};
+		/// Files being probed at once. 0 uses every core
+		int cpu_threads{0};
+		/// Bytes of each file the I/O threads read ahead, which is also the probe budget
+		int64_t probe_size{64 * 1024};
+	};
+
+	/// One scanned file
+	struct ScanResult {
+		/// Position of the file in the list given to scan
+		size_t index{0};
+		bool success{false};
+		/// Filled in even when the file couldn't be probed, with at least the path
+		MediaSummary summary{};
+		std::string error{};
+	};
+
+	using ScanCallback = std::function<void(const ScanResult&)>;
+
+	/// Probes a list of files on a pool of threads, in two stages throttled separately
+	/// I/O threads open each file and read its headers into the page cache, CPU threads then probe it (see FFMpegMedia::probe) from memory
+	/// At most a couple of opened files per CPU thread wait between the stages, so a slow probe doesn't pile up open files
+	class MediaScanner {
+	public:
+		MediaScanner(ScannerOptions options = ScannerOptions{});
+		~MediaScanner();
+
+		/// Starts scanning these files in the background. The callback gets each result as soon as its file is done, in no particular order
+		/// Calls to the callback come from the worker threads, one at a time. Returns false if a scan is already running
+		bool scan(std::vector<std::string> paths, ScanCallback callback);
+
+		/// Blocks until the scan has finished or been cancelled
+		void wait();
+
+		/// Stops starting new files. The ones already being probed finish and are reported. Call wait to be sure they have
+		void cancel();
+
+		bool is_scanning() { return scanning; }
+
+		/// Files with an up to date entry in this cache are reported from it without being opened, the others are stored in it once probed
+		/// Saving the cache is up to you. Set this before scan
+		void set_cache(MediaCache_Ptr cache) { this->cache = cache; }
+
+		/// Files reported so far, out of the total given to the last scan
+		size_t get_completed() { return completed; }
+		size_t get_total() { return paths.size(); }
+
+		/// Scans the files and waits for them, returning the results in the order of the paths
+		static std::vector<ScanResult> scan_all(const std::vector<std::string>& paths, ScannerOptions options = ScannerOptions{});
+
+	private:
+		ScannerOptions options{};
+		std::vector<std::string> paths{};
+		ScanCallback callback{};
+		MediaCache_Ptr cache{nullptr};
+
+		/// Next path for the I/O threads
+		std::atomic<size_t> next_path{0};
+		std::atomic<size_t> completed{0};
+		std::atomic<bool> cancelled{false};
+		std::atomic<bool> scanning{false};
+
+		/// A file opened by the I/O stage, waiting for a CPU thread
+		struct OpenedFile {
+			size_t index{0};
+			FFMpegIOContext_Ptr context{nullptr};
+		};
+		std::mutex queue_mutex{};
+		/// Signalled when a file is queued or the I/O stage is done
+		std::condition_variable queue_filled{};
+		/// Signalled when a file is taken off the queue
+		std::condition_variable queue_drained{};
+		std::deque<OpenedFile> opened_files{};
+		size_t queue_capacity{0};
+		int io_running{0};
+		int cpu_running{0};
+
+		std::mutex callback_mutex{};
+
+		std::vector<std::thread> io_workers{};
+		std::vector<std::thread> cpu_workers{};
+
+		void io_func();
+		void cpu_func();
+
+		void report(ScanResult& result);
+	};
+
+	using MediaScanner_Ptr = std::shared_ptr<MediaScanner>;
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include "IAudioOutput.h"
+#include "IVideoOutput.h"
+#include "FFMpegMediaPlayer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace jp {
+
+	/// How fast a null output takes frames from the player
+	enum class OutputPacing {
+		/// As fast as the player can decode and filter them, to measure throughput
+		OUTPUT_PACING_FAST,
+		/// At the speed a real output would, audio by its sample rate and video synced like SDLVideoOutput (dropping late frames)
+		OUTPUT_PACING_REALTIME
+	};
+
+	/// What a null output has consumed. Times are in microseconds
+	struct OutputStats {
+		uint64_t frames{0};
+		/// Late frames a realtime video output threw away
+		uint64_t dropped{0};
+		/// Sample frames, for audio
+		uint64_t samples{0};
+		uint64_t bytes{0};
+		/// Times the player had no frame ready before the end of the media, i.e. the pipeline couldn't keep up
+		uint64_t underruns{0};
+		/// Time spent in the player's get_next_*_frame, which decodes and filters on the output's thread, and the longest single call
+		uint64_t fetch_time{0};
+		uint64_t max_fetch_time{0};
+		/// Time spent playing
+		uint64_t elapsed{0};
+
+		double get_fps() const { return elapsed ? frames * 1000000.0 / elapsed : 0; }
+		double get_average_fetch_time() const { return frames ? (double) fetch_time / frames : 0; }
+	};
+
+	/// The counters both null outputs keep, written by the output's thread and read from anywhere
+	class OutputCounters {
+	public:
+		void record_fetch(uint64_t time);
+		void record_frame(uint64_t bytes, uint64_t samples) {
+			frames++;
+			this->bytes += bytes;
+			this->samples += samples;
+		}
+		void record_drop() { dropped++; }
+		void record_underrun() { underruns++; }
+
+		/// Starts and stops the elapsed time
+		void start(int64_t time);
+		void stop(int64_t time);
+
+		OutputStats get_stats(int64_t time);
+		void reset();
+
+	private:
+		std::atomic<uint64_t> frames{0};
+		std::atomic<uint64_t> dropped{0};
+		std::atomic<uint64_t> samples{0};
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> underruns{0};
+		std::atomic<uint64_t> fetch_time{0};
+		std::atomic<uint64_t> max_fetch_time{0};
+		std::atomic<uint64_t> elapsed{0};
+		/// Monotonic time playing started, 0 while stopped
+		std::atomic<int64_t> started{0};
+	};
+
+	/// An audio output without a device, for benchmarks and batch processing on machines without sound
+	/// A thread of its own takes the audio from the player, either as fast as it comes or at the sample rate, and keeps the audio clock like a device would
+	class NullAudioOutput : public IAudioOutput {
+	public:
+		NullAudioOutput(FFMpegMediaPlayer_Ptr media_player, OutputPacing pacing = OutputPacing::OUTPUT_PACING_FAST) : IAudioOutput::IAudioOutput(media_player), pacing(pacing) {}
+		~NullAudioOutput() { release(); }
+
+		/// Takes the preferred format as is, filling the blanks from the media. Planar formats become packed, like a device's
+		bool initialize() override;
+		bool play() override;
+		bool pause() override;
+		bool stop() override;
+		void release() override;
+		void reset() override;
+
+		void set_pacing(OutputPacing pacing) { this->pacing = pacing; }
+		OutputPacing get_pacing() { return pacing; }
+
+		OutputStats get_stats() { return counters.get_stats(get_monotonic_time()); }
+		void reset_stats() { counters.reset(); }
+
+		/// Blocks until the player has no audio left, or timeout milliseconds pass. Returns whether the audio ended
+		bool wait_until_finished(int64_t timeout);
+
+	private:
+		std::atomic<OutputPacing> pacing;
+		OutputCounters counters{};
+
+		std::thread worker{};
+		std::mutex mutex{};
+		std::condition_variable condition{};
+		std::atomic<bool> quit{false};
+		std::atomic<bool> finished{false};
+		/// wait_until_finished waits on these, the thread holds mutex nearly all the time
+		std::mutex finish_mutex{};
+		std::condition_variable finish_condition{};
+
+		/// Sample frames consumed since playing started, which realtime pacing runs from
+		uint64_t paced_samples{0};
+		int64_t pace_start{0};
+
+		void run();
+
+		/// freeze_clock under mutex, which run publishes the clock under
+		void freeze_clock_locked();
+	};
+
+	/// A video output without a window. Like NullAudioOutput it takes frames on a thread of its own, as fast as they come or at the pace SDLVideoOutput would show them
+	class NullVideoOutput : public IVideoOutput {
+	public:
+		NullVideoOutput(FFMpegMediaPlayer_Ptr player, OutputPacing pacing = OutputPacing::OUTPUT_PACING_FAST) : IVideoOutput(player), pacing(pacing) {}
+		~NullVideoOutput() { release(); }
+
+		bool initialize() override;
+		bool play() override;
+		bool pause() override;
+		bool stop() override;
+		void release() override;
+		void clear_buffer() override {}
+		void reset() override;
+
+		void set_pacing(OutputPacing pacing) { this->pacing = pacing; }
+		OutputPacing get_pacing() { return pacing; }
+
+		OutputStats get_stats() { return counters.get_stats(IAudioOutput::get_monotonic_time()); }
+		void reset_stats() { counters.reset(); }
+
+		/// Blocks until the player has no video left, or timeout milliseconds pass. Returns whether the video ended
+		bool wait_until_finished(int64_t timeout);
+
+	private:
+		std::atomic<OutputPacing> pacing;
+		OutputCounters counters{};
+
+		std::thread worker{};
+		std::mutex mutex{};
+		std::condition_variable condition{};
+		std::atomic<bool> initialized{false};
+		std::atomic<bool> playing{false};
+		std::atomic<bool> quit{false};
+		std::atomic<bool> finished{false};
+		/// wait_until_finished waits on these, the thread holds mutex nearly all the time
+		std::mutex finish_mutex{};
+		std::condition_variable finish_condition{};
+
+		/// Without audio to sync to, realtime pacing runs frames from the monotonic time their pts maps to, -1 until the first frame after playing starts
+		double pace_offset{-1};
+
+		void run();
+	};
+
+	using NullAudioOutput_Ptr = std::shared_ptr<NullAudioOutput>;
+	using NullVideoOutput_Ptr = std::shared_ptr<NullVideoOutput>;
+}
@@ -4,11 +4,14 @@
 #include <SDL2/SDL.h>
 
 #include <atomic>
+#include <vector>
+#include <string>
 extern "C" {
 #include <libavutil/audio_fifo.h>
 }
 
 namespace jp {
+	/// Plays audio on an SDL audio device. Every output opens its own device handle, so any number of players can play at once
 	class SDLAudioOutput : public IAudioOutput {
 	public:
 		SDLAudioOutput(FFMpegMediaPlayer_Ptr media_player) : IAudioOutput::IAudioOutput(media_player) {}
@@ -25,15 +28,34 @@ namespace jp {
 
 		static void audio_callback(void* opaque, uint8_t* buffer, int len);
 
+		/// Names of the playback devices SDL knows about, for set_device
+		static std::vector<std::string> get_devices();
+
+		/// The device to open on the next initialize. An empty name (the default) opens the system's default device
+		void set_device(std::string name) { device_name = name; }
+		std::string get_device() { return device_name; }
+
+		/// Sample frames the device asks for per callback, applied on the next initialize. Smaller periods lower the latency, larger ones wake the audio thread less often
+		/// SDL wants a power of two, other sizes are rounded up to one
+		void set_period_size(int frames) { period_size = frames; }
+
+		/// The period size the device was opened with
+		int get_period_size() { return spec.samples; }
+
 		~SDLAudioOutput() { release(); }
         
         uint64_t get_num_written_samples() { return total_samples_written; }
         
         void reset() {
             if (fifo) {
+                // Keep the callback out while the fifo changes under it
+                SDL_LockAudioDevice(device);
                 av_audio_fifo_reset(fifo);
                 total_samples_written = 0;
                 last_pts = media_player->get_position();
+                fifo_end_pts = -1;
+                clear_clock();
+                SDL_UnlockAudioDevice(device);
             }
         }
         
@@ -50,9 +72,18 @@ namespace jp {
 
 	private:
 		SDL_AudioSpec spec{};
+		SDL_AudioDeviceID device{0};
+		std::string device_name{};
+		int period_size{1024};
+
+		/// Whether we hold a reference on SDL's audio subsystem, which is counted across outputs
+		bool subsystem_initialized{false};
 
 		/// This stores the last pts from the frames we received
         uint64_t last_pts{0};
+
+		/// Media time in milliseconds just past the last sample written to the fifo, -1 until a frame arrives
+		double fifo_end_pts{-1};
         uint64_t total_samples_written{0};
 
 		std::atomic<bool> running;
@@ -17,6 +17,7 @@ namespace jp {
 class SDLVideoOutput : public IVideoOutput {
 public:
     SDLVideoOutput(std::shared_ptr<FFMpegMediaPlayer> player);
+    ~SDLVideoOutput();
     bool initialize();
     bool play();
     bool pause();
@@ -32,11 +33,16 @@ private:
     SDL_Renderer* renderer{nullptr};
     SDL_Texture* texture{nullptr};
     std::atomic_bool initialized{false};
+    /// Whether we hold a reference on SDL's video subsystem, release only gives back our own
+    bool subsystem_initialized{false};
     std::atomic_bool playing{false};
     std::atomic_bool stop_thread{true};
+    /// Joined by release, so nothing renders into a window that's gone
+    std::thread buffer_thread{};
+    std::thread player_thread{};
     std::mutex player_mutex{};
     std::condition_variable player_condition{};
-    SwsContext* context;
+    SwsContext* context{nullptr};
     
     /// This function does the actual playback
     void playback_func();
@@ -50,9 +56,9 @@ private:
     bool sync_to_audio{true};
     
     std::vector<std::string> last_subs{};
-    SDL_Texture* sub_texture;
+    SDL_Texture* sub_texture{nullptr};
     
-    TTF_Font* font;
+    TTF_Font* font{nullptr};
 };
 }
 
@@ -0,0 +1,147 @@
+#ifndef SAMPLECONVERSION_H
+#define SAMPLECONVERSION_H
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <type_traits>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+namespace jp {
+
+/// Converts count S16 samples to float in [-1, 1)
+void s16_to_f32(const int16_t* in, float* out, size_t count);
+
+/// Converts count float samples to S16, clipping anything outside [-1, 1) and rounding to nearest with ties to even
+void f32_to_s16(const float* in, int16_t* out, size_t count);
+
+/// Interleaves frames sample frames from one plane per channel into a packed buffer
+void interleave_f32(const float* const* in, float* out, size_t frames, int channels);
+void interleave_s16(const int16_t* const* in, int16_t* out, size_t frames, int channels);
+
+/// Splits frames sample frames of packed audio into one plane per channel
+void deinterleave_f32(const float* in, float* const* out, size_t frames, int channels);
+void deinterleave_s16(const int16_t* in, int16_t* const* out, size_t frames, int channels);
+
+/// Converts frames sample frames from input to output, one pointer per plane. channels is only read by the kernels built for any channel count
+using SampleConverter = void (*)(const uint8_t* const* input, uint8_t* const* output, int frames, int channels);
+
+/// Picks the conversion kernel for this pair of formats and channel count. Call this once per stream, the kernel itself doesn't branch per sample
+/// Handles S16, S16P, S32, S32P, FLT, FLTP, DBL and DBLP. Mono, stereo and 5.1 get kernels with the channel count built in. Returns nullptr for anything else
+SampleConverter get_sample_converter(AVSampleFormat input, AVSampleFormat output, int channels);
+
+/// The sample type and layout of each format, at compile time
+template <AVSampleFormat Format> struct SampleFormatTraits;
+template <> struct SampleFormatTraits<AV_SAMPLE_FMT_S16> { using type = int16_t; static constexpr bool planar = false; };
+template <> struct SampleFormatTraits<AV_SAMPLE_FMT_S16P> { using type = int16_t; static constexpr bool planar = true; };
+template <> struct SampleFormatTraits<AV_SAMPLE_FMT_S32> { using type = int32_t; static constexpr bool planar = false; };
+template <> struct SampleFormatTraits<AV_SAMPLE_FMT_S32P> { using type = int32_t; static constexpr bool planar = true; };
+template <> struct SampleFormatTraits<AV_SAMPLE_FMT_FLT> { using type = float; static constexpr bool planar = false; };
+template <> struct SampleFormatTraits<AV_SAMPLE_FMT_FLTP> { using type = float; static constexpr bool planar = true; };
+template <> struct SampleFormatTraits<AV_SAMPLE_FMT_DBL> { using type = double; static constexpr bool planar = false; };
+template <> struct SampleFormatTraits<AV_SAMPLE_FMT_DBLP> { using type = double; static constexpr bool planar = true; };
+
+/// Full scale of each sample type, integers map [-scale, scale) to [-1, 1)
+template <typename T> struct SampleScale { static constexpr double value = 1.0; };
+template <> struct SampleScale<int16_t> { static constexpr double value = 32768.0; };
+template <> struct SampleScale<int32_t> { static constexpr double value = 2147483648.0; };
+
+/// Converts one sample. Integers are clipped and rounded to nearest with ties to even, the same rule f32_to_s16 and its SIMD kernels use, so every path gives the same output
+template <typename In, typename Out>
+struct SampleCast {
+    /// Anything touching 32 bit integers or doubles needs double precision, the rest is fine in float
+    using Work = typename std::conditional<std::is_same<In, double>::value || std::is_same<Out, double>::value
+            || std::is_same<In, int32_t>::value || std::is_same<Out, int32_t>::value, double, float>::type;
+    
+    static inline Out convert(In value) {
+        Work sample = (Work) value * (Work) (SampleScale<Out>::value / SampleScale<In>::value);
+        if (!std::is_integral<Out>::value) return (Out) sample;
+        
+        const Work max = (Work) (SampleScale<Out>::value - 1);
+        const Work min = (Work) -SampleScale<Out>::value;
+        sample = sample < min ? min : (sample > max ? max : sample);
+        return (Out) std::lrint(sample);
+    }
+};
+
+/// Converts runs of samples that keep their layout
+template <typename In, typename Out>
+struct SampleRunKernel {
+    static inline void run(const In* in, Out* out, size_t count) {
+        for (size_t i = 0; i < count; i++) out[i] = SampleCast<In, Out>::convert(in[i]);
+    }
+};
+template <typename T>
+struct SampleRunKernel<T, T> {
+    static inline void run(const T* in, T* out, size_t count) { memcpy(out, in, count * sizeof(T)); }
+};
+template <>
+struct SampleRunKernel<int16_t, float> {
+    static inline void run(const int16_t* in, float* out, size_t count) { s16_to_f32(in, out, count); }
+};
+template <>
+struct SampleRunKernel<float, int16_t> {
+    static inline void run(const float* in, int16_t* out, size_t count) { f32_to_s16(in, out, count); }
+};
+
+/// Converts between planar and packed. With Channels known, the channel loop unrolls and the frame loop vectorises
+template <typename In, typename Out, int Channels>
+struct SampleLayoutKernel {
+    static inline void interleave(const In* const* in, Out* out, size_t frames, int channels) {
+        if (Channels) channels = Channels;
+        for (size_t i = 0; i < frames; i++) {
+            for (int channel = 0; channel < channels; channel++) {
+                out[i * channels + channel] = SampleCast<In, Out>::convert(in[channel][i]);
+            }
+        }
+    }
+    
+    static inline void deinterleave(const In* in, Out* const* out, size_t frames, int channels) {
+        if (Channels) channels = Channels;
+        for (size_t i = 0; i < frames; i++) {
+            for (int channel = 0; channel < channels; channel++) {
+                out[channel][i] = SampleCast<In, Out>::convert(in[i * channels + channel]);
+            }
+        }
+    }
+};
+template <int Channels>
+struct SampleLayoutKernel<float, float, Channels> {
+    static inline void interleave(const float* const* in, float* out, size_t frames, int channels) { interleave_f32(in, out, frames, Channels ? Channels : channels); }
+    static inline void deinterleave(const float* in, float* const* out, size_t frames, int channels) { deinterleave_f32(in, out, frames, Channels ? Channels : channels); }
+};
+template <int Channels>
+struct SampleLayoutKernel<int16_t, int16_t, Channels> {
+    static inline void interleave(const int16_t* const* in, int16_t* out, size_t frames, int channels) { interleave_s16(in, out, frames, Channels ? Channels : channels); }
+    static inline void deinterleave(const int16_t* in, int16_t* const* out, size_t frames, int channels) { deinterleave_s16(in, out, frames, Channels ? Channels : channels); }
+};
+
+/// The conversion kernel for one (input format, output format, channel count). Channels of 0 builds a kernel that takes the count at runtime
+template <AVSampleFormat InFormat, AVSampleFormat OutFormat, int Channels>
+void convert_samples(const uint8_t* const* input, uint8_t* const* output, int frames, int channels) {
+    using In = typename SampleFormatTraits<InFormat>::type;
+    using Out = typename SampleFormatTraits<OutFormat>::type;
+    constexpr bool in_planar = SampleFormatTraits<InFormat>::planar;
+    constexpr bool out_planar = SampleFormatTraits<OutFormat>::planar;
+    if (Channels) channels = Channels;
+    
+    if (in_planar == out_planar) {
+        // Same layout: every plane is one flat run
+        const int planes = in_planar ? channels : 1;
+        const size_t count = (size_t) frames * (in_planar ? 1 : channels);
+        for (int plane = 0; plane < planes; plane++) {
+            SampleRunKernel<In, Out>::run(reinterpret_cast<const In*>(input[plane]), reinterpret_cast<Out*>(output[plane]), count);
+        }
+    } else if (in_planar) {
+        SampleLayoutKernel<In, Out, Channels>::interleave(reinterpret_cast<const In* const*>(input), reinterpret_cast<Out*>(output[0]), frames, channels);
+    } else {
+        SampleLayoutKernel<In, Out, Channels>::deinterleave(reinterpret_cast<const In*>(input[0]), reinterpret_cast<Out* const*>(output), frames, channels);
+    }
+}
+
+}
+
+#endif // SAMPLECONVERSION_H
@@ -0,0 +1,74 @@
+#pragma once
+#include "ThumbnailExtractor.h"
+
+#include <string>
+#include <vector>
+
+namespace jp {
+
+	struct SpriteSheetOptions {
+		/// Tiles in the sheet, spread evenly over the video, and how many go on a row
+		int tiles{100};
+		int columns{10};
+		/// Size of a tile. Like ThumbnailOptions, 0 follows the picture's aspect ratio
+		int tile_width{160};
+		int tile_height{0};
+		/// PNG or JPEG, RGB24 means PNG here
+		ThumbnailFormat format{ThumbnailFormat::THUMBNAIL_FORMAT_JPEG};
+		int quality{4};
+		/// Workers extracting the tiles, see ThumbnailOptions
+		int threads{0};
+		/// Where sheets are kept. It has to exist
+		std::string cache_directory{};
+	};
+
+	/// One picture in a sheet
+	struct SpriteTile {
+		/// The span of the video this tile stands for, in milliseconds. It starts at the keyframe the picture comes from
+		uint64_t start_time{0};
+		uint64_t end_time{0};
+		/// Where it is in the sheet, in pixels
+		int x{0};
+		int y{0};
+		int width{0};
+		int height{0};
+	};
+
+	struct SpriteSheet {
+		/// The sheet image, and a WebVTT index pointing each span of the video at its tile (the usual "sheet.jpg#xywh=x,y,w,h" form players take)
+		std::string image_path{};
+		std::string index_path{};
+		std::vector<SpriteTile> tiles{};
+		/// Whether it came from the cache
+		bool cached{false};
+	};
+
+	/// Builds timeline sprite sheets for hover previews and keeps them on disk
+	/// The tiles are the keyframes from the demuxer's index closest to even steps through the video, so no picture but a keyframe is ever decoded. Without an index (MPEG-TS and the like) the steps are used, each landing on its nearest keyframe
+	/// Sheets are named after the file's path, size and modification time and the options, so an unchanged file never gets its sheet built twice
+	class SpriteSheetGenerator {
+	public:
+		SpriteSheetGenerator(SpriteSheetOptions options);
+
+		/// Gets the sheet of this file from the cache, or builds and caches it
+		bool generate(const std::string& path, SpriteSheet& sheet);
+
+		/// The name (without extension) the sheet of this file has in the cache. Empty if the file can't be found
+		std::string get_cache_key(const std::string& path);
+
+		std::string get_error() { return error; }
+
+	private:
+		SpriteSheetOptions options{};
+		std::string error{};
+
+		/// Reads a sheet's tiles back from its index. Returns false if it isn't there or is damaged
+		static bool load_index(const std::string& index_path, std::vector<SpriteTile>& tiles);
+
+		/// Picks count times from the keyframes, each the closest to its step through the video
+		static std::vector<uint64_t> pick_times(const std::vector<uint64_t>& keyframes, uint64_t duration, int count);
+
+		/// Writes data to path through a temporary file, so a reader never sees half of it
+		static bool write_file(const std::string& path, const void* data, size_t size);
+	};
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "FFMpegMedia.h"
+
+#include <string>
+#include <vector>
+
+extern "C" {
+	#include <libswscale/swscale.h>
+}
+
+namespace jp {
+
+	enum class ThumbnailFormat { THUMBNAIL_FORMAT_RGB24, THUMBNAIL_FORMAT_PNG, THUMBNAIL_FORMAT_JPEG };
+
+	struct ThumbnailOptions {
+		/// Size of the thumbnails. When one of them is 0 it follows the picture's aspect ratio, when both are the picture keeps its size
+		int width{320};
+		int height{0};
+		ThumbnailFormat format{ThumbnailFormat::THUMBNAIL_FORMAT_RGB24};
+		/// JPEG quantiser, from 2 (best) to 31 (smallest)
+		int quality{4};
+		/// Workers, each with its own demuxer and decoder. 0 uses every core. There's never more than one per thumbnail
+		int threads{0};
+	};
+
+	struct Thumbnail {
+		/// The time asked for and the time of the keyframe the picture comes from, in milliseconds
+		uint64_t requested_time{0};
+		uint64_t time{0};
+		int width{0};
+		int height{0};
+		ThumbnailFormat format{ThumbnailFormat::THUMBNAIL_FORMAT_RGB24};
+		/// RGB24 rows of width * 3 bytes, or the encoded PNG or JPEG file
+		std::vector<uint8_t> data{};
+		/// Why there's no picture, when there isn't
+		std::string error{};
+
+		bool is_valid() const { return !data.empty(); }
+	};
+
+	/// Pulls scaled pictures out of a video at a list of times
+	/// Each time is served by the keyframe closest to it, and only keyframes are decoded, so a thumbnail costs a seek and one picture however long the GOPs are
+	/// The times are sorted and split into runs, one per worker, so every worker only ever seeks forward through the file
+	class ThumbnailExtractor {
+	public:
+		ThumbnailExtractor(std::string path, ThumbnailOptions options = ThumbnailOptions{});
+
+		/// Extracts a thumbnail for each time (in milliseconds), in the same order. Blocks until they're all done
+		/// Returns false if any of them failed, get_error and the thumbnail's own error say why
+		bool extract(const std::vector<uint64_t>& times, std::vector<Thumbnail>& thumbnails);
+
+		/// Extracts a thumbnail every interval milliseconds, from the start to the end of the video
+		bool extract_every(uint64_t interval, std::vector<Thumbnail>& thumbnails);
+
+		std::string get_error() { return error; }
+
+		/// Encodes a picture of packed RGB24 rows as a PNG or JPEG file (RGB24 means PNG here), with the options' quality
+		static bool encode_image(const uint8_t* data, int width, int height, const ThumbnailOptions& options, std::vector<uint8_t>& output);
+
+	private:
+		std::string path{};
+		ThumbnailOptions options{};
+		std::string error{};
+
+		/// Extracts the thumbnails for times[order[first]] to times[order[last - 1]] with a demuxer and decoder of its own. Returns false and sets error if the file can't be opened
+		static bool extract_range(const std::string& path, const ThumbnailOptions& options, const std::vector<uint64_t>& times, const std::vector<size_t>& order, size_t first, size_t last, std::vector<Thumbnail>& thumbnails, std::string& error);
+
+		/// The thumbnail size for a picture of this size
+		static void get_output_size(const ThumbnailOptions& options, int width, int height, int& output_width, int& output_height);
+
+		/// Opens a PNG or JPEG encoder for pictures of this size
+		static AVCodecContext* open_encoder(const ThumbnailOptions& options, int width, int height);
+	};
+}
@@ -0,0 +1,382 @@
+#include "AudioGain.h"
+#include "CpuDispatch.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(JP_X86_DISPATCH)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace jp {
+
+static inline int16_t clamp_s16(float value) {
+    return (int16_t) lrintf(std::min(32767.0f, std::max(-32768.0f, value)));
+}
+
+/// In double, a float can't hold every 32 bit sample
+static inline int32_t clamp_s32(double value) {
+    return (int32_t) llrint(std::min(2147483647.0, std::max(-2147483648.0, value)));
+}
+
+static inline uint8_t clamp_u8(float value) {
+    return (uint8_t) lrintf(std::min(255.0f, std::max(0.0f, value + 128.0f)));
+}
+
+#if defined(JP_X86_DISPATCH) || defined(__SSE2__)
+/// Scales 8 S16 samples by two vectors of 4 gains each
+#if defined(JP_X86_DISPATCH)
+JP_TARGET("sse2")
+#endif
+static inline __m128i scale_s16x8(__m128i samples, __m128 gains_lo, __m128 gains_hi) {
+    const __m128 max = _mm_set1_ps(32767.0f);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+
+    // Sign extend to 32 bits by moving each sample to the top half and shifting it back down
+    __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16));
+    __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16));
+    lo = _mm_min_ps(_mm_max_ps(_mm_mul_ps(lo, gains_lo), min), max);
+    hi = _mm_min_ps(_mm_max_ps(_mm_mul_ps(hi, gains_hi), min), max);
+
+    return _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+}
+#endif
+
+void gain_f32(float* samples, size_t count, float gain) {
+    get_kernels().gain_f32(samples, count, gain);
+}
+
+void gain_s16(int16_t* samples, size_t count, float gain) {
+    get_kernels().gain_s16(samples, count, gain);
+}
+
+// Devices only hand out S32 and U8 when they can't do better, plain loops are plenty for those
+void gain_s32(int32_t* samples, size_t count, float gain) {
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = clamp_s32(samples[i] * (double) gain);
+    }
+}
+
+void gain_u8(uint8_t* samples, size_t count, float gain) {
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = clamp_u8((samples[i] - 128) * gain);
+    }
+}
+
+namespace simd {
+
+void gain_f32_scalar(float* samples, size_t count, float gain) {
+    for (size_t i = 0; i < count; i++) {
+        samples[i] *= gain;
+    }
+}
+
+void gain_s16_scalar(int16_t* samples, size_t count, float gain) {
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = clamp_s16(samples[i] * gain);
+    }
+}
+
+#if defined(JP_X86_DISPATCH)
+JP_TARGET("sse2") void gain_f32_sse2(float* samples, size_t count, float gain) {
+    size_t i = 0;
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), g));
+        _mm_storeu_ps(samples + i + 4, _mm_mul_ps(_mm_loadu_ps(samples + i + 4), g));
+    }
+    gain_f32_scalar(samples + i, count - i, gain);
+}
+
+JP_TARGET("sse2") void gain_s16_sse2(int16_t* samples, size_t count, float gain) {
+    size_t i = 0;
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 8 <= count; i += 8) {
+        __m128i* pointer = reinterpret_cast<__m128i*>(samples + i);
+        _mm_storeu_si128(pointer, scale_s16x8(_mm_loadu_si128(pointer), g, g));
+    }
+    gain_s16_scalar(samples + i, count - i, gain);
+}
+
+JP_TARGET("sse4.1") void gain_s16_sse41(int16_t* samples, size_t count, float gain) {
+    size_t i = 0;
+    const __m128 g = _mm_set1_ps(gain);
+    const __m128 max = _mm_set1_ps(32767.0f);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128i* pointer = reinterpret_cast<__m128i*>(samples + i);
+        __m128i packed = _mm_loadu_si128(pointer);
+        __m128 lo = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(packed));
+        __m128 hi = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(packed, 8)));
+        lo = _mm_min_ps(_mm_max_ps(_mm_mul_ps(lo, g), min), max);
+        hi = _mm_min_ps(_mm_max_ps(_mm_mul_ps(hi, g), min), max);
+        _mm_storeu_si128(pointer, _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+    }
+    gain_s16_scalar(samples + i, count - i, gain);
+}
+
+JP_TARGET("avx2") void gain_f32_avx2(float* samples, size_t count, float gain) {
+    size_t i = 0;
+    const __m256 g = _mm256_set1_ps(gain);
+    for (; i + 16 <= count; i += 16) {
+        _mm256_storeu_ps(samples + i, _mm256_mul_ps(_mm256_loadu_ps(samples + i), g));
+        _mm256_storeu_ps(samples + i + 8, _mm256_mul_ps(_mm256_loadu_ps(samples + i + 8), g));
+    }
+    gain_f32_scalar(samples + i, count - i, gain);
+}
+
+JP_TARGET("avx2") void gain_s16_avx2(int16_t* samples, size_t count, float gain) {
+    size_t i = 0;
+    const __m256 g = _mm256_set1_ps(gain);
+    const __m256 max = _mm256_set1_ps(32767.0f);
+    const __m256 min = _mm256_set1_ps(-32768.0f);
+    for (; i + 16 <= count; i += 16) {
+        __m256i* pointer = reinterpret_cast<__m256i*>(samples + i);
+        __m256i packed = _mm256_loadu_si256(pointer);
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(packed)));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(packed, 1)));
+        lo = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(lo, g), min), max);
+        hi = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(hi, g), min), max);
+        // The pack works per 128 bit lane, put the quarters back in order
+        __m256i result = _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        _mm256_storeu_si256(pointer, _mm256_permute4x64_epi64(result, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    gain_s16_scalar(samples + i, count - i, gain);
+}
+
+JP_TARGET("avx512f") void gain_f32_avx512(float* samples, size_t count, float gain) {
+    size_t i = 0;
+    const __m512 g = _mm512_set1_ps(gain);
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(samples + i, _mm512_mul_ps(_mm512_loadu_ps(samples + i), g));
+    }
+    gain_f32_scalar(samples + i, count - i, gain);
+}
+
+JP_TARGET("avx512f") void gain_s16_avx512(int16_t* samples, size_t count, float gain) {
+    size_t i = 0;
+    const __m512 g = _mm512_set1_ps(gain);
+    const __m512 max = _mm512_set1_ps(32767.0f);
+    const __m512 min = _mm512_set1_ps(-32768.0f);
+    for (; i + 16 <= count; i += 16) {
+        __m256i* pointer = reinterpret_cast<__m256i*>(samples + i);
+        __m512 values = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm256_loadu_si256(pointer)));
+        values = _mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(values, g), min), max);
+        _mm256_storeu_si256(pointer, _mm512_cvtsepi32_epi16(_mm512_cvtps_epi32(values)));
+    }
+    gain_s16_scalar(samples + i, count - i, gain);
+}
+#endif
+
+}
+
+void gain_ramp_f32(float* samples, size_t frames, int channels, float start, float step) {
+    size_t count = frames * channels;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // The gain changes every `channels` samples, which lines up with the vectors when channels divides 8
+    if (channels == 1 || channels == 2 || channels == 4 || channels == 8) {
+        __m128 gains_lo = _mm_setr_ps(start, start + step * (1 / channels), start + step * (2 / channels), start + step * (3 / channels));
+        __m128 gains_hi = _mm_setr_ps(start + step * (4 / channels), start + step * (5 / channels), start + step * (6 / channels), start + step * (7 / channels));
+        const __m128 increment = _mm_set1_ps(step * (8 / channels));
+        for (; i + 8 <= count; i += 8) {
+            _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), gains_lo));
+            _mm_storeu_ps(samples + i + 4, _mm_mul_ps(_mm_loadu_ps(samples + i + 4), gains_hi));
+            gains_lo = _mm_add_ps(gains_lo, increment);
+            gains_hi = _mm_add_ps(gains_hi, increment);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        samples[i] *= start + step * (i / channels);
+    }
+}
+
+void gain_ramp_s16(int16_t* samples, size_t frames, int channels, float start, float step) {
+    size_t count = frames * channels;
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (channels == 1 || channels == 2 || channels == 4 || channels == 8) {
+        __m128 gains_lo = _mm_setr_ps(start, start + step * (1 / channels), start + step * (2 / channels), start + step * (3 / channels));
+        __m128 gains_hi = _mm_setr_ps(start + step * (4 / channels), start + step * (5 / channels), start + step * (6 / channels), start + step * (7 / channels));
+        const __m128 increment = _mm_set1_ps(step * (8 / channels));
+        for (; i + 8 <= count; i += 8) {
+            __m128i* pointer = reinterpret_cast<__m128i*>(samples + i);
+            _mm_storeu_si128(pointer, scale_s16x8(_mm_loadu_si128(pointer), gains_lo, gains_hi));
+            gains_lo = _mm_add_ps(gains_lo, increment);
+            gains_hi = _mm_add_ps(gains_hi, increment);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        samples[i] = clamp_s16(samples[i] * (start + step * (i / channels)));
+    }
+}
+
+void gain_ramp_s32(int32_t* samples, size_t frames, int channels, float start, float step) {
+    size_t count = frames * channels;
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = clamp_s32(samples[i] * (double) (start + step * (i / channels)));
+    }
+}
+
+void gain_ramp_u8(uint8_t* samples, size_t frames, int channels, float start, float step) {
+    size_t count = frames * channels;
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = clamp_u8((samples[i] - 128) * (start + step * (i / channels)));
+    }
+}
+
+/// Lane i of the 8 samples in a step holds frame i / channels, like the ramps above
+void crossfade_f32(float* dest, const float* src, size_t frames, int channels, float out_start, float out_step, float in_start, float in_step) {
+    size_t count = frames * channels;
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (channels == 1 || channels == 2 || channels == 4 || channels == 8) {
+        __m128 out_lo = _mm_setr_ps(out_start, out_start + out_step * (1 / channels), out_start + out_step * (2 / channels), out_start + out_step * (3 / channels));
+        __m128 out_hi = _mm_setr_ps(out_start + out_step * (4 / channels), out_start + out_step * (5 / channels), out_start + out_step * (6 / channels), out_start + out_step * (7 / channels));
+        __m128 in_lo = _mm_setr_ps(in_start, in_start + in_step * (1 / channels), in_start + in_step * (2 / channels), in_start + in_step * (3 / channels));
+        __m128 in_hi = _mm_setr_ps(in_start + in_step * (4 / channels), in_start + in_step * (5 / channels), in_start + in_step * (6 / channels), in_start + in_step * (7 / channels));
+        const __m128 out_increment = _mm_set1_ps(out_step * (8 / channels));
+        const __m128 in_increment = _mm_set1_ps(in_step * (8 / channels));
+        for (; i + 8 <= count; i += 8) {
+            __m128 lo = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dest + i), out_lo), _mm_mul_ps(_mm_loadu_ps(src + i), in_lo));
+            __m128 hi = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dest + i + 4), out_hi), _mm_mul_ps(_mm_loadu_ps(src + i + 4), in_hi));
+            _mm_storeu_ps(dest + i, lo);
+            _mm_storeu_ps(dest + i + 4, hi);
+            out_lo = _mm_add_ps(out_lo, out_increment);
+            out_hi = _mm_add_ps(out_hi, out_increment);
+            in_lo = _mm_add_ps(in_lo, in_increment);
+            in_hi = _mm_add_ps(in_hi, in_increment);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        size_t frame = i / channels;
+        dest[i] = dest[i] * (out_start + out_step * frame) + src[i] * (in_start + in_step * frame);
+    }
+}
+
+void crossfade_s16(int16_t* dest, const int16_t* src, size_t frames, int channels, float out_start, float out_step, float in_start, float in_step) {
+    size_t count = frames * channels;
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (channels == 1 || channels == 2 || channels == 4 || channels == 8) {
+        __m128 out_lo = _mm_setr_ps(out_start, out_start + out_step * (1 / channels), out_start + out_step * (2 / channels), out_start + out_step * (3 / channels));
+        __m128 out_hi = _mm_setr_ps(out_start + out_step * (4 / channels), out_start + out_step * (5 / channels), out_start + out_step * (6 / channels), out_start + out_step * (7 / channels));
+        __m128 in_lo = _mm_setr_ps(in_start, in_start + in_step * (1 / channels), in_start + in_step * (2 / channels), in_start + in_step * (3 / channels));
+        __m128 in_hi = _mm_setr_ps(in_start + in_step * (4 / channels), in_start + in_step * (5 / channels), in_start + in_step * (6 / channels), in_start + in_step * (7 / channels));
+        const __m128 out_increment = _mm_set1_ps(out_step * (8 / channels));
+        const __m128 in_increment = _mm_set1_ps(in_step * (8 / channels));
+        const __m128 max = _mm_set1_ps(32767.0f);
+        const __m128 min = _mm_set1_ps(-32768.0f);
+        for (; i + 8 <= count; i += 8) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+            // Sign extend to 32 bits, like scale_s16x8
+            __m128 a_lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16));
+            __m128 a_hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16));
+            __m128 b_lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16));
+            __m128 b_hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(b, b), 16));
+
+            __m128 lo = _mm_add_ps(_mm_mul_ps(a_lo, out_lo), _mm_mul_ps(b_lo, in_lo));
+            __m128 hi = _mm_add_ps(_mm_mul_ps(a_hi, out_hi), _mm_mul_ps(b_hi, in_hi));
+            lo = _mm_min_ps(_mm_max_ps(lo, min), max);
+            hi = _mm_min_ps(_mm_max_ps(hi, min), max);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+
+            out_lo = _mm_add_ps(out_lo, out_increment);
+            out_hi = _mm_add_ps(out_hi, out_increment);
+            in_lo = _mm_add_ps(in_lo, in_increment);
+            in_hi = _mm_add_ps(in_hi, in_increment);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        size_t frame = i / channels;
+        dest[i] = clamp_s16(dest[i] * (out_start + out_step * frame) + src[i] * (in_start + in_step * frame));
+    }
+}
+
+bool AudioGain::process(FFMpegFrame_Ptr& frame) {
+    if (!frame || !frame->is_valid()) return false;
+
+    // Don't scale data someone else is still looking at
+    if (!frame->make_writable()) return false;
+
+    return process(frame->get_data(), frame->get_number_of_samples(), frame->get_channels(), (AVSampleFormat) frame->get_sample_format());
+}
+
+bool AudioGain::is_supported(AVSampleFormat format) {
+    switch (av_get_packed_sample_fmt(format)) {
+        case AV_SAMPLE_FMT_U8:
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S32:
+        case AV_SAMPLE_FMT_FLT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool AudioGain::process(uint8_t** data, int nb_samples, int channels, AVSampleFormat format) {
+    AVSampleFormat packed = av_get_packed_sample_fmt(format);
+    if (!is_supported(packed)) return false;
+    if (nb_samples <= 0 || channels <= 0) return true;
+
+    bool planar = av_sample_fmt_is_planar(format);
+    int planes = planar ? channels : 1;
+    int plane_channels = planar ? 1 : channels;
+
+    float target = target_gain.load(std::memory_order_relaxed);
+    if (reset_requested.exchange(false, std::memory_order_acquire)) {
+        current_gain = ramp_target = target;
+        ramp_remaining = 0;
+    }
+
+    if (target != ramp_target) {
+        // Start a new ramp from wherever we are now, even if the last one hasn't finished
+        ramp_target = target;
+        ramp_remaining = ramp_length.load(std::memory_order_relaxed);
+        if (ramp_remaining == 0) current_gain = target;
+    }
+
+    int offset = 0;
+    if (ramp_remaining > 0) {
+        int frames = std::min(nb_samples, ramp_remaining);
+        float step = (ramp_target - current_gain) / ramp_remaining;
+        float start = current_gain + step;
+
+        for (int plane = 0; plane < planes; plane++) {
+            switch (packed) {
+                case AV_SAMPLE_FMT_U8: gain_ramp_u8(data[plane], frames, plane_channels, start, step); break;
+                case AV_SAMPLE_FMT_S16: gain_ramp_s16(reinterpret_cast<int16_t*>(data[plane]), frames, plane_channels, start, step); break;
+                case AV_SAMPLE_FMT_S32: gain_ramp_s32(reinterpret_cast<int32_t*>(data[plane]), frames, plane_channels, start, step); break;
+                default: gain_ramp_f32(reinterpret_cast<float*>(data[plane]), frames, plane_channels, start, step); break;
+            }
+        }
+
+        ramp_remaining -= frames;
+        current_gain = ramp_remaining ? current_gain + step * frames : ramp_target;
+        offset = frames;
+    }
+
+    // Unity gain, nothing left to do
+    if (offset == nb_samples || current_gain == 1.0f) return true;
+
+    size_t count = (size_t) (nb_samples - offset) * plane_channels;
+    for (int plane = 0; plane < planes; plane++) {
+        switch (packed) {
+            case AV_SAMPLE_FMT_U8: gain_u8(data[plane] + offset * plane_channels, count, current_gain); break;
+            case AV_SAMPLE_FMT_S16: gain_s16(reinterpret_cast<int16_t*>(data[plane]) + offset * plane_channels, count, current_gain); break;
+            case AV_SAMPLE_FMT_S32: gain_s32(reinterpret_cast<int32_t*>(data[plane]) + offset * plane_channels, count, current_gain); break;
+            default: gain_f32(reinterpret_cast<float*>(data[plane]) + offset * plane_channels, count, current_gain); break;
+        }
+    }
+
+    return true;
+}
+
+}
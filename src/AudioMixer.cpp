@@ -0,0 +1,439 @@
+#include "AudioMixer.h"
+#include "AudioGain.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace jp {
+
+	using mixer_clock = std::chrono::steady_clock;
+
+	void mix_ramp_f32(float* dest, const float* src, size_t frames, int channels, float start_left, float start_right, float step_left, float step_right) {
+		size_t i = 0;
+#if defined(__SSE2__)
+		if (channels == 2) {
+			// Two frames per vector, the gains move two steps per vector
+			__m128 gains_lo = _mm_setr_ps(start_left, start_right, start_left + step_left, start_right + step_right);
+			__m128 gains_hi = _mm_add_ps(gains_lo, _mm_setr_ps(2 * step_left, 2 * step_right, 2 * step_left, 2 * step_right));
+			const __m128 increment = _mm_setr_ps(4 * step_left, 4 * step_right, 4 * step_left, 4 * step_right);
+			for (; i + 4 <= frames; i += 4) {
+				__m128 lo = _mm_add_ps(_mm_loadu_ps(dest + i * 2), _mm_mul_ps(_mm_loadu_ps(src + i * 2), gains_lo));
+				__m128 hi = _mm_add_ps(_mm_loadu_ps(dest + i * 2 + 4), _mm_mul_ps(_mm_loadu_ps(src + i * 2 + 4), gains_hi));
+				_mm_storeu_ps(dest + i * 2, lo);
+				_mm_storeu_ps(dest + i * 2 + 4, hi);
+				gains_lo = _mm_add_ps(gains_lo, increment);
+				gains_hi = _mm_add_ps(gains_hi, increment);
+			}
+		}
+#endif
+		for (; i < frames; i++) {
+			float left = start_left + step_left * i;
+			float right = start_right + step_right * i;
+			for (int channel = 0; channel < channels; channel++) {
+				dest[i * channels + channel] += src[i * channels + channel] * (channels == 2 && channel == 1 ? right : left);
+			}
+		}
+	}
+
+	void soft_clip_f32(float* samples, size_t count) {
+		// |x| <= knee stays, above that the magnitude is knee + (1 - knee) * t / (1 + t) with t = (|x| - knee) / (1 - knee), which meets x with the same slope and never reaches 1
+		// The same curve for every sample of every block, so a value never comes out differently from one callback to the next
+		const float knee = 0.9f;
+		const float range = 1 - knee;
+		size_t i = 0;
+#if defined(__SSE2__)
+		const __m128 sign_mask = _mm_set1_ps(-0.0f);
+		const __m128 knees = _mm_set1_ps(knee);
+		const __m128 ranges = _mm_set1_ps(range);
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 zero = _mm_setzero_ps();
+		for (; i + 4 <= count; i += 4) {
+			__m128 x = _mm_loadu_ps(samples + i);
+			__m128 sign = _mm_and_ps(x, sign_mask);
+			__m128 magnitude = _mm_andnot_ps(sign_mask, x);
+			__m128 t = _mm_div_ps(_mm_max_ps(_mm_sub_ps(magnitude, knees), zero), ranges);
+			__m128 bent = _mm_add_ps(_mm_min_ps(magnitude, knees), _mm_mul_ps(ranges, _mm_div_ps(t, _mm_add_ps(one, t))));
+			_mm_storeu_ps(samples + i, _mm_or_ps(bent, sign));
+		}
+#endif
+		for (; i < count; i++) {
+			float magnitude = fabsf(samples[i]);
+			if (magnitude <= knee) continue;
+			float t = (magnitude - knee) / range;
+			samples[i] = copysignf(knee + range * t / (1 + t), samples[i]);
+		}
+	}
+
+	void AudioRing::allocate(size_t frames, int channels) {
+		buffer.assign(frames * channels, 0.0f);
+		write_index = 0;
+		read_index = 0;
+	}
+
+	size_t AudioRing::write(const float* samples, size_t count) {
+		if (buffer.empty()) return 0;
+
+		size_t write_position = write_index.load(std::memory_order_relaxed);
+		count = std::min(count, space());
+
+		size_t start = write_position % buffer.size();
+		size_t first = std::min(count, buffer.size() - start);
+		memcpy(buffer.data() + start, samples, first * sizeof(float));
+		memcpy(buffer.data(), samples + first, (count - first) * sizeof(float));
+
+		write_index.store(write_position + count, std::memory_order_release);
+		return count;
+	}
+
+	size_t AudioRing::peek(size_t count, const float*& first, size_t& first_count, const float*& second) {
+		count = buffer.empty() ? 0 : std::min(count, available());
+
+		size_t start = read_index.load(std::memory_order_relaxed) % std::max<size_t>(buffer.size(), 1);
+		first = buffer.data() + start;
+		first_count = std::min(count, buffer.size() - start);
+		second = buffer.data();
+		return count;
+	}
+
+	bool MixerInput::initialize() {
+		auto mixer = this->mixer.lock();
+		if (!mixer) {
+			error = "The mixer is gone";
+			return false;
+		}
+
+		format = mixer->get_format();
+		if (!format.channels) {
+			error = "Open the mixer before initializing its sources";
+			return false;
+		}
+
+		// The format never changes, so the ring is set up once and the mixer can keep reading it
+		if (!ring.is_allocated()) {
+			ring.allocate(format.sample_rate / 2, format.channels);
+		}
+
+		if (slot < 0 && !mixer->attach_source(this)) {
+			error = "The mixer can't take any more sources";
+			return false;
+		}
+
+		device_latency = mixer->get_stats().period_time / 1000.0;
+		needs_clock_base = true;
+		clear_clock_locked();
+
+		if (!feeder.joinable()) {
+			stop_feeder = false;
+			feeder = std::thread(&MixerInput::feed, this);
+		}
+
+		buffering = false;
+		return true;
+	}
+
+	bool MixerInput::play() {
+		if (is_playing) return false;
+		is_playing = true;
+		return true;
+	}
+
+	bool MixerInput::pause() {
+		if (!is_playing) return false;
+		is_playing = false;
+		freeze_clock_locked();
+		return true;
+	}
+
+	bool MixerInput::stop() {
+		is_playing = false;
+		freeze_clock_locked();
+		return true;
+	}
+
+	void MixerInput::reset() {
+		flush_requested = true;
+		needs_clock_base = true;
+		// The old base would have the mixer publish the old position again until the feeder sets a new one
+		clock_base_pts.store(-1, std::memory_order_relaxed);
+		clear_clock_locked();
+	}
+
+	void MixerInput::freeze_clock_locked() {
+		auto mixer = this->mixer.lock();
+		if (mixer) mixer->lock_device();
+		freeze_clock();
+		if (mixer) mixer->unlock_device();
+	}
+
+	void MixerInput::clear_clock_locked() {
+		auto mixer = this->mixer.lock();
+		if (mixer) mixer->lock_device();
+		clear_clock();
+		if (mixer) mixer->unlock_device();
+	}
+
+	void MixerInput::release() {
+		is_playing = false;
+		stop_feeder = true;
+		if (feeder.joinable()) feeder.join();
+
+		// remove_source clears slot, and may drop the last reference to us, so nothing here touches a member after it
+		auto mixer = this->mixer.lock();
+		if (!mixer) slot = -1;
+		else if (slot >= 0) mixer->remove_source(this);
+	}
+
+	void MixerInput::feed() {
+		FFMpegFrame_Ptr pending;
+		// Samples of pending already in the ring, a frame can be bigger than the whole ring
+		size_t written = 0;
+
+		while (!stop_feeder) {
+			if (!is_playing) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				continue;
+			}
+
+			if (!pending) pending = media_player->get_next_audio_frame();
+			if (!pending || pending->get_number_of_samples() <= 0) {
+				// Nothing decoded yet
+				pending = nullptr;
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				continue;
+			}
+
+			size_t count = (size_t) pending->get_number_of_samples() * format.channels;
+			if (!ring.space()) {
+				// Full, the mixer frees up a period every callback
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				continue;
+			}
+
+			if (!written && pending->get_presentation_timestamp() != AV_NOPTS_VALUE && needs_clock_base.exchange(false)) {
+				clock_base_sample.store(ring.get_write_position(), std::memory_order_relaxed);
+				clock_base_pts.store(pending->get_presentation_timestamp() * (media_player->get_current_media()->get_demuxer()->get_audio_stream()->get_time_base() * 1000.0), std::memory_order_relaxed);
+			}
+
+			// Whatever fits now, the rest once the mixer has read some
+			written += ring.write(reinterpret_cast<const float*>(pending->get_data()[0]) + written, count - written);
+			if (written == count) {
+				pending = nullptr;
+				written = 0;
+			}
+		}
+	}
+
+	bool AudioMixer::open() {
+		close();
+
+		if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+			error = "Unable to initialize the SDL2 audio subsystem";
+			return false;
+		}
+		subsystem_initialized = true;
+
+		int samples = 1;
+		while (samples < period_size && samples < 32768) samples <<= 1;
+
+		SDL_AudioSpec wanted{};
+		wanted.freq = requested_format.sample_rate ? requested_format.sample_rate : 48000;
+		wanted.channels = requested_format.channels ? requested_format.channels : 2;
+		wanted.format = AUDIO_F32SYS;
+		wanted.samples = samples;
+		wanted.callback = AudioMixer::audio_callback;
+		wanted.userdata = this;
+
+		// Always float, SDL converts if the device wants something else. Mixing in anything narrower would clip
+		SDL_AudioSpec obtained;
+		device = SDL_OpenAudioDevice(nullptr, 0, &wanted, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+		if (!device) {
+			error = std::string("Unable to open audio output! ") + SDL_GetError();
+			close();
+			return false;
+		}
+
+		format.sample_rate = obtained.freq;
+		format.channels = obtained.channels;
+		format.channel_layout = av_get_default_channel_layout(obtained.channels);
+		format.sample_format = AV_SAMPLE_FMT_FLT;
+		period_time = obtained.samples * 1000000.0 / obtained.freq;
+
+		fprintf(stderr, "Mixer output %u: %d Hz, %d channels, %d frame periods\n", device, format.sample_rate, format.channels, obtained.samples);
+
+		SDL_PauseAudioDevice(device, 0);
+		return true;
+	}
+
+	void AudioMixer::close() {
+		if (device) SDL_CloseAudioDevice(device);
+		device = 0;
+
+		// The sources try to remove themselves when they go, so let them go outside the lock
+		std::vector<MixerInput_Ptr> removed;
+		{
+			std::lock_guard<std::mutex> lock(sources_mutex);
+			for (auto& slot : slots) slot.store(nullptr, std::memory_order_release);
+			for (auto& source : sources) source->slot = -1;
+			removed.swap(sources);
+		}
+		removed.clear();
+
+		if (subsystem_initialized) SDL_QuitSubSystem(SDL_INIT_AUDIO);
+		subsystem_initialized = false;
+		format = AudioFormat{};
+	}
+
+	MixerInput_Ptr AudioMixer::add_source(FFMpegMediaPlayer_Ptr player) {
+		MixerInput_Ptr source{new MixerInput(player, shared_from_this())};
+
+		std::lock_guard<std::mutex> lock(sources_mutex);
+		sources.push_back(source);
+		return source;
+	}
+
+	bool AudioMixer::attach_source(MixerInput* source) {
+		std::lock_guard<std::mutex> lock(sources_mutex);
+		for (int i = 0; i < max_sources; i++) {
+			if (!slots[i].load(std::memory_order_relaxed)) {
+				// A source released (e.g. by the player switching media) and initialized again was taken out of sources
+				auto iter = std::find_if(sources.begin(), sources.end(), [source](MixerInput_Ptr& entry) { return entry.get() == source; });
+				if (iter == sources.end()) sources.push_back(source->shared_from_this());
+
+				source->slot = i;
+				slots[i].store(source, std::memory_order_release);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void AudioMixer::remove_source(MixerInput* source) {
+		MixerInput_Ptr removed;
+		{
+			std::lock_guard<std::mutex> lock(sources_mutex);
+			if (source->slot >= 0) slots[source->slot].store(nullptr, std::memory_order_release);
+			source->slot = -1;
+
+			auto iter = std::find_if(sources.begin(), sources.end(), [source](MixerInput_Ptr& entry) { return entry.get() == source; });
+			if (iter != sources.end()) {
+				removed = *iter;
+				sources.erase(iter);
+			}
+		}
+
+		// Taking the device lock waits for a callback that may still be reading the source
+		if (device) {
+			SDL_LockAudioDevice(device);
+			SDL_UnlockAudioDevice(device);
+		}
+	}
+
+	MixerStats AudioMixer::get_stats() {
+		MixerStats stats;
+		stats.callbacks = callbacks.load(std::memory_order_relaxed);
+		stats.total_time = total_time.load(std::memory_order_relaxed);
+		stats.max_time = max_time.load(std::memory_order_relaxed);
+		stats.underruns = underruns.load(std::memory_order_relaxed);
+		stats.period_time = period_time;
+		return stats;
+	}
+
+	void AudioMixer::reset_stats() {
+		callbacks = 0;
+		total_time = 0;
+		max_time = 0;
+		underruns = 0;
+	}
+
+	void AudioMixer::audio_callback(void* opaque, uint8_t* buffer, int len) {
+		auto* mixer = reinterpret_cast<AudioMixer*>(opaque);
+		auto start = mixer_clock::now();
+
+		mixer->mix(reinterpret_cast<float*>(buffer), len / (mixer->format.channels * (int) sizeof(float)), IAudioOutput::get_monotonic_time());
+
+		uint64_t time = std::chrono::duration_cast<std::chrono::microseconds>(mixer_clock::now() - start).count();
+		mixer->callbacks.fetch_add(1, std::memory_order_relaxed);
+		mixer->total_time.fetch_add(time, std::memory_order_relaxed);
+		uint64_t max = mixer->max_time.load(std::memory_order_relaxed);
+		while (time > max && !mixer->max_time.compare_exchange_weak(max, time, std::memory_order_relaxed)) {}
+	}
+
+	void AudioMixer::mix(float* output, int frames, int64_t time) {
+		const int channels = format.channels;
+		const size_t count = (size_t) frames * channels;
+		memset(output, 0, count * sizeof(float));
+		if (frames <= 0) return;
+
+		bool underrun = false;
+		for (auto& slot : slots) {
+			MixerInput* source = slot.load(std::memory_order_acquire);
+			if (!source) continue;
+
+			if (source->flush_requested.exchange(false)) source->ring.consume(source->ring.available());
+
+			// Constant power pan, normalised so the centre keeps the source's level
+			float gain = source->gain.load(std::memory_order_relaxed);
+			float left = gain, right = gain;
+			if (channels == 2) {
+				float angle = (source->pan.load(std::memory_order_relaxed) + 1) * (float) M_PI / 4;
+				left = gain * cosf(angle) * (float) M_SQRT2;
+				right = gain * sinf(angle) * (float) M_SQRT2;
+			}
+
+			if (!source->is_playing) {
+				source->current_left = left;
+				source->current_right = right;
+				continue;
+			}
+
+			const float* first;
+			const float* second;
+			size_t first_count;
+			size_t available = source->ring.peek(count, first, first_count, second);
+			if (available < count) underrun = true;
+
+			// The first sample mixed now is heard after the period the device holds, publish that as the source's clock
+			size_t read_position = source->ring.get_read_position();
+			size_t base_sample = source->clock_base_sample.load(std::memory_order_relaxed);
+			double base_pts = source->clock_base_pts.load(std::memory_order_relaxed);
+			if (base_pts >= 0 && read_position >= base_sample) {
+				double start_pts = base_pts + (read_position - base_sample) / channels * 1000.0 / format.sample_rate;
+				double latency = source->get_latency();
+				double heard = start_pts - latency;
+				source->publish_clock(heard, time, start_pts + available / channels * 1000.0 / format.sample_rate, true);
+				source->media_player->set_last_audio_pts(heard > 0 ? heard : 0);
+			}
+
+			// Ramp from where the last period ended, over the whole period, so gain and pan changes don't click
+			float step_left = (left - source->current_left) / frames;
+			float step_right = (right - source->current_right) / frames;
+			float start_left = source->current_left + step_left;
+			float start_right = source->current_right + step_right;
+
+			size_t first_frames = first_count / channels;
+			size_t second_frames = (available - first_count) / channels;
+			mix_ramp_f32(output, first, first_frames, channels, start_left, start_right, step_left, step_right);
+			mix_ramp_f32(output + first_count, second, second_frames, channels, start_left + step_left * first_frames, start_right + step_right * first_frames, step_left, step_right);
+			source->ring.consume(available);
+
+			source->current_left = left;
+			source->current_right = right;
+		}
+
+		if (underrun) underruns.fetch_add(1, std::memory_order_relaxed);
+
+		float master = master_gain.load(std::memory_order_relaxed);
+		if (master != current_master || master != 1.0f) {
+			float step = (master - current_master) / frames;
+			gain_ramp_f32(output, frames, channels, current_master + step, step);
+			current_master = master;
+		}
+
+		soft_clip_f32(output, count);
+	}
+}
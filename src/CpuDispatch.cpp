@@ -0,0 +1,111 @@
+#include "CpuDispatch.h"
+#include <cstdio>
+#include <cstdlib>
+
+namespace jp {
+
+static CpuLevel detect_cpu_level() {
+#if defined(JP_X86_DISPATCH)
+    // Also checks the OS saves the wider registers, so AVX isn't reported where it can't be used
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return CpuLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return CpuLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return CpuLevel::SSE4_1;
+    if (__builtin_cpu_supports("sse2")) return CpuLevel::SSE2;
+#endif
+    return CpuLevel::SCALAR;
+}
+
+CpuLevel get_detected_cpu_level() {
+    static const CpuLevel level = detect_cpu_level();
+    return level;
+}
+
+std::string get_cpu_level_name(CpuLevel level) {
+    switch (level) {
+        case CpuLevel::SCALAR: return "scalar";
+        case CpuLevel::SSE2: return "sse2";
+        case CpuLevel::SSE4_1: return "sse4.1";
+        case CpuLevel::AVX2: return "avx2";
+        case CpuLevel::AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+bool parse_cpu_level(const std::string& name, CpuLevel& level) {
+    for (CpuLevel candidate : {CpuLevel::SCALAR, CpuLevel::SSE2, CpuLevel::SSE4_1, CpuLevel::AVX2, CpuLevel::AVX512}) {
+        if (get_cpu_level_name(candidate) == name) {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+KernelTable get_kernel_table(CpuLevel level) {
+    if (level > get_detected_cpu_level()) level = get_detected_cpu_level();
+    
+    KernelTable table{simd::gain_f32_scalar, simd::gain_s16_scalar, simd::s16_to_f32_scalar, simd::f32_to_s16_scalar, simd::normalize_u8_f32_scalar};
+#if defined(JP_X86_DISPATCH)
+    if (level >= CpuLevel::SSE2) {
+        table = {simd::gain_f32_sse2, simd::gain_s16_sse2, simd::s16_to_f32_sse2, simd::f32_to_s16_sse2, simd::normalize_u8_f32_sse2};
+    }
+    if (level >= CpuLevel::SSE4_1) {
+        // Only the 16 bit kernels gain anything from the sign extending loads
+        table.gain_s16 = simd::gain_s16_sse41;
+        table.s16_to_f32 = simd::s16_to_f32_sse41;
+    }
+    if (level >= CpuLevel::AVX2) {
+        table = {simd::gain_f32_avx2, simd::gain_s16_avx2, simd::s16_to_f32_avx2, simd::f32_to_s16_avx2, simd::normalize_u8_f32_avx2};
+    }
+    if (level >= CpuLevel::AVX512) {
+        table = {simd::gain_f32_avx512, simd::gain_s16_avx512, simd::s16_to_f32_avx512, simd::f32_to_s16_avx512, simd::normalize_u8_f32_avx512};
+    }
+#endif
+    return table;
+}
+
+struct KernelBinding {
+    CpuLevel level;
+    KernelTable table;
+};
+
+static KernelBinding make_initial_binding() {
+    CpuLevel level = get_detected_cpu_level();
+    
+    const char* forced = getenv("JAGUNMOLU_CPU_LEVEL");
+    CpuLevel requested;
+    if (forced && parse_cpu_level(forced, requested)) {
+        if (requested <= level) {
+            level = requested;
+        } else {
+            fprintf(stderr, "This CPU doesn't support %s, staying on %s\n", forced, get_cpu_level_name(level).c_str());
+        }
+    }
+    
+    return {level, get_kernel_table(level)};
+}
+
+static KernelBinding& get_binding() {
+    static KernelBinding binding = make_initial_binding();
+    return binding;
+}
+
+CpuLevel get_cpu_level() {
+    return get_binding().level;
+}
+
+bool set_cpu_level(CpuLevel level) {
+    if (level > get_detected_cpu_level()) return false;
+    
+    auto& binding = get_binding();
+    binding.level = level;
+    binding.table = get_kernel_table(level);
+    return true;
+}
+
+const KernelTable& get_kernels() {
+    return get_binding().table;
+}
+
+}
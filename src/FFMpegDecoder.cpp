@@ -1,75 +1,186 @@
 #include "FFMpegDecoder.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 namespace jp {
+    std::atomic<int> FFMpegDecoder::active_decoders{0};
+    
     /// Decodes this packet and returns the list of decoded frames. If an error occurred, the error string will be set to the specified value and an empty vector will be returned
     std::vector<FFMpegFrame_Ptr> FFMpegDecoder::decode(FFMpegPacket_Ptr packet) {
-        std::vector<FFMpegFrame_Ptr> frames;
-        int error;
-        if ((error = avcodec_send_packet(params.codec_context, packet->internal) >= 0)) {
-            FFMpegFrame_Ptr frame_ptr{new FFMpegFrame()};
-            
-            while ((error = avcodec_receive_frame(params.codec_context, frame_ptr->internal)) >= 0) {
-                frames.emplace_back(frame_ptr);
-                frame_ptr.reset(new FFMpegFrame());
-            }
-            
-        } else {
-            if (error == AVERROR_EOF) {
-                this->error = "Decoder flushed! No more receiving packets";
-            }
-            if (error == AVERROR(EAGAIN)) {
-                this->error = "Input not accepted in current state";
-            }
-            if (error == AVERROR(EINVAL)) {
-                this->error = "Invalid argument!";
-            }
-        }
+        FFMpegFrameBuffer output;
+        decode(packet, output);
         
+        std::vector<FFMpegFrame_Ptr> frames;
+        for (size_t i = 0; i < output.size(); i++) frames.emplace_back(output[i]);
         return frames;
     }
     
     /// Flush this decoder and returns its buffered frames
     std::vector<FFMpegFrame_Ptr> FFMpegDecoder::flush() {
-        fprintf(stderr, "Flushing...\n");
+        FFMpegFrameBuffer output;
+        flush(output);
+        
         std::vector<FFMpegFrame_Ptr> frames;
+        for (size_t i = 0; i < output.size(); i++) frames.emplace_back(output[i]);
+        return frames;
+    }
+    
+    int FFMpegDecoder::decode(const FFMpegPacket_Ptr& packet, FFMpegFrameBuffer& output) {
+        if (!packet) return 0;
         
-        int error = 0;
-        if ((error = avcodec_send_packet(params.codec_context, nullptr)) >= 0) {
-            fprintf(stderr, "Sent flush packet!\n");
-            FFMpegFrame_Ptr frame_ptr{new FFMpegFrame()};
-            
-            while ((error = avcodec_receive_frame(params.codec_context, frame_ptr->internal)) >= 0) {
-                fprintf(stderr, "Got one flush frame!\n");
-                frames.emplace_back(frame_ptr);
-                frame_ptr.reset(new FFMpegFrame());
-            }
-            char buf[2048];
-            fprintf(stderr, "Error gotten from decoder: %s\n", av_make_error_string(buf, 2048, error));
-            
-            if (frames.empty()) {
-                fprintf(stderr, "No frame was gotten from flush!\n");
+        auto start = std::chrono::steady_clock::now();
+        int frames = send_packet(packet->internal, output);
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        record_decode_time(elapsed.count(), frames);
+        
+        return frames;
+    }
+    
+    int FFMpegDecoder::decode(const std::vector<FFMpegPacket_Ptr>& packets, FFMpegFrameBuffer& output) {
+        int frames = 0;
+        for (auto& packet : packets) {
+            frames += decode(packet, output);
+        }
+        return frames;
+    }
+    
+    int FFMpegDecoder::flush(FFMpegFrameBuffer& output) {
+        return send_packet(nullptr, output);
+    }
+    
+    void FFMpegDecoder::reset_buffers() {
+        if (params.codec_context) avcodec_flush_buffers(params.codec_context);
+        finished = false;
+    }
+    
+    int FFMpegDecoder::send_packet(AVPacket* packet, FFMpegFrameBuffer& output) {
+        int frames = 0;
+        int ret;
+        while ((ret = avcodec_send_packet(params.codec_context, packet)) == AVERROR(EAGAIN)) {
+            // The decoder has frames waiting, they have to come out before it takes more input
+            int received = receive_frames(output);
+            if (received == 0) break;
+            frames += received;
+        }
+        
+        if (ret < 0) {
+            set_error(ret);
+            return frames;
+        }
+        
+        return frames + receive_frames(output);
+    }
+    
+    int FFMpegDecoder::receive_frames(FFMpegFrameBuffer& output) {
+        int frames = 0;
+        while (true) {
+            if (avcodec_receive_frame(params.codec_context, output.next_frame()) < 0) {
+                output.discard_last();
+                break;
             }
-            
+            frames++;
+        }
+        return frames;
+    }
+    
+    void FFMpegDecoder::set_error(int code) {
+        if (code == AVERROR_EOF) {
+            error = "Decoder flushed! No more receiving packets";
+        } else if (code == AVERROR(EAGAIN)) {
+            error = "Input not accepted in current state";
+        } else if (code == AVERROR(EINVAL)) {
+            error = "Invalid argument!";
         } else {
-            fprintf(stderr, "Error while flushing!\n");
-            if (error == AVERROR_EOF) {
-                this->error = "Decoder flushed! No more receiving frames";
-            }
-            if (error == AVERROR(EAGAIN)) {
-                this->error = "Input not accepted in current state";
+            char buffer[AV_ERROR_MAX_STRING_SIZE];
+            error = av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, code);
+        }
+    }
+    
+    void FFMpegDecoder::record_decode_time(uint64_t micros, size_t frames) {
+        stat_packets++;
+        stat_frames += frames;
+        stat_total_time += micros;
+        
+        uint64_t max = stat_max_time;
+        while (micros > max && !stat_max_time.compare_exchange_weak(max, micros)) {}
+    }
+    
+    DecoderStats FFMpegDecoder::get_stats() {
+        DecoderStats stats;
+        stats.packets = stat_packets;
+        stats.frames = stat_frames;
+        stats.total_decode_time = stat_total_time;
+        stats.max_decode_time = stat_max_time;
+        
+        if (params.codec_context) {
+            stats.thread_count = params.codec_context->thread_count;
+            if (params.codec_context->active_thread_type & FF_THREAD_FRAME) {
+                stats.thread_type = DecoderThreadType::THREAD_TYPE_FRAME;
+            } else if (params.codec_context->active_thread_type & FF_THREAD_SLICE) {
+                stats.thread_type = DecoderThreadType::THREAD_TYPE_SLICE;
             }
-            if (error == AVERROR(EINVAL)) {
-                this->error = "Invalid argument!";
+        }
+        
+        return stats;
+    }
+    
+    void FFMpegDecoder::reset_stats() {
+        stat_packets = 0;
+        stat_frames = 0;
+        stat_total_time = 0;
+        stat_max_time = 0;
+    }
+    
+    void FFMpegDecoder::apply_threading_policy(AVCodecContext* codec_context, const AVCodec* codec, const DecoderThreadingPolicy& policy) {
+        if (!codec_context || !codec) return;
+        
+        int thread_count = policy.thread_count;
+        if (thread_count <= 0) {
+            int cores = std::max(1, (int) std::thread::hardware_concurrency());
+            thread_count = std::max(1, cores / (get_active_decoders() + 1));
+            thread_count = std::min(thread_count, std::max(1, policy.max_threads));
+        }
+        
+        int thread_type = 0;
+        switch (policy.type) {
+        case DecoderThreadType::THREAD_TYPE_FRAME:
+            thread_type = FF_THREAD_FRAME;
+            break;
+        case DecoderThreadType::THREAD_TYPE_SLICE:
+            thread_type = FF_THREAD_SLICE;
+            break;
+        case DecoderThreadType::THREAD_TYPE_NONE:
+            thread_count = 1;
+            break;
+        case DecoderThreadType::THREAD_TYPE_AUTO:
+            // Prefer frame threading for throughput, fall back to slices if that's all the codec can do
+            if (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
+                thread_type = FF_THREAD_FRAME;
+            } else if (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
+                thread_type = FF_THREAD_SLICE;
             }
+            break;
         }
         
-        fprintf(stderr, "Flushed %zu frames\n", frames.size());
+        if (thread_type == 0) thread_count = 1;
         
-        return frames;
+        codec_context->thread_count = thread_count;
+        codec_context->thread_type = thread_type;
+    }
+    
+    void FFMpegDecoder::register_active() {
+        if (counted_active) return;
+        counted_active = true;
+        active_decoders++;
     }
     
     void FFMpegDecoder::release() {
         avcodec_free_context(&params.codec_context);
+        if (counted_active) {
+            active_decoders--;
+            counted_active = false;
+        }
     }
 
 }
@@ -1,29 +1,127 @@
 #include "FFMpegDemuxer.h"
+#include <chrono>
+#include <thread>
 
 namespace jp {
 	FFMpegDemuxer::FFMpegDemuxer(FFMpegIOContext_Ptr& context) : io_context(context) {}
 	
+	using startup_clock = std::chrono::steady_clock;
+	
 	bool FFMpegDemuxer::initialize() {
 	    release();
+	    startup_timings = StartupTimings{};
+	    auto phase_start = startup_clock::now();
+	    auto end_phase = [&phase_start]() {
+	        auto now = startup_clock::now();
+	        uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - phase_start).count();
+	        phase_start = now;
+	        return elapsed;
+	    };
+	    
+		if (!open_input(startup_options.probe_size, startup_options.analyze_duration)) return false;
+		startup_timings.open_input = end_phase();
+		
+		if (avformat_find_stream_info(format_context, nullptr) < 0) {
+		    error = "Couldn't find stream info!";
+		    return false;
+		}
+		startup_timings.find_stream_info = end_phase();
+		
+		if (!find_streams()) return false;
+		
+		if (!audio_enabled && has_audio_stream) {
+		    format_context->streams[audio_stream->index]->discard = AVDISCARD_ALL;
+		    has_audio_stream = false;
+		    audio_stream = nullptr;
+		    if (!has_video_stream) {
+		        error = "No video stream found.";
+		        return false;
+		    }
+		}
+        
+        // libavcodec serialises the codecs whose init isn't thread safe itself, the rest (most video decoders) open alongside the audio decoder
+        std::string video_error;
+        bool video_opened = true;
+        std::thread video_opener;
+        if (has_video_stream) {
+            auto open_video = [&]() {
+                video_opened = open_decoder(DecoderType::DECODER_TYPE_VIDEO, video_stream, video_decoder_internal, video_threading, video_decoder_context, video_decoder, video_error);
+            };
+            if (startup_options.parallel_decoders && has_audio_stream) video_opener = std::thread(open_video);
+            else open_video();
+        }
+        
+        bool audio_opened = !has_audio_stream || open_decoder(DecoderType::DECODER_TYPE_AUDIO, audio_stream, audio_decoder_internal, audio_threading, audio_decoder_context, audio_decoder, error);
+        if (video_opener.joinable()) video_opener.join();
+        
+        if (!audio_opened) return false;
+        if (!video_opened) {
+            error = video_error;
+            return false;
+        }
+        startup_timings.open_decoders = end_phase();
+        
+        // avformat_find_stream_info keeps the packets it read buffered, so carrying on from here doesn't read them twice
+        if (!startup_options.reuse_probe_packets) {
+            reset();
+        } else {
+            if (audio_decoder) audio_decoder->set_finished(false);
+            if (video_decoder) video_decoder->set_finished(false);
+        }
+        
+        initialized = true;
+        finished = false;
+
+		return true;
+	}
+	
+	bool FFMpegDemuxer::probe(int64_t probe_size) {
+	    release();
+	    
+	    // The analysis only runs when the headers aren't enough, half a second of media is plenty to fill in the parameters
+	    if (!open_input(probe_size, 500000)) return false;
+	    
+	    if (!find_streams() || !has_stream_parameters()) {
+	        // libavformat may decode a frame or two of its own here, our decoders stay closed
+	        if (avformat_find_stream_info(format_context, nullptr) < 0) {
+	            error = "Couldn't find stream info!";
+	            return false;
+	        }
+	        if (!find_streams()) return false;
+	    }
+	    
+	    probed = true;
+	    return true;
+	}
+	
+	bool FFMpegDemuxer::open_input(int64_t probe_size, int64_t analyze_duration) {
 		format_context = avformat_alloc_context();
 		if (!format_context) {
 			error = "FFMPEG_DEMUXER: Unable to allocate format context!";
 			return false;
 		}
 		
-		format_context->pb = io_context->get_context_internal();
+		// The IO context may have been read by an earlier probe or parse
+		AVIOContext* pb = io_context->get_context_internal();
+		if (avio_tell(pb) != 0) avio_seek(pb, 0, SEEK_SET);
+		
+		format_context->pb = pb;
 		AVFormatContext* context = format_context;
 		
+		// Bounded probing. probesize limits both the format probe and the stream info
+		if (probe_size > 0) format_context->probesize = probe_size;
+		if (analyze_duration > 0) format_context->max_analyze_duration = analyze_duration;
+		
 		if (avformat_open_input(&context, nullptr, nullptr, nullptr) < 0) {
+		    // avformat_open_input frees the context when it fails
+		    format_context = nullptr;
 		    error = "FFMPEG_DEMUXER: Unable to open input file!";
 		    return false;
 		}
-		
-		if (avformat_find_stream_info(format_context, nullptr) < 0) {
-		    error = "Couldn't find stream info!";
-		    return false;
-		}
-		
+		return true;
+	}
+	
+	bool FFMpegDemuxer::find_streams() {
 		int audio_stream_index = av_find_best_stream(format_context, AVMEDIA_TYPE_AUDIO, -1, -1, &audio_decoder_internal, 0);
 		has_audio_stream = audio_stream_index >= 0;
 		
@@ -39,31 +137,8 @@ namespace jp {
 		    audio_stream.reset(new FFMpegStream());
 		    audio_stream->index = audio_stream_index;
 		    audio_stream->internal = format_context->streams[audio_stream_index];
-		    AVCodecContext* codec_context = avcodec_alloc_context3(audio_decoder_internal);
-		    if (!codec_context) {
-		        error = "Couldn't allocate context for audio decoder!";
-		        return false;
-		    }
-		    
-		    if (avcodec_parameters_to_context(codec_context, audio_stream->internal->codecpar) < 0) {
-		        error = "Unable to initialize the audio decoder context";
-		        return false;
-		    }
-		    
-		    // Open the codec
-		    if (avcodec_open2(codec_context, audio_decoder_internal, nullptr) < 0) {
-		        error = "Couldn't open audio decoder";
-		        return false;
-		    }
-            
-            audio_decoder_context = codec_context;
-		    
-		    FFMpegDecoder* decoder = new FFMpegDecoder(DecoderType::DECODER_TYPE_AUDIO);
-		    DecoderParams decoder_params;
-		    decoder_params.codec = audio_decoder_internal;
-		    decoder_params.codec_context = audio_decoder_context;
-		    decoder->params = decoder_params;
-		    audio_decoder.reset(decoder);
+		} else {
+		    audio_stream = nullptr;
 		}
 		
 		if (has_video_stream) {
@@ -71,39 +146,90 @@ namespace jp {
             video_stream->index = video_stream_index;
             video_stream->internal = format_context->streams[video_stream_index];
             video_stream->attached_pic = format_context->streams[video_stream_index]->disposition & AV_DISPOSITION_ATTACHED_PIC;
-            AVCodecContext* codec_context = avcodec_alloc_context3(video_decoder_internal);
-            if (!codec_context) {
-                error = "Couldn't allocate context for video decoder!";
-                return false;
-            }
-            
-            if (avcodec_parameters_to_context(codec_context, video_stream->internal->codecpar) < 0) {
-                error = "Unable to initialize the video decoder context";
-                return false;
-            }
-            
-            // Open the codec
-            if (avcodec_open2(codec_context, video_decoder_internal, nullptr) < 0) {
-                error = "Couldn't open video decoder";
-                return false;
-            }
-            
-            video_decoder_context = codec_context;
-            
-            FFMpegDecoder* decoder = new FFMpegDecoder(DecoderType::DECODER_TYPE_VIDEO);
-            DecoderParams decoder_params;
-            decoder_params.codec = video_decoder_internal;
-            decoder_params.codec_context = video_decoder_context;
-            decoder->params = decoder_params;
-            video_decoder.reset(decoder);
+        } else {
+            video_stream = nullptr;
         }
-        
-        reset();
-        
-        initialized = true;
-        finished = false;
-
-		return true;
+        return true;
+	}
+	
+	bool FFMpegDemuxer::has_stream_parameters() {
+	    // The sample and pixel formats are left out: demuxers only fill them in for raw codecs, so asking for them would analyse nearly every file
+	    if (has_audio_stream) {
+	        AVCodecParameters* parameters = audio_stream->internal->codecpar;
+	        if (parameters->codec_id == AV_CODEC_ID_NONE || parameters->sample_rate <= 0 || parameters->channels <= 0) return false;
+	    }
+	    if (has_video_stream) {
+	        AVCodecParameters* parameters = video_stream->internal->codecpar;
+	        if (parameters->codec_id == AV_CODEC_ID_NONE || parameters->width <= 0 || parameters->height <= 0) return false;
+	    }
+	    // Most containers keep the duration in the stream headers, the container's own is only worked out by avformat_find_stream_info
+	    return get_duration() > 0;
+	}
+	
+	uint64_t FFMpegDemuxer::get_duration() {
+	    if (!format_context) return 0;
+	    if (format_context->duration != AV_NOPTS_VALUE) return format_context->duration;
+	    
+	    int64_t longest = 0;
+	    for (auto& stream : {audio_stream, video_stream}) {
+	        if (!stream || stream->internal->duration == AV_NOPTS_VALUE) continue;
+	        int64_t duration = av_rescale_q(stream->internal->duration, stream->internal->time_base, AVRational{1, AV_TIME_BASE});
+	        if (duration > longest) longest = duration;
+	    }
+	    return longest;
+	}
+	
+	Metadata FFMpegDemuxer::get_metadata() {
+	    Metadata metadata;
+	    if (!format_context) return metadata;
+	    
+	    auto add_tags = [&metadata](AVDictionary* tags) {
+	        AVDictionaryEntry* entry = nullptr;
+	        while ((entry = av_dict_get(tags, "", entry, AV_DICT_IGNORE_SUFFIX))) {
+	            // insert keeps what's there, so the container's tags win over the streams'
+	            metadata.insert({entry->key, entry->value});
+	        }
+	    };
+	    
+	    add_tags(format_context->metadata);
+	    if (audio_stream) add_tags(audio_stream->internal->metadata);
+	    if (video_stream) add_tags(video_stream->internal->metadata);
+	    return metadata;
+	}
+	
+	bool FFMpegDemuxer::open_decoder(DecoderType type, FFMpegStream_Ptr& stream, AVCodec* codec, const DecoderThreadingPolicy& threading, AVCodecContext*& decoder_context, FFMpegDecoder_Ptr& decoder, std::string& error) {
+	    std::string name = type == DecoderType::DECODER_TYPE_AUDIO ? "audio" : "video";
+	    
+	    AVCodecContext* codec_context = avcodec_alloc_context3(codec);
+	    if (!codec_context) {
+	        error = "Couldn't allocate context for " + name + " decoder!";
+	        return false;
+	    }
+	    
+	    if (avcodec_parameters_to_context(codec_context, stream->internal->codecpar) < 0) {
+	        error = "Unable to initialize the " + name + " decoder context";
+	        return false;
+	    }
+	    
+	    FFMpegDecoder::apply_threading_policy(codec_context, codec, threading);
+	    
+	    // Open the codec
+	    if (avcodec_open2(codec_context, codec, nullptr) < 0) {
+	        error = "Couldn't open " + name + " decoder";
+	        return false;
+	    }
+	    
+	    decoder_context = codec_context;
+	    
+	    FFMpegDecoder* new_decoder = new FFMpegDecoder(type);
+	    DecoderParams decoder_params;
+	    decoder_params.codec = codec;
+	    decoder_params.codec_context = codec_context;
+	    new_decoder->params = decoder_params;
+	    // Counted from the moment it's open, whether a player plays it yet or not
+	    if (threading.thread_count <= 0 && threading.type != DecoderThreadType::THREAD_TYPE_NONE) new_decoder->register_active();
+	    decoder.reset(new_decoder);
+	    return true;
 	}
     
     FFMpegPacket_Ptr FFMpegDemuxer::get_next_packet() {
@@ -155,7 +281,33 @@ namespace jp {
         return ret >= 0;
     }
     
+    bool FFMpegDemuxer::seek_to_keyframe(uint64_t position) {
+        if (!has_video_stream) return false;
+        finished = false;
+        AVStream* stream = video_stream->internal;
+        int64_t timestamp = av_rescale_q(position, AVRational{1, 1000}, stream->time_base);
+        if (stream->start_time != AV_NOPTS_VALUE) timestamp += stream->start_time;
+        // Without AVSEEK_FLAG_ANY libavformat only lands on keyframes, the open range lets it pick the closest one either side
+        return avformat_seek_file(format_context, video_stream->index, INT64_MIN, timestamp, INT64_MAX, 0) >= 0;
+    }
+    
+    std::vector<uint64_t> FFMpegDemuxer::get_keyframe_times() {
+        std::vector<uint64_t> times;
+        if (!has_video_stream) return times;
+        AVStream* stream = video_stream->internal;
+        int64_t start_time = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        for (int i = 0; i < stream->nb_index_entries; i++) {
+            const AVIndexEntry& entry = stream->index_entries[i];
+            if (!(entry.flags & AVINDEX_KEYFRAME) || entry.timestamp < start_time) continue;
+            times.push_back(av_rescale_q(entry.timestamp - start_time, stream->time_base, AVRational{1, 1000}));
+        }
+        return times;
+    }
+    
     void FFMpegDemuxer::release() {
+        initialized = false;
+        probed = false;
+        finished = true;
         if (format_context) {
             avformat_free_context(format_context);
             format_context = nullptr;
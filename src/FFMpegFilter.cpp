@@ -7,14 +7,20 @@ namespace jp {
 FFMpegFilter::FFMpegFilter() {}
 
 bool FFMpegFilter::initialize() {
-    std::string final_val;
-    std::for_each(properties.begin(), properties.end(), [&final_val] (std::pair<std::string, std::string> pair) {
-        final_val += pair.first + "=" + pair.second + ":";
-    });
+    std::string final_val = get_arguments();
     
-    final_val.pop_back();
+    // Created after its graph was configured: the graph is built from the arguments later, so only check them here
+    AVFilterGraph* scratch = nullptr;
+    AVFilterContext* context = filter_context;
+    if (!context) {
+        scratch = avfilter_graph_alloc();
+        context = scratch ? avfilter_graph_alloc_filter(scratch, filter, name.c_str()) : nullptr;
+    }
+    
+    bool good = context && avfilter_init_str(context, final_val.empty() ? nullptr : final_val.c_str()) >= 0;
+    avfilter_graph_free(&scratch);
     
-    if (avfilter_init_str(filter_context, final_val.empty() ? nullptr : final_val.c_str()) < 0) {
+    if (!good) {
         fprintf(stderr, "Not initializing filter!\n");
         return false;
     }
@@ -22,6 +28,17 @@ bool FFMpegFilter::initialize() {
     return true;
 }
 
+std::string FFMpegFilter::get_arguments() {
+    std::string final_val;
+    std::for_each(properties.begin(), properties.end(), [&final_val] (std::pair<std::string, std::string> pair) {
+        final_val += pair.first + "=" + pair.second + ":";
+    });
+    
+    if (!final_val.empty()) final_val.pop_back();
+    
+    return final_val;
+}
+
 void FFMpegFilter::set_property(std::string key, std::string value) {
     properties[key] = value;
 }
@@ -36,10 +53,11 @@ FFMpegFilter_Ptr FFMpegFilter::get_filter(FFMpegFilterGraph* graph, std::string
     filt->filter = avfilter_get_by_name(name.c_str());
     if (!filt->filter) return nullptr;
     
-    filt->filter_context = avfilter_graph_alloc_filter(graph->graph_internal, filt->filter, av_strdup(name.c_str()));
-    
-    if (!filt->filter_context) {
-        return nullptr;
+    // Filters created once the graph is configured go straight into the graphs built from it, see FFMpegFilterGraph::get_allocation_graph
+    AVFilterGraph* allocation_graph = graph->get_allocation_graph();
+    if (allocation_graph) {
+        filt->filter_context = avfilter_graph_alloc_filter(allocation_graph, filt->filter, name.c_str());
+        if (!filt->filter_context) return nullptr;
     }
     
     filt->name = name;
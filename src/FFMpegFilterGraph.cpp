@@ -1,8 +1,16 @@
 #include "FFMpegFilterGraph.h"
 #include <algorithm>
+#include <chrono>
+#include <cinttypes>
 
 namespace jp {
 
+using filter_clock = std::chrono::steady_clock;
+
+static uint64_t elapsed_us(filter_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(filter_clock::now() - start).count();
+}
+
 FFMpegFilterGraph::FFMpegFilterGraph(int sample_format, std::string channel_layout, int sample_rate, std::string time_base) {
     initialized = true;
     graph_internal = avfilter_graph_alloc();
@@ -15,6 +23,9 @@ FFMpegFilterGraph::FFMpegFilterGraph(int sample_format, std::string channel_layo
     
     avfilter_graph_set_auto_convert(graph_internal, AVFILTER_AUTO_CONVERT_ALL);
     
+    // Audio filters are cheap enough that waking up worker threads costs more than it saves
+    threading.threads = 1;
+    
     input = create_filter("abuffer");
     input->set_property("sample_fmt", std::to_string(sample_format));
     input->set_property("channel_layout", channel_layout);
@@ -51,8 +62,21 @@ FFMpegFilterGraph::FFMpegFilterGraph(int pixel_format, int width, int height, st
 
 FFMpegFilterGraph::~FFMpegFilterGraph() {
     fprintf(stderr, "Cleaning up filters...");
+    if (builder.joinable()) builder.join();
+    free_pending_graph(pending_graph.exchange(nullptr));
+    
+    free_stages(stages);
     avfilter_graph_free(&graph_internal);
     filters.clear();
+    
+    for (auto frame : queued_frames) av_frame_free(&frame);
+    for (auto frame : held_frames) av_frame_free(&frame);
+    for (auto frame : free_frames) av_frame_free(&frame);
+}
+
+AVFilterGraph* FFMpegFilterGraph::get_allocation_graph() {
+    if (!configured && !passthrough) return graph_internal;
+    return nullptr;
 }
 
 FFMpegFilter_Ptr FFMpegFilterGraph::create_filter(std::string name) {
@@ -62,23 +86,29 @@ FFMpegFilter_Ptr FFMpegFilterGraph::create_filter(std::string name) {
 bool FFMpegFilterGraph::add_filter(FFMpegFilter_Ptr filter) {
     if (!filter) return false;
     
+    std::lock_guard<std::mutex> lock(filters_mutex);
     filters.push_back(filter);
+    dirty = true;
     
     return true;
 }
 
 bool FFMpegFilterGraph::remove_filter(int index) {
-    if (index >= (int) filters.size()) return false;
-    auto filter = filters[index];
+    std::lock_guard<std::mutex> lock(filters_mutex);
+    if (index < 0 || index >= (int) filters.size()) return false;
     
-    return remove_filter(filter);
+    filters.erase(filters.begin() + index);
+    dirty = true;
+    return true;
 }
 
 bool FFMpegFilterGraph::remove_filter(FFMpegFilter_Ptr filter) {
+    std::lock_guard<std::mutex> lock(filters_mutex);
     auto iter = filters.begin();
     for (;iter != filters.end(); ++iter) {
         if ((*iter) == filter) {
             filters.erase(iter);
+            dirty = true;
             return true;
         }
     }
@@ -90,110 +120,661 @@ bool FFMpegFilterGraph::move_filter(FFMpegFilter_Ptr filter, int filter_index, i
     // Same index
     if (filter_index == new_index) return true;
     
+    std::lock_guard<std::mutex> lock(filters_mutex);
     if (filter_index < 0 || new_index < 0 || filter_index >= (int)filters.size() || new_index >= (int)filters.size()) return false;
     
+    // Check for filter pointer equality
+    if (!filter || filters[filter_index] != filter) return false;
+    
     // 0 1 2 3 4
     // 0 2 3 4
     // 0 2 1 3 4
-    auto temp = get_filter(filter_index);
-    auto new_filter = get_filter(new_index);
+    filters.erase(filters.begin() + filter_index);
+    filters.insert(filters.begin() + new_index, filter);
+    dirty = true;
     
-    // Check for filter pointer equality
-    if (temp != filter) return false;
+    return true;
+}
+
+FFMpegFilter_Ptr FFMpegFilterGraph::get_filter(int index) {
+    std::lock_guard<std::mutex> lock(filters_mutex);
+    if (index >= (int) filters.size() || index < 0) return nullptr;
+    return filters[index];
+}
+
+bool FFMpegFilterGraph::configure() {
+    // Frames may already be flowing, build the new graph next to the running one
+    if (configured || passthrough) {
+        return dirty ? reconfigure() : true;
+    }
     
-    if (!temp || !new_filter) {
-        return false;
+    dirty = false;
+    
+    // Nothing would touch the frames, skip building the graph until a real filter shows up
+    if (is_identity_chain()) {
+        passthrough = true;
+        pass_held_frames();
+        return true;
     }
     
-    if (!remove_filter(filter)) {
+    auto graph_template = make_template();
+    bool restock = false;
+    PendingGraph* graph = acquire_graph(graph_template, restock);
+    if (!graph) {
+        error = "Unable to configure filter graph!";
+        // Nothing will take them, and nothing more is held back
+        configure_failed = true;
+        for (auto frame : held_frames) av_frame_free(&frame);
+        held_frames.clear();
         return false;
     }
+    configure_failed = false;
     
-    if (filter_index > new_index) {
-        auto iter = filters.begin();
-        for (; iter != filters.end(); iter++) {
-            
-            if (*iter == new_filter) {
-                filters.emplace(iter);
-                return true;
-            }
-        }
-    } else {
-        auto iter = filters.begin();
-        for (; iter != filters.end(); iter++) {   
-            if (*iter == new_filter) {
-                filters.emplace(++iter);
-                return true;
-            }
+    // Nothing is flowing yet, so the graph can go in right away. Frames held back until now go into it, a rejected one is reported through get_error
+    publish_graph(graph);
+    apply_pending_configuration();
+    
+    // The next graph opened with the same chain and input gets a spare, if this setup keeps coming back
+    if (restock) {
+        if (builder.joinable()) builder.join();
+        builder = std::thread([graph_template]() {
+            prepare_cached_graph(graph_template);
+        });
+    }
+    
+    return true;
+}
+
+bool FFMpegFilterGraph::reconfigure() {
+    if (!initialized) return false;
+    
+    // A rebuild that's still running gets replaced by this one once both are done
+    if (builder.joinable()) builder.join();
+    
+    dirty = false;
+    
+    if (is_identity_chain()) {
+        publish_graph(new PendingGraph());
+        return true;
+    }
+    
+    // Copy everything the builder needs now, the caller is free to keep changing the filters
+    auto graph_template = make_template();
+    
+    builder = std::thread([this, graph_template]() {
+        bool restock = false;
+        auto graph = acquire_graph(graph_template, restock);
+        if (graph) publish_graph(graph);
+        if (restock) prepare_cached_graph(graph_template);
+    });
+    
+    return true;
+}
+
+bool FFMpegFilterGraph::set_description(std::string description) {
+    if (description == this->description) return true;
+    
+    this->description = description;
+    dirty = true;
+    
+    return true;
+}
+
+void FFMpegFilterGraph::set_threading(FilterGraphThreading threading) {
+    if (threading.threads == this->threading.threads && threading.per_filter_timing == this->threading.per_filter_timing) return;
+    
+    this->threading = threading;
+    dirty = true;
+}
+
+std::vector<FilterTiming> FFMpegFilterGraph::get_filter_timings() {
+    std::lock_guard<std::mutex> lock(timing_mutex);
+    std::vector<FilterTiming> timings;
+    for (size_t i = 0; i < stages.size(); i++) {
+        FilterTiming timing;
+        timing.name = stages[i].name;
+        timing.frames = stage_timers[i].frames.load(std::memory_order_relaxed);
+        timing.total_time = stage_timers[i].total_time.load(std::memory_order_relaxed);
+        timings.push_back(timing);
+    }
+    
+    return timings;
+}
+
+void FFMpegFilterGraph::reset_filter_timings() {
+    std::lock_guard<std::mutex> lock(timing_mutex);
+    for (size_t i = 0; i < stages.size(); i++) {
+        stage_timers[i].frames = 0;
+        stage_timers[i].total_time = 0;
+    }
+}
+
+bool FFMpegFilterGraph::send_command(FFMpegFilter_Ptr filter, std::string value) {
+    if (!filter) return false;
+    
+    // apply_pending_configuration frees and swaps the stages under this lock on the thread feeding the graph
+    std::lock_guard<std::mutex> lock(timing_mutex);
+    if (stages.empty()) return false;
+    
+    char response[2048];
+    bool sent = false;
+    // The filter lives in exactly one stage, the others don't know it
+    for (auto& stage : stages) {
+        response[0] = '\0';
+        int result = avfilter_graph_send_command(stage.graph, filter->get_name().c_str(), filter->get_name().c_str(), value.c_str(), response, sizeof(response), 0);
+        if (result >= 0) {
+            fprintf(stderr, "Sent command! Response: %s\n", response);
+            sent = true;
+        } else if (result != AVERROR(ENOSYS)) {
+            fprintf(stderr, "Unable to send command! Response: %s\n", response);
+            fprintf(stderr, "Reason: %s\n", av_make_error_string(response, sizeof(response), result));
         }
     }
     
-    return false;
+    return sent;
 }
 
-FFMpegFilter_Ptr FFMpegFilterGraph::get_filter(int index) {
-    if (index >= (int) filters.size() || index < 0) return nullptr;
-    return filters[index];
+bool FFMpegFilterGraph::is_identity_chain() {
+    if (!description.empty() && description != "null" && description != "anull") {
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(filters_mutex);
+    return std::all_of(filters.begin(), filters.end(), [](FFMpegFilter_Ptr& filter) {
+        auto name = filter->get_name();
+        return name == "null" || name == "anull" || name == "copy" || name == "acopy";
+    });
 }
 
-bool FFMpegFilterGraph::configure() {
-    // Take all the filters in the vector and link them together
+FFMpegFilterGraph::GraphTemplate FFMpegFilterGraph::make_template() {
+    GraphTemplate graph_template;
+    graph_template.input_filter = input->filter;
+    graph_template.input_name = input->get_name();
+    graph_template.input_arguments = input->get_arguments();
+    graph_template.output_filter = output->filter;
+    graph_template.output_name = output->get_name();
+    graph_template.output_arguments = output->get_arguments();
+    graph_template.description = description;
+    graph_template.threading = threading;
+    
+    std::lock_guard<std::mutex> lock(filters_mutex);
+    for (auto& filter : filters) {
+        graph_template.chain.push_back({filter, filter->get_arguments()});
+    }
+    
+    return graph_template;
+}
+
+std::string FFMpegFilterGraph::GraphTemplate::get_key() const {
+    std::string key = input_name + "=" + input_arguments + "|" + description + "|";
+    for (auto& filter : chain) {
+        key += filter.filter->get_name() + "=" + filter.arguments + ",";
+    }
+    key += "|" + output_name + "=" + output_arguments;
+    return key + "|" + std::to_string(threading.threads) + (threading.per_filter_timing ? "t" : "");
+}
+
+FFMpegFilterGraph::PendingGraph* FFMpegFilterGraph::build_graph(const GraphTemplate& graph_template, int& result) {
+    PendingGraph* pending = new PendingGraph();
+    auto& chain = graph_template.chain;
     bool good = true;
     
-    if (configured) {
-        return true;
+    if (!graph_template.threading.per_filter_timing) {
+        good = build_stage(graph_template, graph_template.input_arguments, graph_template.output_arguments, true, 0, chain.size(), pending);
+    } else {
+        // The description is one stage, then each filter is one. Each stage's source takes whatever the stage before negotiated
+        bool video = graph_template.input_name == "buffer";
+        bool with_description = !graph_template.description.empty();
+        size_t count = chain.size() + (with_description ? 1 : 0);
+        std::string input_arguments = graph_template.input_arguments;
+        
+        for (size_t i = 0; good && i < count; i++) {
+            bool last = i + 1 == count;
+            size_t first = with_description ? (i == 0 ? 0 : i - 1) : i;
+            size_t end = with_description && i == 0 ? 0 : first + 1;
+            
+            good = build_stage(graph_template, input_arguments, last ? graph_template.output_arguments : "", with_description && i == 0, first, end, pending);
+            if (good && !last) input_arguments = get_stage_arguments(pending->stages.back().output, video);
+        }
     }
     
-    if (filters.empty()) {
-        good = avfilter_link(input->filter_context, 0, output->filter_context, 0) >= 0;
+    result = pending->result;
+    if (!good) {
+        fprintf(stderr, "Not configuring filter graph!\n");
+        free_pending_graph(pending);
+        return nullptr;
+    }
+    
+    return pending;
+}
+
+bool FFMpegFilterGraph::build_stage(const GraphTemplate& graph_template, const std::string& input_arguments, const std::string& output_arguments, bool with_description, size_t first, size_t last, PendingGraph* pending) {
+    // The first thing to fail says why, for acquire_graph to tell a broken setup from running out of memory
+    auto check = [pending](int result) {
+        if (result < 0 && pending->result >= 0) pending->result = result;
+        return result >= 0;
+    };
+    
+    FilterStage stage;
+    stage.graph = avfilter_graph_alloc();
+    if (!stage.graph) return check(AVERROR(ENOMEM));
+    
+    // The threading has to be set before the first filter is allocated, filters pick it up when they're created
+    auto& threading = graph_template.threading;
+    stage.graph->nb_threads = threading.threads;
+    stage.graph->thread_type = threading.threads == 1 ? 0 : AVFILTER_THREAD_SLICE;
+    
+    avfilter_graph_set_auto_convert(stage.graph, AVFILTER_AUTO_CONVERT_ALL);
+    
+    auto create = [&](const AVFilter* filter, const std::string& name, const std::string& arguments) -> AVFilterContext* {
+        AVFilterContext* context = avfilter_graph_alloc_filter(stage.graph, filter, name.c_str());
+        if (!check(context ? 0 : AVERROR(ENOMEM))) return nullptr;
+        if (!check(avfilter_init_str(context, arguments.empty() ? nullptr : arguments.c_str()))) return nullptr;
+        return context;
+    };
+    
+    auto& chain = graph_template.chain;
+    size_t stage_filters = pending->filters.size();
+    bool good = true;
+    stage.input = create(graph_template.input_filter, graph_template.input_name, input_arguments);
+    stage.output = create(graph_template.output_filter, graph_template.output_name, output_arguments);
+    good = stage.input && stage.output;
+    
+    if (with_description) stage.name = graph_template.description;
+    
+    // Link the filter chain first, the description goes between the source and the chain
+    for (size_t i = first; good && i < last; i++) {
+        AVFilterContext* context = create(chain[i].filter->filter, chain[i].filter->get_name(), chain[i].arguments);
+        good = context && (i == first || check(avfilter_link(pending->filters.back().second, 0, context, 0)));
         if (!good) {
-            return false;
+            fprintf(stderr, "Couldn't build %s\n", chain[i].filter->get_name().c_str());
+            break;
         }
+        
+        pending->filters.emplace_back(chain[i].filter, context);
+        stage.name += (stage.name.empty() ? "" : ",") + chain[i].filter->get_name();
     }
     
-    for (size_t i = 0; i < filters.size(); i++) {
-        if (i == 0) {
-            fprintf(stderr, "Linking src to %s\n", filters[i]->get_name().c_str());
-            good = avfilter_link(input->filter_context, 0, filters[i]->filter_context, 0) >= 0;
-            if (!good) {
-                fprintf(stderr, "Couldn't link src to %s\n", filters[i]->get_name().c_str());
-                return false;
-            }
+    bool has_chain = pending->filters.size() > stage_filters;
+    AVFilterContext* chain_head = has_chain ? pending->filters[stage_filters].second : stage.output;
+    if (good && has_chain) {
+        good = check(avfilter_link(pending->filters.back().second, 0, stage.output, 0));
+    }
+    
+    if (good && with_description && !graph_template.description.empty()) {
+        // The description's unlabeled input hangs off our source, its unlabeled output feeds the chain
+        AVFilterInOut* outputs = avfilter_inout_alloc();
+        AVFilterInOut* inputs = avfilter_inout_alloc();
+        good = check(outputs && inputs ? 0 : AVERROR(ENOMEM));
+        if (good) {
+            outputs->name = av_strdup("in");
+            outputs->filter_ctx = stage.input;
+            outputs->pad_idx = 0;
+            outputs->next = nullptr;
+            
+            inputs->name = av_strdup("out");
+            inputs->filter_ctx = chain_head;
+            inputs->pad_idx = 0;
+            inputs->next = nullptr;
+            
+            good = check(avfilter_graph_parse_ptr(stage.graph, graph_template.description.c_str(), &inputs, &outputs, nullptr));
+            if (!good) fprintf(stderr, "Couldn't parse filter description: %s\n", graph_template.description.c_str());
+        }
+        avfilter_inout_free(&inputs);
+        avfilter_inout_free(&outputs);
+    } else if (good) {
+        good = check(avfilter_link(stage.input, 0, chain_head, 0));
+    }
+    
+    good = good && check(avfilter_graph_config(stage.graph, nullptr));
+    
+    // Even a broken stage goes in the list, so freeing the pending graph cleans it up
+    pending->stages.push_back(stage);
+    return good;
+}
+
+std::string FFMpegFilterGraph::get_stage_arguments(AVFilterContext* sink, bool video) {
+    AVRational time_base = av_buffersink_get_time_base(sink);
+    std::string arguments = "time_base=" + std::to_string(time_base.num) + "/" + std::to_string(time_base.den);
+    
+    if (video) {
+        AVRational aspect = av_buffersink_get_sample_aspect_ratio(sink);
+        arguments += ":width=" + std::to_string(av_buffersink_get_w(sink));
+        arguments += ":height=" + std::to_string(av_buffersink_get_h(sink));
+        arguments += ":pix_fmt=" + std::to_string(av_buffersink_get_format(sink));
+        arguments += ":pixel_aspect=" + std::to_string(aspect.num) + "/" + std::to_string(aspect.den ? aspect.den : 1);
+    } else {
+        arguments += ":sample_fmt=" + std::to_string(av_buffersink_get_format(sink));
+        arguments += ":sample_rate=" + std::to_string(av_buffersink_get_sample_rate(sink));
+        arguments += ":channels=" + std::to_string(av_buffersink_get_channels(sink));
+        uint64_t layout = av_buffersink_get_channel_layout(sink);
+        if (layout) {
+            char hex_layout[32];
+            snprintf(hex_layout, sizeof(hex_layout), "0x%" PRIx64, layout);
+            arguments += ":channel_layout=" + std::string(hex_layout);
         }
+    }
+    
+    return arguments;
+}
+
+std::mutex FFMpegFilterGraph::cache_mutex{};
+std::map<std::string, FFMpegFilterGraph::PendingGraph*> FFMpegFilterGraph::graph_cache{};
+std::deque<std::string> FFMpegFilterGraph::cache_order{};
+std::set<std::string> FFMpegFilterGraph::invalid_templates{};
+std::deque<std::string> FFMpegFilterGraph::missed_templates{};
+size_t FFMpegFilterGraph::cache_size{16};
+
+FFMpegFilterGraph::PendingGraph* FFMpegFilterGraph::acquire_graph(const GraphTemplate& graph_template, bool& restock) {
+    auto key = graph_template.get_key();
+    PendingGraph* graph = nullptr;
+    restock = false;
+    
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (invalid_templates.count(key)) return nullptr;
         
-        if (i == filters.size() - 1) {
-            fprintf(stderr, "Linking %s to sink\n", filters[i]->get_name().c_str());
-            good = avfilter_link(filters[i]->filter_context, 0, output->filter_context, 0) >= 0;
-        } else {
-            good = avfilter_link(filters[i]->filter_context, 0, filters[i + 1]->filter_context, 0) >= 0;
-            fprintf(stderr, "Linking %s to %s\n", filters[i]->get_name().c_str(), filters[i + 1]->get_name().c_str());
+        auto iter = graph_cache.find(key);
+        if (iter != graph_cache.end()) {
+            graph = iter->second;
+            graph_cache.erase(iter);
+            cache_order.erase(std::find(cache_order.begin(), cache_order.end(), key));
+            restock = true;
+        } else if (cache_size) {
+            // A spare costs a whole build, so it's only worth it for a setup that comes back
+            auto missed = std::find(missed_templates.begin(), missed_templates.end(), key);
+            if (missed != missed_templates.end()) {
+                missed_templates.erase(missed);
+                restock = true;
+            } else {
+                missed_templates.push_back(key);
+                while (missed_templates.size() > cache_size) missed_templates.pop_front();
+            }
         }
-        if (!good) return false;
     }
     
-    if (avfilter_graph_config(graph_internal, nullptr) < 0) {
-        fprintf(stderr, "Not configuring filter!\n");
-        return false;
+    if (graph) {
+        // Same key, same chain: the cached contexts line up with our filters one by one
+        for (size_t i = 0; i < graph->filters.size(); i++) {
+            graph->filters[i].first = graph_template.chain[i].filter;
+        }
+        return graph;
     }
     
-    configured = true;
+    int result = 0;
+    graph = build_graph(graph_template, result);
+    if (!graph && result == AVERROR(EINVAL)) {
+        // A description or chain libavfilter rejects fails the same way every time. Anything else (e.g. running out of memory) may not
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        invalid_templates.insert(key);
+    }
     
-    return true;
+    return graph;
 }
 
+void FFMpegFilterGraph::prepare_cached_graph(const GraphTemplate& graph_template) {
+    auto key = graph_template.get_key();
+    
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cache_size == 0 || graph_cache.count(key)) return;
+    }
+    
+    int result = 0;
+    PendingGraph* graph = build_graph(graph_template, result);
+    if (!graph) return;
+    
+    // The cache must not keep our filters alive
+    for (auto& filter : graph->filters) filter.first = nullptr;
+    
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (graph_cache.count(key)) {
+        free_pending_graph(graph);
+        return;
+    }
+    
+    graph_cache[key] = graph;
+    cache_order.push_back(key);
+    
+    while (cache_order.size() > cache_size) {
+        free_pending_graph(graph_cache[cache_order.front()]);
+        graph_cache.erase(cache_order.front());
+        cache_order.pop_front();
+    }
 }
 
+void FFMpegFilterGraph::set_cache_size(size_t size) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache_size = size;
+    while (cache_order.size() > cache_size) {
+        free_pending_graph(graph_cache[cache_order.front()]);
+        graph_cache.erase(cache_order.front());
+        cache_order.pop_front();
+    }
+}
 
+void FFMpegFilterGraph::clear_cache() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (auto& entry : graph_cache) free_pending_graph(entry.second);
+    graph_cache.clear();
+    cache_order.clear();
+    invalid_templates.clear();
+    missed_templates.clear();
+}
 
+void FFMpegFilterGraph::publish_graph(PendingGraph* graph) {
+    // If the last one was never picked up, it's out of date now
+    free_pending_graph(pending_graph.exchange(graph));
+}
 
+void FFMpegFilterGraph::free_pending_graph(PendingGraph* graph) {
+    if (!graph) return;
+    free_stages(graph->stages);
+    delete graph;
+}
 
+void FFMpegFilterGraph::free_stages(std::vector<FilterStage>& stages) {
+    for (auto& stage : stages) avfilter_graph_free(&stage.graph);
+    stages.clear();
+}
 
+bool FFMpegFilterGraph::apply_pending_configuration() {
+    PendingGraph* pending = pending_graph.exchange(nullptr);
+    if (!pending) return false;
+    
+    if (configured) {
+        // Whatever is still inside the old graph has been filtered already, it comes out before the new graph's frames
+        av_buffersrc_add_frame(input->filter_context, nullptr);
+        while (AVFrame* frame = get_free_frame()) {
+            if (pull_frame(stages.size() - 1, frame) < 0) {
+                free_frames.push_back(frame);
+                break;
+            }
+            queued_frames.push_back(frame);
+        }
+    }
+    
+    // The graph the filters were first created in, if it's still around, holds nothing we need
+    avfilter_graph_free(&graph_internal);
+    
+    {
+        // The old stages own the old filter contexts, they all go away with them
+        std::lock_guard<std::mutex> lock(timing_mutex);
+        free_stages(stages);
+        stages = pending->stages;
+        stage_timers.reset(stages.empty() ? nullptr : new StageTimer[stages.size()]);
+    }
+    
+    if (stages.empty()) {
+        configured = false;
+        passthrough = true;
+        delete pending;
+        pass_held_frames();
+        return true;
+    }
+    
+    input->filter_context = stages.front().input;
+    output->filter_context = stages.back().output;
+    for (auto& filter : pending->filters) {
+        filter.first->filter_context = filter.second;
+    }
+    delete pending;
+    
+    // Frames handed in while we were passing through, or before the first configure, still have to be filtered
+    if (passthrough) feed_waiting_frames(queued_frames);
+    feed_waiting_frames(held_frames);
+    
+    passthrough = false;
+    configured = true;
+    
+    return true;
+}
 
+void FFMpegFilterGraph::pass_held_frames() {
+    while (!held_frames.empty()) {
+        AVFrame* frame = held_frames.front();
+        held_frames.pop_front();
+        if (frame) queued_frames.push_back(frame);
+        passthrough_eof = !frame;
+    }
+}
 
+bool FFMpegFilterGraph::feed_waiting_frames(std::deque<AVFrame*>& frames) {
+    int rejected = 0;
+    int result = 0;
+    while (!frames.empty()) {
+        AVFrame* frame = frames.front();
+        frames.pop_front();
+        
+        int added = av_buffersrc_add_frame(input->filter_context, frame);
+        if (added < 0) {
+            rejected++;
+            result = added;
+        }
+        
+        if (frame) {
+            // Left as it was if the graph didn't take it
+            av_frame_unref(frame);
+            free_frames.push_back(frame);
+        }
+    }
+    
+    if (!rejected) return true;
+    
+    char reason[AV_ERROR_MAX_STRING_SIZE];
+    error = "The filter graph rejected " + std::to_string(rejected) + " waiting frames: " + av_make_error_string(reason, sizeof(reason), result);
+    fprintf(stderr, "%s\n", error.c_str());
+    return false;
+}
 
+int FFMpegFilterGraph::pull_frame(size_t stage, AVFrame* frame) {
+    StageTimer& timer = stage_timers[stage];
+    
+    while (true) {
+        auto start = filter_clock::now();
+        int result = av_buffersink_get_frame(stages[stage].output, frame);
+        timer.total_time.fetch_add(elapsed_us(start), std::memory_order_relaxed);
+        
+        if (result >= 0) {
+            timer.frames.fetch_add(1, std::memory_order_relaxed);
+            return result;
+        }
+        
+        if (result != AVERROR(EAGAIN) || stage == 0) return result;
+        
+        // This stage is starved, run the one before it
+        AVFrame* between = get_free_frame();
+        if (!between) return AVERROR(ENOMEM);
+        
+        int previous = pull_frame(stage - 1, between);
+        if (previous < 0 && previous != AVERROR_EOF) {
+            free_frames.push_back(between);
+            return previous;
+        }
+        
+        start = filter_clock::now();
+        // At the end of the stream the stage before is drained, pass the end on so this stage flushes too
+        av_buffersrc_add_frame(stages[stage].input, previous == AVERROR_EOF ? nullptr : between);
+        timer.total_time.fetch_add(elapsed_us(start), std::memory_order_relaxed);
+        free_frames.push_back(between);
+    }
+}
 
+AVFrame* FFMpegFilterGraph::get_free_frame() {
+    if (free_frames.empty()) return av_frame_alloc();
+    
+    AVFrame* frame = free_frames.back();
+    free_frames.pop_back();
+    return frame;
+}
 
+bool FFMpegFilterGraph::add_frame(FFMpegFrame_Ptr frame) {
+    if (!initialized) return false;
+    
+    apply_pending_configuration();
+    
+    if (passthrough) {
+        if (!frame) {
+            passthrough_eof = true;
+            return true;
+        }
+        
+        AVFrame* pending = get_free_frame();
+        if (!pending) return false;
+        
+        av_frame_move_ref(pending, frame->internal);
+        queued_frames.push_back(pending);
+        passthrough_eof = false;
+        return true;
+    }
+    
+    // The configure failed: there's no graph to take the frame
+    if (configure_failed) return false;
+    
+    // Not configured yet: held back for the graph configure builds
+    if (!configured) {
+        AVFrame* held = nullptr;
+        if (frame) {
+            held = get_free_frame();
+            if (!held) return false;
+            av_frame_move_ref(held, frame->internal);
+        }
+        held_frames.push_back(held);
+        return true;
+    }
+    
+    auto value = frame ? frame->internal : nullptr;
+    auto start = filter_clock::now();
+    bool added = av_buffersrc_add_frame(input->filter_context, value) >= 0;
+    stage_timers[0].total_time.fetch_add(elapsed_us(start), std::memory_order_relaxed);
+    
+    return added;
+}
 
+bool FFMpegFilterGraph::get_frame(FFMpegFrame_Ptr frame) {
+    if (!queued_frames.empty()) {
+        AVFrame* pending = queued_frames.front();
+        queued_frames.pop_front();
+        av_frame_unref(frame->internal);
+        av_frame_move_ref(frame->internal, pending);
+        free_frames.push_back(pending);
+        return true;
+    }
+    
+    if (passthrough || !configured) {
+        return false;
+    }
+    
+    int error;
+    error = pull_frame(stages.size() - 1, frame->internal);
+    if (error < 0) {
+        if (error == AVERROR(EAGAIN)) {
+            fprintf(stderr, "Need more input frames to get this thing out!\n");
+        } else if (error == AVERROR_EOF) {
+            fprintf(stderr, "End of file from the filter graph!\n");
+        }
+    }
+    return error >= 0;
+}
 
-
-
+}
@@ -4,6 +4,7 @@ namespace jp {
 
     /// Opens the file path with the specified open mode
     bool FFMpegIOContext::open(std::string path, OpenMode open_mode) {
+        close();
         this->path = path;
     	int flag = open_mode == OpenMode::OPEN_MODE_READ ? AVIO_FLAG_READ : AVIO_FLAG_WRITE;
     	
@@ -76,7 +77,7 @@ namespace jp {
     
     /// Close this file
     void FFMpegIOContext::close() {
-        avio_close(io_context);
+        avio_closep(&io_context);
     }
 
 }
@@ -12,16 +12,74 @@ namespace jp {
 	        return false;
 	    }
 	    
+	    for (auto& policy : threading_policies) {
+	        demuxer->set_threading_policy(policy.first, policy.second);
+	    }
+	    demuxer->set_startup_options(startup_options);
+	    demuxer->set_audio_enabled(audio_enabled);
+	    
 	    if (!demuxer->initialize()) {
 	        error = demuxer->get_error();
 	        return false;
 	    }
 	    
 	    duration = demuxer->get_duration() * demuxer->get_global_time_base() * 1000;
+	    metadata = demuxer->get_metadata();
 	    parsed = true;
 	    
 	    return true;
 	}
+	
+	bool FFMpegMedia::probe(int64_t probe_size) {
+	    release();
+	    demuxer.reset(new FFMpegDemuxer(context));
+	    if (!demuxer) {
+	        error = "Unable to allocate demuxer";
+	        return false;
+	    }
+	    
+	    if (!demuxer->probe(probe_size)) {
+	        error = demuxer->get_error();
+	        return false;
+	    }
+	    
+	    duration = demuxer->get_duration() * demuxer->get_global_time_base() * 1000;
+	    metadata = demuxer->get_metadata();
+	    probed = true;
+	    
+	    return true;
+	}
+
+	MediaSummary FFMpegMedia::get_summary() {
+	    MediaSummary summary;
+	    summary.path = context->get_path();
+	    if (!(parsed || probed)) return summary;
+	    
+	    summary.duration = duration;
+	    summary.bitrate = get_bitrate();
+	    summary.metadata = metadata;
+	    
+	    summary.has_audio = demuxer->has_audio();
+	    if (summary.has_audio) {
+	        auto stream = demuxer->get_audio_stream();
+	        summary.sample_rate = stream->get_sample_rate();
+	        summary.channels = stream->get_channels();
+	        summary.channel_layout = stream->get_channel_layout();
+	        summary.sample_format = stream->get_sample_format();
+	    }
+	    
+	    summary.has_video = demuxer->has_video();
+	    if (summary.has_video) {
+	        auto stream = demuxer->get_video_stream();
+	        summary.width = stream->get_width();
+	        summary.height = stream->get_height();
+	        summary.pixel_format = stream->get_pixel_format();
+	        summary.frame_rate = stream->get_frame_rate();
+	        summary.attached_pic = stream->is_attached_pic();
+	        summary.keyframes = stream->get_keyframe_count();
+	    }
+	    return summary;
+	}
 
 	uint64_t FFMpegMedia::get_sample_rate() {
 	    if (!demuxer->has_audio()) return 0;
@@ -46,6 +104,7 @@ namespace jp {
     
     void FFMpegMedia::release() {
         parsed = false;
+        probed = false;
     }
 	
 }
@@ -1,87 +1,144 @@
 #include "FFMpegMediaPlayer.h"
 #include <algorithm>
+#include <cmath>
 
 namespace jp {
+    using startup_clock = std::chrono::steady_clock;
+    
+    /// Whether the media has a video stream that isn't just cover art
+    static bool has_moving_video(FFMpegMedia_Ptr& media) {
+        return media->has_video() && !media->get_demuxer()->get_video_stream()->is_attached_pic();
+    }
+    
+    /// Equal power crossfade gains at this point of the fade
+    static void get_fade_gains(int64_t position, int64_t length, float& out, float& in) {
+        double angle = std::min(1.0, (double) position / length) * M_PI / 2;
+        out = cos(angle);
+        in = sin(angle);
+    }
+    
     MediaResult FFMpegMediaPlayer::set_media(FFMpegMedia_Ptr media) {
         if (!media) {
             set_error("Media is null");
             return MediaResult::RESULT_ERROR;
         }
-        if (!media->is_parsed() && !media->parse()) {
-            set_error("Unable to parse media!");
-            return MediaResult::RESULT_ERROR;
+        
+        // Switching while playing: nothing may be reading the old media while its state is replaced below
+        auto previous = get_current_media();
+        if (previous) stop_playback_threads(previous);
+        
+        startup_start = startup_clock::now();
+        startup_timings = StartupTimings{};
+        first_audio_frame = 0;
+        first_video_frame = 0;
+        
+        if (!media->is_parsed()) {
+            if (fast_start) media->set_startup_options(StartupOptions::fast());
+            if (!media->parse()) {
+                set_error("Unable to parse media!");
+                return MediaResult::RESULT_ERROR;
+            }
         }
         
+        // The parse phases come from the demuxer, which may have parsed long before (e.g. in the playlist)
+        StartupTimings parse_timings = media->get_startup_timings();
+        startup_timings.open_input = parse_timings.open_input;
+        startup_timings.find_stream_info = parse_timings.find_stream_info;
+        startup_timings.open_decoders = parse_timings.open_decoders;
+        
         current_position = 0;
         error.error = "";
         
-        current_media = media;
+        // Whatever was on its way to follow the previous media doesn't follow this one
+        std::atomic_store(&prepared_media, PreparedMedia_Ptr());
+        std::atomic_store(&splicing_media, PreparedMedia_Ptr());
+        std::atomic_store(&next_media, FFMpegMedia_Ptr());
+        splice_pending = false;
+        audio_tail.clear();
+        end_of_media = false;
+        cancel_crossfade();
+        demuxed_audio_end = 0;
+        
+        // Nothing of the old media gets decoded into the new one
+        FFMpegPacket_Ptr packet;
+        while (audio_packet_queue.try_dequeue(packet)) {}
+        while (video_packet_queue.try_dequeue(packet)) {}
+        audio_decoded.clear();
+        audio_decoded_index = 0;
+        audio_clear = false;
+        
+        std::atomic_store(&current_media, media);
+        video_media = media;
+        std::atomic_store(&demux_media, media);
         
         released = false;
         
+        auto section_start = startup_clock::now();
+        
+        // With fast start, the video graph builds while the audio device opens
+        std::string video_graph_error;
+        bool video_graph_built = true;
+        std::thread video_graph_builder;
+        if (media->has_video() && fast_start) {
+            video_graph_builder = std::thread([&]() { video_graph_built = build_video_graph(media, video_graph_error); });
+        }
+        
+        bool audio_configured = true;
         if (media->has_audio()) {
-            std::string ch_layout = "0x" + std::to_string(media->get_channel_layout());
-            std::string tb = std::to_string(media->get_demuxer()->get_audio_stream()->get_time_base_numerator()) + "/" + std::to_string(media->get_demuxer()->get_audio_stream()->get_time_base_denominator());
-            
-            filter_graph = FFMpegFilterGraph_Ptr(new FFMpegFilterGraph(media->get_sample_format(), ch_layout, media->get_sample_rate(), tb));
-            
-            if (!filter_graph || !filter_graph->is_initialized()) {
-                set_error("Unable to initialize filter graph!");
-                return MediaResult::RESULT_ERROR;
+            // Open the device first, so the audio is converted once, straight to what the device accepted
+            AudioFormat output_format{(int) media->get_sample_rate(), (int) media->get_channels(), media->get_channel_layout(), AV_SAMPLE_FMT_S16};
+            if (audio_output) {
+                auto output_start = startup_clock::now();
+                audio_configured = audio_output->initialize();
+                startup_timings.outputs += std::chrono::duration_cast<std::chrono::microseconds>(startup_clock::now() - output_start).count();
+                if (!audio_configured) set_error("Unable to initialize audio output");
+                
+                output_format = audio_output->get_format();
             }
             
-            auto volume_filter = filter_graph->create_filter("volume");
-            volume_filter->set_property("volume", "1.0");
-            volume_filter->initialize();
-            filter_graph->add_filter(volume_filter);
-            
-            auto resample_filter = filter_graph->create_filter("aresample");
-            resample_filter->set_property("in_channel_layout", "stereo");
-            resample_filter->set_property("out_channel_layout", "stereo");
-            resample_filter->set_property("in_sample_fmt", av_get_sample_fmt_name(AV_SAMPLE_FMT_S16));
-            resample_filter->set_property("out_sample_fmt", av_get_sample_fmt_name(AV_SAMPLE_FMT_S16));
-            resample_filter->set_property("in_sample_rate", std::to_string(get_sample_rate()));
-            resample_filter->set_property("out_sample_rate", std::to_string(get_sample_rate()));
-            resample_filter->initialize();
-            filter_graph->add_filter(resample_filter);
-            
-            if (!filter_graph->configure()) {
-                set_error("Unable to configure filter graph!\n");
-                return MediaResult::RESULT_ERROR;
-            }
+            if (!output_format.channel_layout) output_format.channel_layout = av_get_default_channel_layout(output_format.channels);
+            audio_output_format = output_format;
             
-            if (audio_output) {
-                if (!audio_output->initialize()) {
-                    set_error("Unable to initialize audio output");
-                    return MediaResult::RESULT_ERROR;
-                }
-            }
+            audio_configured = audio_configured && build_audio_graph(media, filter_graph, audio_converter);
             
             audio_decoder = media->get_demuxer()->get_audio_decoder();
             
+            // Spread volume changes over 10ms
+            audio_gain.set_ramp_length(output_format.sample_rate / 100);
+            audio_gain.reset();
+            if (!AudioGain::is_supported(output_format.sample_format)) {
+                fprintf(stderr, "Volume can't be applied to %s audio, set_volume won't do anything\n", av_get_sample_fmt_name(output_format.sample_format));
+            }
+            
             audio_enabled = true;
         }
         
+        if (video_graph_builder.joinable()) {
+            video_graph_builder.join();
+        } else if (media->has_video()) {
+            video_graph_built = build_video_graph(media, video_graph_error);
+        }
+        startup_timings.filter_graphs = std::chrono::duration_cast<std::chrono::microseconds>(startup_clock::now() - section_start).count() - startup_timings.outputs;
+        
+        if (!audio_configured) return MediaResult::RESULT_ERROR;
+        if (!video_graph_built) {
+            set_error(video_graph_error);
+            return MediaResult::RESULT_ERROR;
+        }
+        
         if (media->has_video()) {
-            std::string tb = std::to_string(media->get_demuxer()->get_video_stream()->get_time_base_numerator()) + "/" + std::to_string(media->get_demuxer()->get_video_stream()->get_time_base_denominator());
-            
-            video_filter_graph = FFMpegFilterGraph_Ptr(new FFMpegFilterGraph(media->get_pixel_format(), media->get_width(), media->get_height(), tb));
-            
-            if (!video_filter_graph || !video_filter_graph->is_initialized()) {
-                set_error("Unable to initialize filter graph!");
-                return MediaResult::RESULT_ERROR;
-            }
-            
-            if (!video_filter_graph->configure()) {
-                set_error("Unable to configure video filter graph!\n");
-                return MediaResult::RESULT_ERROR;
-            }
             video_decoder = media->get_demuxer()->get_video_decoder();
             
             if (video_output) {
                 video_output->set_subtitle_manager(subtitle_manager.get());
-                if (!video_output->initialize()) {
-                    set_error("Unable to initialize video output!\n");
+                
+                // Fast start leaves creating the window to the first play, the video output does that itself
+                if (!fast_start) {
+                    auto output_start = startup_clock::now();
+                    if (!video_output->initialize()) {
+                        set_error("Unable to initialize video output!\n");
+                    }
+                    startup_timings.outputs += std::chrono::duration_cast<std::chrono::microseconds>(startup_clock::now() - output_start).count();
                 }
             }
             
@@ -95,23 +152,136 @@ namespace jp {
         return MediaResult::RESULT_SUCCESS;
     }
     
+    bool FFMpegMediaPlayer::build_video_graph(FFMpegMedia_Ptr media, std::string& error) {
+        std::string tb = std::to_string(media->get_demuxer()->get_video_stream()->get_time_base_numerator()) + "/" + std::to_string(media->get_demuxer()->get_video_stream()->get_time_base_denominator());
+        
+        video_filter_graph = FFMpegFilterGraph_Ptr(new FFMpegFilterGraph(media->get_pixel_format(), media->get_width(), media->get_height(), tb));
+        
+        if (!video_filter_graph || !video_filter_graph->is_initialized()) {
+            error = "Unable to initialize filter graph!";
+            return false;
+        }
+        
+        video_filter_graph->set_description(video_filter_description);
+        video_filter_graph->set_threading(video_filter_threading);
+        
+        if (!video_filter_graph->configure()) {
+            error = "Unable to configure video filter graph!\n";
+            return false;
+        }
+        
+        return true;
+    }
+    
+    void FFMpegMediaPlayer::record_first_frame(std::atomic<uint64_t>& first_frame) {
+        if (first_frame.load(std::memory_order_relaxed)) return;
+        
+        uint64_t elapsed = std::max<uint64_t>(1, std::chrono::duration_cast<std::chrono::microseconds>(startup_clock::now() - startup_start).count());
+        uint64_t expected = 0;
+        if (first_frame.compare_exchange_strong(expected, elapsed) && fast_start && elapsed > startup_budget * 1000) {
+            fprintf(stderr, "First frame after %.1fms, over the %lums budget\n", elapsed / 1000.0, (unsigned long) startup_budget);
+        }
+    }
+    
+    StartupTimings FFMpegMediaPlayer::get_startup_timings() {
+        StartupTimings timings = startup_timings;
+        timings.first_audio_frame = first_audio_frame;
+        timings.first_video_frame = first_video_frame;
+        return timings;
+    }
+    
+    AudioFormat FFMpegMediaPlayer::get_source_format(FFMpegMedia_Ptr media) {
+        AudioFormat format{(int) media->get_sample_rate(), (int) media->get_channels(), media->get_channel_layout(), (AVSampleFormat) media->get_sample_format()};
+        if (!format.channel_layout) format.channel_layout = av_get_default_channel_layout(format.channels);
+        return format;
+    }
+    
+    bool FFMpegMediaPlayer::build_audio_graph(FFMpegMedia_Ptr media, FFMpegFilterGraph_Ptr& graph, FFMpegResampler_Ptr& converter) {
+        const AudioFormat& output_format = audio_output_format;
+        
+        std::string ch_layout = "0x" + std::to_string(media->get_channel_layout());
+        std::string tb = std::to_string(media->get_demuxer()->get_audio_stream()->get_time_base_numerator()) + "/" + std::to_string(media->get_demuxer()->get_audio_stream()->get_time_base_denominator());
+        
+        graph = FFMpegFilterGraph_Ptr(new FFMpegFilterGraph(media->get_sample_format(), ch_layout, media->get_sample_rate(), tb));
+        
+        if (!graph || !graph->is_initialized()) {
+            set_error("Unable to initialize filter graph!");
+            return false;
+        }
+        
+        graph->set_description(audio_filter_description);
+        
+        // Media already in the device's format passes straight through unless the description changes it
+        AudioFormat source_format = get_source_format(media);
+        
+        // Only the sample format differs: a kernel picked now does it on the frames that come out of the graph, which stays in pass-through mode
+        converter = nullptr;
+        bool same_shape = source_format.sample_rate == output_format.sample_rate && source_format.channel_layout == output_format.channel_layout;
+        if (same_shape && source_format != output_format && audio_filter_description.empty()) {
+            converter = FFMpegResampler_Ptr(new FFMpegResampler());
+            if (!converter->initialize(source_format.channel_layout, source_format.sample_rate, source_format.sample_format,
+                                       output_format.channel_layout, output_format.sample_rate, output_format.sample_format) || !converter->is_fast_path()) {
+                converter = nullptr;
+            }
+        }
+        
+        if (!converter && (source_format != output_format || !audio_filter_description.empty())) {
+            auto resample_filter = graph->create_filter("aresample");
+            resample_filter->set_property("out_channel_layout", std::to_string(output_format.channel_layout));
+            resample_filter->set_property("out_sample_fmt", av_get_sample_fmt_name(output_format.sample_format));
+            resample_filter->set_property("out_sample_rate", std::to_string(output_format.sample_rate));
+            resample_filter->initialize();
+            graph->add_filter(resample_filter);
+        }
+        
+        if (!graph->configure()) {
+            set_error("Unable to configure filter graph!\n");
+            return false;
+        }
+        
+        return true;
+    }
+    
+    void FFMpegMediaPlayer::stop_playback_threads(FFMpegMedia_Ptr media) {
+        playing = false;
+        requested_play = false;
+        
+        {
+            // Taken so the flag can't slip in between the demuxer checking it and waiting
+            std::lock_guard<std::mutex> lock(demuxer_wake_mutex);
+            demuxer_quit = true;
+        }
+        demuxer_wake_condition.notify_all();
+        if (demuxer_thread.joinable()) demuxer_thread.join();
+        
+        // With demuxer_quit set, the outputs' threads stop waiting for packets that won't come. Releasing joins them (or closes the device, which waits for its callback), initialize starts them again
+        if (audio_output && media->has_audio()) audio_output->release();
+        if (video_output && media->has_video()) video_output->release();
+        
+        demuxer_quit = false;
+    }
+    
     void FFMpegMediaPlayer::start_demuxer_thread() {
         if (!demuxer_thread.joinable()) {
             uint64_t total_bytes;
             demuxer_thread = std::thread([&]() {
-                while (!released) {
+                while (!released && !demuxer_quit) {
                     std::unique_lock<std::mutex> lock(demuxer_wake_mutex);
-                    while (demuxer_clear) {
+                    while (demuxer_clear && !demuxer_quit) {
                         demuxer_wake_condition.wait(lock);
                     }
                     
-                    auto packet = current_media->get_demuxer()->get_next_packet();
+                    auto media = std::atomic_load(&demux_media);
+                    auto packet = media->get_demuxer()->get_next_packet();
 
                     if (!packet || packet->is_empty()) {
-                        if (current_media->get_demuxer()->is_finished()) {
-                            fprintf(stderr, "Demuxer says: %s\n", current_media->get_demuxer()->get_error().c_str());
+                        if (media->get_demuxer()->is_finished()) {
+                            // Carry straight on with the next media if it's ready to be spliced in
+                            if (splice_next_media(lock)) continue;
+                            
+                            fprintf(stderr, "Demuxer says: %s\n", media->get_demuxer()->get_error().c_str());
                             fprintf(stderr, "Total demuxed: %luMB\n", total_bytes / (1024 * 1024));
-                            demuxer_wake_condition.wait(lock);
+                            if (!demuxer_quit) demuxer_wake_condition.wait(lock);
                             continue;
                         }
                     }
@@ -121,17 +291,21 @@ namespace jp {
                         if (!audio_enabled) {
                             continue;
                         }
+                        if (packet->get_pts() != AV_NOPTS_VALUE) {
+                            double end = (packet->get_pts() + packet->get_duration()) * media->get_demuxer()->get_audio_stream()->get_time_base() * 1000;
+                            demuxed_audio_end = std::max(demuxed_audio_end, end);
+                        }
                         while (!audio_packet_queue.try_enqueue(packet)) {
                             if (!playing && requested_play) {
                                 buffering = false;
                                 buffering_changed();
                             }
-                            if (released) break;
+                            if (released || demuxer_quit) break;
                             demuxer_wake_condition.wait(lock);
                         }
                     } else if (packet->is_video_packet()) {
                         total_bytes += packet->get_bytes();
-                        if (!video_enabled) {
+                        if (!video_enabled || media != video_media) {
                             continue;
                         }
                         while (!video_packet_queue.try_enqueue(packet)) {
@@ -139,7 +313,7 @@ namespace jp {
                                 buffering = false;
                                 buffering_changed();
                             }
-                            if (released) break;
+                            if (released || demuxer_quit) break;
                             demuxer_wake_condition.wait(lock);
                         }
                     }
@@ -149,6 +323,7 @@ namespace jp {
     }
     
     MediaResult FFMpegMediaPlayer::play() {
+        auto current_media = get_current_media();
         if (current_media == nullptr || !current_media->is_parsed()) {
             set_error("Media not parsed or media is invalid");
             return MediaResult::RESULT_ERROR;
@@ -175,6 +350,7 @@ namespace jp {
     }
     
     MediaResult FFMpegMediaPlayer::pause(bool temp_pause) {
+        auto current_media = get_current_media();
         if (current_media == nullptr || !current_media->is_parsed()) return MediaResult::RESULT_ERROR;
         if (current_media->has_audio())
             audio_output->pause();
@@ -190,6 +366,7 @@ namespace jp {
     }
     
     MediaResult FFMpegMediaPlayer::stop() {
+        auto current_media = get_current_media();
         if (current_media == nullptr || !current_media->is_parsed()) return MediaResult::RESULT_ERROR;
         if (current_media->has_audio())
             audio_output->stop();
@@ -206,6 +383,9 @@ namespace jp {
     }
     
     bool FFMpegMediaPlayer::seek_to(uint64_t position_millis) {
+        // The audio thread can't splice the next media in while we decide which media to seek
+        std::lock_guard<std::mutex> splice_lock(splice_mutex);
+        auto current_media = get_current_media();
         if (current_media->get_demuxer()->seek(position_millis)) {
             bool was_playing = playing;
             pause();
@@ -217,11 +397,29 @@ namespace jp {
             
             demuxer_clear = true;
             
+            {
+                std::lock_guard<std::mutex> lock(demuxer_wake_mutex);
+                demuxed_audio_end = 0;
+                
+                // Seeking back into this media undoes a splice the demuxer had started. The next media goes back to the front of the playlist, to be prepared again
+                auto spliced = std::atomic_exchange(&splicing_media, PreparedMedia_Ptr());
+                if (spliced) {
+                    std::atomic_store(&demux_media, current_media);
+                    spliced->media->get_demuxer()->reset();
+                    spliced->audio_decoder->reset_buffers();
+                    
+                    std::lock_guard<std::mutex> playlist_lock(playlist_mutex);
+                    playlist.push_front(spliced->media);
+                }
+                
+                end_of_media = false;
+            }
+            
             FFMpegPacket_Ptr ptr;
-            FFMpegFrame_Ptr frame;
             while (audio_packet_queue.try_dequeue(ptr)) {}
             while (video_packet_queue.try_dequeue(ptr)) {}
-            while (audio_frame_queue.try_dequeue(frame)) {}
+            audio_clear = true;
+            audio_gain.reset();
             
             demuxer_clear = false;
             
@@ -238,34 +436,73 @@ namespace jp {
     }
     
     FFMpegFrame_Ptr FFMpegMediaPlayer::get_next_audio_frame() {
-        FFMpegFrame_Ptr frame;
+        // Frames decoded before a seek are from the old position, and seek_to has put a media being spliced in back in the playlist
+        if (audio_clear.exchange(false)) {
+            audio_decoded.clear();
+            audio_decoded_index = 0;
+            // The decoder may also have been flushed at the end marker
+            audio_decoder->reset_buffers();
+            splice_pending = false;
+            audio_tail.clear();
+            cancel_crossfade();
+        }
         
-        // Do we have any buffered frames?
-        while (!audio_frame_queue.try_dequeue(frame)) {
-            FFMpegPacket_Ptr packet;
-            if (!audio_packet_queue.try_dequeue(packet)) {
-                if (current_media->get_demuxer()->is_finished()) {
-                    auto result = audio_decoder->flush();
-                    if (result.empty()) return nullptr;
-                    std::for_each(result.begin(), result.end(), [&](FFMpegFrame_Ptr frame) {
-                        audio_frame_queue.enqueue(frame);
-                    });
+        // What the previous media's graph still held at a splice goes first
+        if (!audio_tail.empty()) {
+            FFMpegFrame_Ptr frame = audio_tail.front();
+            audio_tail.pop_front();
+            return frame;
+        }
+        
+        // What a graph swap flushed out of the old graph comes out before anything new goes in, so it doesn't stay queued up as extra latency
+        if (!filter_graph->has_queued_frames()) {
+            // Do we have any buffered frames?
+            while (audio_decoded_index >= audio_decoded.size()) {
+                audio_decoded.clear();
+                audio_decoded_index = 0;
+            
+                if (splice_pending) {
+                    // Every frame of the previous media is out, carry on with the next one. Unless a seek is busy, which may take the next media back
+                    if (!splice_prepared_media()) return nullptr;
+                    if (!audio_tail.empty()) return get_next_audio_frame();
                     continue;
                 }
-            } else {
-                auto result = audio_decoder->decode(packet);
-                std::for_each(result.begin(), result.end(), [&](FFMpegFrame_Ptr frame) {
-                    audio_frame_queue.enqueue(frame);
-                });
+            
+                FFMpegPacket_Ptr packet;
+                if (!audio_packet_queue.try_dequeue(packet)) {
+                    if (demuxer_quit) return nullptr;
+                    if (get_current_media()->get_demuxer()->is_finished()) {
+                        if (audio_decoder->flush(audio_decoded) == 0) {
+                            end_of_media = true;
+                            return nullptr;
+                        }
+                    }
+                } else if (!packet) {
+                    // The end of this media, the next one follows in the queue
+                    audio_decoder->flush(audio_decoded);
+                    splice_pending = true;
+                } else {
+                    audio_decoder->decode(packet, audio_decoded);
+                }
+            }
+            
+            // Get the next media ready while this one plays out
+            if (!std::atomic_load(&prepared_media) && get_duration() <= current_position + preload_time) {
+                playlist_condition.notify_all();
+            }
+            
+            FFMpegFrame_Ptr frame = audio_decoded[audio_decoded_index++];
+            audio_pts = frame->get_presentation_timestamp();
+            
+            demuxer_wake_condition.notify_all();
+            
+            if (!filter_graph->add_frame(frame)) {
+                fprintf(stderr, "Unable to add frame to filter graph!\n");
             }
         }
         
-        demuxer_wake_condition.notify_all();
-        
-        if (!filter_graph->add_frame(frame)) {
-            printf("Unable to add frame to filter graph!\n");
-        }
-        
+        // Taken after the splice above, if there was one
+        auto current_media = get_current_media();
         FFMpegFrame_Ptr frame2 = FFMpegFrame_Ptr(new FFMpegFrame());
         frame2->internal->sample_rate = current_media->get_sample_rate();
         frame2->internal->channel_layout = current_media->get_channel_layout();
@@ -273,10 +510,19 @@ namespace jp {
         frame2->internal->format = current_media->get_sample_format();
         
         if (!filter_graph->get_frame(frame2)) {
-            printf("Unable to get frame from filter graph!\n");
+            fprintf(stderr, "Unable to get frame from filter graph!\n");
         } else {
+            if (audio_converter) {
+                // Don't overwrite a frame someone is still holding on to
+                if (audio_converted.use_count() > 1) audio_converted = nullptr;
+                if (audio_converter->resample(frame2, audio_converted) >= 0) frame2 = audio_converted;
+            }
+            
+            crossfade(frame2, audio_pts * current_media->get_demuxer()->get_audio_stream()->get_time_base() * 1000);
+            audio_gain.process(frame2);
+            record_first_frame(first_audio_frame);
             if (!video_enabled) {
-                current_position = frame->get_presentation_timestamp() * current_media->get_demuxer()->get_audio_stream()->get_time_base() * 1000;
+                current_position = audio_pts * current_media->get_demuxer()->get_audio_stream()->get_time_base() * 1000;
             }
         }
         
@@ -284,39 +530,62 @@ namespace jp {
     }
     
     FFMpegFrame_Ptr FFMpegMediaPlayer::get_next_video_frame() {
-        FFMpegFrame_Ptr frame2 = FFMpegFrame_Ptr(new FFMpegFrame());
-        frame2->internal->width = current_media->get_width();
-        frame2->internal->height = current_media->get_height();
-        frame2->internal->format = AV_PIX_FMT_RGB24;
+        auto current_media = get_current_media();
+        FFMpegFrame_Ptr frame2;
         
         while (true) {
+            // Like the audio, what a graph swap flushed out goes first, also when the new graph passes frames through
+            if (video_filter_graph->has_queued_frames()) {
+                frame2 = FFMpegFrame_Ptr(new FFMpegFrame());
+                if (video_filter_graph->get_frame(frame2)) break;
+            }
+            
             FFMpegPacket_Ptr packet;
             while (!video_packet_queue.try_dequeue(packet)) {
+                if (demuxer_quit) return nullptr;
                 if (current_media->get_demuxer()->get_video_stream()->is_attached_pic() || current_media->get_demuxer()->is_finished()) {
+                    // Media with audio ends when its audio does
+                    if (current_media->get_demuxer()->is_finished() && !audio_enabled) end_of_media = true;
                     return nullptr;
                 }
             }
             
             demuxer_wake_condition.notify_all();
             
-            auto frames = video_decoder->decode(packet);
-            if (frames.empty()) {
+            video_decoded.clear();
+            if (video_decoder->decode(packet, video_decoded) == 0) {
                 continue;
             }
             
-            auto frame = frames[0];
+            // Filters added while playing take effect here, between two frames
+            video_filter_graph->apply_pending_configuration();
+            
+            // No filters, the decoded frame is what we'd get out of the graph anyway. Unless the swap to pass-through left frames to come out first, then it queues up behind them
+            if (video_filter_graph->is_passthrough() && !video_filter_graph->has_queued_frames()) {
+                record_first_frame(first_video_frame);
+                return video_decoded[0];
+            }
             
-            if (!video_filter_graph->add_frame(frame)) {
-                printf("Unable to add frame to video filter graph!\n");
+            if (!frame2) {
+                frame2 = FFMpegFrame_Ptr(new FFMpegFrame());
+                frame2->internal->width = current_media->get_width();
+                frame2->internal->height = current_media->get_height();
+                frame2->internal->format = AV_PIX_FMT_RGB24;
+            }
+            
+            if (!video_filter_graph->add_frame(video_decoded[0])) {
+                fprintf(stderr, "Unable to add frame to video filter graph!\n");
             }
             
             if (!video_filter_graph->get_frame(frame2)) {
-                printf("Unable to get frame from video filter graph!\n");
+                fprintf(stderr, "Unable to get frame from video filter graph!\n");
             } else {
                 break;
             }
         }
         
+        record_first_frame(first_video_frame);
+
         return frame2;
     }
     
@@ -344,6 +613,330 @@ namespace jp {
     
     void FFMpegMediaPlayer::release() {
         released = true;
+        demuxer_wake_condition.notify_all();
+        playlist_condition.notify_all();
         if (demuxer_thread.joinable()) demuxer_thread.join();
+        if (playlist_thread.joinable() && playlist_thread.get_id() != std::this_thread::get_id()) playlist_thread.join();
+    }
+    
+    void FFMpegMediaPlayer::enqueue_media(FFMpegMedia_Ptr media) {
+        if (!media) return;
+        
+        std::lock_guard<std::mutex> lock(playlist_mutex);
+        playlist.push_back(media);
+        if (!playlist_thread.joinable()) playlist_thread = std::thread(&FFMpegMediaPlayer::playlist_func, this);
+        playlist_condition.notify_all();
+    }
+    
+    void FFMpegMediaPlayer::clear_playlist() {
+        std::lock_guard<std::mutex> lock(playlist_mutex);
+        playlist.clear();
+        playlist_generation++;
+        std::atomic_store(&prepared_media, PreparedMedia_Ptr());
+        std::atomic_store(&next_media, FFMpegMedia_Ptr());
+    }
+    
+    MediaResult FFMpegMediaPlayer::play_next() {
+        auto media = std::atomic_exchange(&next_media, FFMpegMedia_Ptr());
+        if (!media) {
+            set_error("No media waiting to be played next");
+            return MediaResult::RESULT_ERROR;
+        }
+        
+        MediaResult result = set_media(media);
+        if (result != MediaResult::RESULT_SUCCESS) {
+            fprintf(stderr, "Unable to play the next media: %s\n", error.error.c_str());
+            return result;
+        }
+        
+        result = play();
+        if (media_changed_callback) media_changed_callback(media);
+        return result;
+    }
+    
+    size_t FFMpegMediaPlayer::get_playlist_size() {
+        std::lock_guard<std::mutex> lock(playlist_mutex);
+        return playlist.size();
+    }
+    
+    void FFMpegMediaPlayer::playlist_func() {
+        std::unique_lock<std::mutex> lock(playlist_mutex);
+        while (!released) {
+            // The audio thread wakes us near the end of the media, the timeout catches media without audio
+            playlist_condition.wait_for(lock, std::chrono::milliseconds(100));
+            if (released) break;
+            auto current_media = get_current_media();
+            if (!current_media) continue;
+            
+            auto prepared = std::atomic_load(&prepared_media);
+            if (!prepared) {
+                bool near_end = current_media->get_demuxer()->is_finished() || current_media->get_duration() <= current_position + preload_time + crossfade_time;
+                if (playlist.empty() || !near_end || std::atomic_load(&splicing_media) || std::atomic_load(&next_media)) continue;
+                
+                auto media = playlist.front();
+                playlist.pop_front();
+                uint64_t generation = playlist_generation;
+                
+                lock.unlock();
+                prepared = prepare_media(media);
+                lock.lock();
+                
+                // Unless the playlist was cleared in the meantime
+                if (prepared && generation == playlist_generation) {
+                    std::atomic_store(&prepared_media, prepared);
+                    demuxer_wake_condition.notify_all();
+                }
+                continue;
+            }
+            
+            // Can't be spliced in, so switch once the current media has played out. set_media sets the outputs up again, which has to happen on their owner's thread
+            if (!prepared->spliceable && end_of_media) {
+                std::atomic_store(&prepared_media, PreparedMedia_Ptr());
+                std::atomic_store(&next_media, prepared->media);
+                lock.unlock();
+                if (next_media_callback) next_media_callback();
+                lock.lock();
+            }
+        }
+    }
+    
+    FFMpegMediaPlayer::PreparedMedia_Ptr FFMpegMediaPlayer::prepare_media(FFMpegMedia_Ptr media) {
+        if (!media->is_parsed() && !media->parse()) {
+            fprintf(stderr, "Unable to parse the next media: %s\n", media->get_error().c_str());
+            return nullptr;
+        }
+        
+        PreparedMedia_Ptr next(new PreparedMedia());
+        next->media = media;
+        
+        // Only audio is spliced, video needs its output set up again
+        auto current = get_current_media();
+        next->spliceable = audio_enabled && current && current->has_audio() && media->has_audio() && !has_moving_video(current) && !has_moving_video(media);
+        if (!next->spliceable) return next;
+        
+        // Audio shaped like the current media's goes through the running graph. Anything else gets a graph of its own, converting to the format the output already has
+        // A crossfade runs both at once, so that always needs a graph of its own
+        uint64_t overlap = crossfade_time;
+        if ((overlap || get_source_format(media) != get_source_format(current)) && !build_audio_graph(media, next->filter_graph, next->audio_converter)) {
+            next->spliceable = false;
+            return next;
+        }
+        
+        // Decode the first 200ms (and the overlap) now, so the audio thread doesn't wait on the decoder when it switches over
+        next->audio_decoder = media->get_demuxer()->get_audio_decoder();
+        int64_t decoded_samples = 0;
+        int64_t wanted_samples = media->get_sample_rate() * (200 + overlap) / 1000;
+        while (decoded_samples < wanted_samples && !released) {
+            auto packet = media->get_demuxer()->get_next_packet();
+            if (!packet || packet->is_empty()) {
+                if (media->get_demuxer()->is_finished()) break;
+                continue;
+            }
+            
+            // Cover art isn't shown for spliced media
+            if (!packet->is_audio_packet()) continue;
+            
+            size_t first = next->decoded.size();
+            next->audio_decoder->decode(packet, next->decoded);
+            for (size_t i = first; i < next->decoded.size(); i++) decoded_samples += next->decoded[i]->get_number_of_samples();
+        }
+        
+        return next;
+    }
+    
+    bool FFMpegMediaPlayer::splice_next_media(std::unique_lock<std::mutex>& lock) {
+        auto next = std::atomic_load(&prepared_media);
+        if (!next || !next->spliceable) return false;
+        
+        // Unless clear_playlist got to it first
+        if (!std::atomic_compare_exchange_strong(&prepared_media, &next, PreparedMedia_Ptr())) return false;
+        
+        // Published along with splicing_media, the crossfade ends on it
+        next->previous_end = demuxed_audio_end;
+        demuxed_audio_end = 0;
+        std::atomic_store(&splicing_media, next);
+        
+        // An empty packet marks the end of this media in the audio queue, the audio thread switches over when it gets there
+        FFMpegPacket_Ptr marker{nullptr};
+        while (!audio_packet_queue.try_enqueue(marker)) {
+            if (released || demuxer_quit) return false;
+            demuxer_wake_condition.wait(lock);
+        }
+        
+        std::atomic_store(&demux_media, next->media);
+        return true;
+    }
+    
+    bool FFMpegMediaPlayer::splice_prepared_media() {
+        std::unique_lock<std::mutex> splice_lock(splice_mutex, std::try_to_lock);
+        if (!splice_lock.owns_lock()) return false;
+        splice_pending = false;
+        
+        auto next = std::atomic_exchange(&splicing_media, PreparedMedia_Ptr());
+        if (!next) return true;
+        
+        bool faded = fading_media == next;
+        
+        if (next->filter_graph) {
+            // Whatever the old graph still holds (e.g. the resampler's delay) plays right before the next media
+            if (!filter_graph->is_passthrough()) {
+                filter_graph->add_frame(nullptr);
+                while (true) {
+                    FFMpegFrame_Ptr frame{new FFMpegFrame()};
+                    if (!filter_graph->get_frame(frame)) break;
+                    if (faded) crossfade(frame, 0);
+                    audio_gain.process(frame);
+                    audio_tail.push_back(frame);
+                }
+            }
+            
+            filter_graph = next->filter_graph;
+            audio_converter = next->audio_converter;
+            audio_converted = nullptr;
+        }
+        
+        audio_decoder = next->audio_decoder;
+        std::swap(audio_decoded, next->decoded);
+        
+        // A crossfade already put the start of the decoded frames through the graph
+        audio_decoded_index = next->decoded_index;
+        fading_media = nullptr;
+        
+        if (faded) {
+            if (fade_position >= fade_length) fade_length = 0;
+            
+            // Filtered but not mixed in yet, this plays first and carries on fading in if the fade isn't done
+            int size = av_audio_fifo_size(fade_fifo);
+            if (size > 0) {
+                FFMpegFrame_Ptr rest{new FFMpegFrame()};
+                rest->internal->format = audio_output_format.sample_format;
+                rest->internal->channel_layout = audio_output_format.channel_layout;
+                rest->internal->channels = audio_output_format.channels;
+                rest->internal->sample_rate = audio_output_format.sample_rate;
+                rest->internal->nb_samples = size;
+                if (av_frame_get_buffer(rest->internal, 0) >= 0) {
+                    av_audio_fifo_read(fade_fifo, (void**) rest->internal->extended_data, size);
+                    if (fade_length) crossfade(rest, 0);
+                    audio_gain.process(rest);
+                    audio_tail.push_back(rest);
+                }
+            }
+        }
+        
+        std::atomic_store(&current_media, next->media);
+        current_position = 0;
+        end_of_media = false;
+        splice_lock.unlock();
+        
+        if (media_changed_callback) media_changed_callback(next->media);
+        
+        // Start looking at the media after this one
+        playlist_condition.notify_all();
+        return true;
+    }
+    
+    bool FFMpegMediaPlayer::fill_fade_fifo() {
+        if (fading_media->decoded_index >= fading_media->decoded.size()) return false;
+        
+        FFMpegFrame_Ptr input = fading_media->decoded[fading_media->decoded_index++];
+        if (!fading_media->filter_graph->add_frame(input)) return true;
+        
+        while (true) {
+            FFMpegFrame_Ptr filtered{new FFMpegFrame()};
+            if (!fading_media->filter_graph->get_frame(filtered)) break;
+            
+            if (fading_media->audio_converter) {
+                if (fading_media->audio_converter->resample(filtered, fade_converted) < 0) continue;
+                filtered = fade_converted;
+            }
+            
+            av_audio_fifo_write(fade_fifo, (void**) filtered->get_data(), filtered->get_number_of_samples());
+        }
+        
+        return true;
+    }
+    
+    void FFMpegMediaPlayer::crossfade(FFMpegFrame_Ptr& frame, double pts) {
+        AVSampleFormat format = (AVSampleFormat) frame->get_sample_format();
+        if (format != AV_SAMPLE_FMT_FLT && format != AV_SAMPLE_FMT_S16) return;
+        
+        int frames = frame->get_number_of_samples();
+        int channels = frame->get_channels();
+        if (frames <= 0 || channels <= 0) return;
+        
+        if (!fading_media && !fade_length) {
+            // Start fading the next media in once this one is within the crossfade of its end. That's where the demuxer found its audio to end, the duration can be off
+            uint64_t length = crossfade_time;
+            if (!length) return;
+            
+            auto next = std::atomic_load(&splicing_media);
+            if (!next || !next->filter_graph || next->decoded_index) return;
+            
+            double end = next->previous_end > 0 ? next->previous_end : get_duration();
+            if (pts + length < end) return;
+            
+            av_audio_fifo_free(fade_fifo);
+            fade_fifo = av_audio_fifo_alloc(format, channels, frames * 4);
+            if (!fade_fifo) return;
+            
+            fading_media = next;
+            fade_position = 0;
+            fade_length = std::max<int64_t>(1, (end - pts) * audio_output_format.sample_rate / 1000);
+        }
+        
+        if (!frame->make_writable()) return;
+        uint8_t* data = frame->get_data()[0];
+        
+        float out_start, in_start, out_end, in_end;
+        if (fading_media) {
+            // Mix in as much of the next media as the overlap has, the rest of the frame stays at the last gain
+            while (av_audio_fifo_size(fade_fifo) < frames && fill_fade_fifo()) {}
+            int count = std::min(frames, av_audio_fifo_size(fade_fifo));
+            
+            size_t bytes = (size_t) frames * channels * av_get_bytes_per_sample(format);
+            if (fade_buffer.size() < bytes) fade_buffer.resize(bytes);
+            void* mix_data = fade_buffer.data();
+            av_audio_fifo_read(fade_fifo, &mix_data, count);
+            
+            get_fade_gains(fade_position, fade_length, out_start, in_start);
+            get_fade_gains(fade_position + count, fade_length, out_end, in_end);
+            float out_step = count ? (out_end - out_start) / count : 0;
+            float in_step = count ? (in_end - in_start) / count : 0;
+            
+            size_t rest = (size_t) (frames - count) * channels;
+            if (format == AV_SAMPLE_FMT_FLT) {
+                crossfade_f32(reinterpret_cast<float*>(data), reinterpret_cast<float*>(fade_buffer.data()), count, channels, out_start, out_step, in_start, in_step);
+                if (rest) gain_f32(reinterpret_cast<float*>(data) + (size_t) count * channels, rest, out_end);
+            } else {
+                crossfade_s16(reinterpret_cast<int16_t*>(data), reinterpret_cast<int16_t*>(fade_buffer.data()), count, channels, out_start, out_step, in_start, in_step);
+                if (rest) gain_s16(reinterpret_cast<int16_t*>(data) + (size_t) count * channels, rest, out_end);
+            }
+            
+            fade_position += count;
+            return;
+        }
+        
+        // The media before ended sooner than the fade, fade the rest of this one in on its own
+        int count = (int) std::min<int64_t>(frames, fade_length - fade_position);
+        get_fade_gains(fade_position, fade_length, out_start, in_start);
+        get_fade_gains(fade_position + count, fade_length, out_end, in_end);
+        float in_step = (in_end - in_start) / count;
+        
+        if (format == AV_SAMPLE_FMT_FLT) {
+            gain_ramp_f32(reinterpret_cast<float*>(data), count, channels, in_start, in_step);
+        } else {
+            gain_ramp_s16(reinterpret_cast<int16_t*>(data), count, channels, in_start, in_step);
+        }
+        
+        fade_position += count;
+        if (fade_position >= fade_length) fade_length = 0;
+    }
+    
+    void FFMpegMediaPlayer::cancel_crossfade() {
+        // Only splicing_media fades, which seek_to has put back in the playlist to be prepared again from the start
+        fading_media = nullptr;
+        fade_length = 0;
+        fade_position = 0;
+        if (fade_fifo) av_audio_fifo_reset(fade_fifo);
     }
 }
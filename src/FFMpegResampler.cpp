@@ -1,4 +1,5 @@
 #include "FFMpegResampler.h"
+#include <algorithm>
 
 namespace jp {
 	FFMpegResampler::FFMpegResampler() {
@@ -11,6 +12,25 @@ namespace jp {
 	
 	bool FFMpegResampler::initialize(int64_t src_channel_layout, int  src_sample_rate, AVSampleFormat src_sample_fmt,
 									int64_t out_channel_layout, int out_sample_rate, AVSampleFormat out_sample_fmt) {
+	    this->out_channel_layout = out_channel_layout;
+	    this->out_sample_rate = out_sample_rate;
+	    this->out_sample_fmt = out_sample_fmt;
+	    this->in_channel_layout = src_channel_layout;
+	    this->in_sample_rate = src_sample_rate;
+	    this->in_sample_fmt = src_sample_fmt;
+	    channels = av_get_channel_layout_nb_channels(out_channel_layout);
+
+	    converter = nullptr;
+	    if (src_sample_rate == out_sample_rate && src_channel_layout == out_channel_layout) {
+	    	converter = get_sample_converter(src_sample_fmt, out_sample_fmt, channels);
+	    }
+
+	    fast_path = converter != nullptr;
+	    if (fast_path) {
+	    	initialized = true;
+	    	return true;
+	    }
+
         if (!resampler_context) return false;
 		av_opt_set_int(resampler_context, "in_channel_layout",    src_channel_layout, 0);
 	    av_opt_set_int(resampler_context, "in_sample_rate",       src_sample_rate, 0);
@@ -20,45 +40,94 @@ namespace jp {
 	    av_opt_set_int(resampler_context, "out_sample_rate",       out_sample_rate, 0);
 	    av_opt_set_sample_fmt(resampler_context, "out_sample_fmt", out_sample_fmt, 0);
 
-	    this->out_channel_layout = out_channel_layout;
-	    this->out_sample_rate = out_sample_rate;
-	    this->out_sample_fmt = out_sample_fmt;
-	    this->in_channel_layout = src_channel_layout;
-	    this->in_sample_rate = src_sample_rate;
-	    this->in_sample_fmt = src_sample_fmt;
-
-	    return swr_init(resampler_context) >= 0;
+	    initialized = swr_init(resampler_context) >= 0;
+	    return initialized;
 	}
 	
 	FFMpegFrame_Ptr FFMpegResampler::resample(FFMpegFrame_Ptr& frame) {
-        
-        if (!resampler_context) return nullptr;
-        
-        FFMpegFrame_Ptr frame_ptr{new FFMpegFrame()};
+		FFMpegFrame_Ptr frame_ptr;
 
-		if (!frame_ptr) return nullptr;
+		if (resample(frame, frame_ptr) < 0) {
+			fprintf(stderr, "Unable to resample frame!\n");
+			return nullptr;
+		}
 
-		AVFrame* src = frame->internal;
-		AVFrame* dest = frame_ptr->internal;
-		dest->format = out_sample_fmt;
-		dest->sample_rate = out_sample_rate;
-		dest->channel_layout = out_channel_layout;
+		return frame_ptr;
+	}
 
-		int ret;
+	int FFMpegResampler::resample(const FFMpegFrame_Ptr& frame, FFMpegFrame_Ptr& output) {
+		if (!initialized) return AVERROR(EINVAL);
 
-	    if ((ret = swr_convert_frame(resampler_context, dest, src)) < 0) {
-	        fprintf(stderr, "Unable to resample frame!\n");
+		AVFrame* src = frame ? frame->internal : nullptr;
+		int in_samples = src ? src->nb_samples : 0;
+		int needed = get_max_output_samples(in_samples);
+		if (needed < 0) return needed;
 
-	        if (ret & AVERROR_OUTPUT_CHANGED && frame != nullptr) {
-	            fprintf(stderr, "Output has changed!\n");
-	        }
-	        if (ret & AVERROR_INPUT_CHANGED && frame != nullptr) {
-	            fprintf(stderr, "Input has changed!\n");
-	        }
-	        return nullptr;
-	    }
+		if (!prepare_output(output, std::max(needed, 1))) return AVERROR(ENOMEM);
 
-		return frame_ptr;
+		AVFrame* dest = output->internal;
+		int written = convert(dest->extended_data, needed, src ? (const uint8_t**) src->extended_data : nullptr, in_samples);
+		if (written < 0) return written;
+
+		dest->nb_samples = written;
+		dest->pts = src ? src->pts : AV_NOPTS_VALUE;
+		return written;
 	}
-}
 
+	int FFMpegResampler::convert(uint8_t** output, int out_capacity, const uint8_t** input, int in_samples) {
+		if (!initialized) return AVERROR(EINVAL);
+
+		if (fast_path) {
+			// Nothing is ever held back, so there's nothing to flush
+			if (!input || in_samples <= 0) return 0;
+			if (out_capacity < in_samples) return AVERROR(EINVAL);
+			converter(input, output, in_samples, channels);
+			return in_samples;
+		}
+
+		return swr_convert(resampler_context, output, out_capacity, input, in_samples);
+	}
+
+	int FFMpegResampler::get_max_output_samples(int in_samples) {
+		if (fast_path) return in_samples;
+		return swr_get_out_samples(resampler_context, in_samples);
+	}
+
+	int64_t FFMpegResampler::get_delay() {
+		if (fast_path || !initialized) return 0;
+		return swr_get_delay(resampler_context, out_sample_rate);
+	}
+
+	void FFMpegResampler::reset() {
+		if (fast_path || !initialized) return;
+		swr_close(resampler_context);
+		initialized = swr_init(resampler_context) >= 0;
+	}
+
+	bool FFMpegResampler::prepare_output(FFMpegFrame_Ptr& output, int samples) {
+		if (!output) output = FFMpegFrame_Ptr(new FFMpegFrame());
+		if (!output->internal) return false;
+
+		AVFrame* dest = output->internal;
+		bool planar = av_sample_fmt_is_planar(out_sample_fmt);
+		int capacity = 0;
+		if (dest->buf[0] && dest->format == out_sample_fmt && dest->channels == channels && av_frame_is_writable(dest)) {
+			// For audio, linesize[0] is the size of every plane
+			capacity = dest->linesize[0] / (av_get_bytes_per_sample(out_sample_fmt) * (planar ? 1 : channels));
+		}
+
+		if (capacity < samples) {
+			av_frame_unref(dest);
+			dest->format = out_sample_fmt;
+			dest->channel_layout = out_channel_layout;
+			dest->channels = channels;
+			dest->sample_rate = out_sample_rate;
+			dest->nb_samples = samples;
+			if (av_frame_get_buffer(dest, 0) < 0) return false;
+		}
+
+		dest->channel_layout = out_channel_layout;
+		dest->sample_rate = out_sample_rate;
+		return true;
+	}
+}
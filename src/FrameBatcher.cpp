@@ -0,0 +1,247 @@
+#include "FrameBatcher.h"
+#include "CpuDispatch.h"
+
+#include <algorithm>
+
+#if defined(JP_X86_DISPATCH)
+#include <immintrin.h>
+#endif
+
+namespace jp {
+
+	namespace {
+		FrameReaderOptions get_reader_options(const TensorOptions& options) {
+			FrameReaderOptions reader_options;
+			reader_options.audio = false;
+			reader_options.fps = options.fps;
+			return reader_options;
+		}
+
+		/// The vector kernels work through 48 values at a time, which every channel count up to 4 divides, so each vector lines up with the same channels every time round
+		const size_t pattern_length = 48;
+
+		void fill_pattern(const float* scale, const float* bias, int channels, float* scales, float* biases) {
+			for (size_t i = 0; i < pattern_length; i++) {
+				scales[i] = scale[i % channels];
+				biases[i] = bias[i % channels];
+			}
+		}
+	}
+
+	void normalize_u8_f32(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels) {
+		get_kernels().normalize_u8_f32(in, out, count, scale, bias, channels);
+	}
+
+	namespace simd {
+
+		void normalize_u8_f32_scalar(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels) {
+			int channel = 0;
+			for (size_t i = 0; i < count; i++) {
+				out[i] = in[i] * scale[channel] + bias[channel];
+				if (++channel == channels) channel = 0;
+			}
+		}
+
+#if defined(JP_X86_DISPATCH)
+		JP_TARGET("sse2") void normalize_u8_f32_sse2(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels) {
+			float scales[pattern_length], biases[pattern_length];
+			fill_pattern(scale, bias, channels, scales, biases);
+
+			const __m128i zero = _mm_setzero_si128();
+			size_t i = 0;
+			for (; i + pattern_length <= count; i += pattern_length) {
+				for (size_t j = 0; j < pattern_length; j += 16) {
+					// Zero extend 16 bytes to four vectors of 32 bit integers
+					__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + j));
+					__m128i lo = _mm_unpacklo_epi8(bytes, zero);
+					__m128i hi = _mm_unpackhi_epi8(bytes, zero);
+					__m128i values[4] = {_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+					for (size_t k = 0; k < 4; k++) {
+						__m128 value = _mm_mul_ps(_mm_cvtepi32_ps(values[k]), _mm_loadu_ps(scales + j + k * 4));
+						_mm_storeu_ps(out + i + j + k * 4, _mm_add_ps(value, _mm_loadu_ps(biases + j + k * 4)));
+					}
+				}
+			}
+			normalize_u8_f32_scalar(in + i, out + i, count - i, scale, bias, channels);
+		}
+
+		JP_TARGET("avx2") void normalize_u8_f32_avx2(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels) {
+			float scales[pattern_length], biases[pattern_length];
+			fill_pattern(scale, bias, channels, scales, biases);
+
+			__m256 scale_vectors[6], bias_vectors[6];
+			for (size_t k = 0; k < 6; k++) {
+				scale_vectors[k] = _mm256_loadu_ps(scales + k * 8);
+				bias_vectors[k] = _mm256_loadu_ps(biases + k * 8);
+			}
+
+			size_t i = 0;
+			for (; i + pattern_length <= count; i += pattern_length) {
+				for (size_t k = 0; k < 6; k++) {
+					__m256i values = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + k * 8)));
+					_mm256_storeu_ps(out + i + k * 8, _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(values), scale_vectors[k]), bias_vectors[k]));
+				}
+			}
+			normalize_u8_f32_scalar(in + i, out + i, count - i, scale, bias, channels);
+		}
+
+		JP_TARGET("avx512f") void normalize_u8_f32_avx512(const uint8_t* in, float* out, size_t count, const float* scale, const float* bias, int channels) {
+			float scales[pattern_length], biases[pattern_length];
+			fill_pattern(scale, bias, channels, scales, biases);
+
+			__m512 scale_vectors[3], bias_vectors[3];
+			for (size_t k = 0; k < 3; k++) {
+				scale_vectors[k] = _mm512_loadu_ps(scales + k * 16);
+				bias_vectors[k] = _mm512_loadu_ps(biases + k * 16);
+			}
+
+			size_t i = 0;
+			for (; i + pattern_length <= count; i += pattern_length) {
+				for (size_t k = 0; k < 3; k++) {
+					__m512i values = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + k * 16)));
+					// Fused, so the last bit can differ from the other levels
+					_mm512_storeu_ps(out + i + k * 16, _mm512_fmadd_ps(_mm512_cvtepi32_ps(values), scale_vectors[k], bias_vectors[k]));
+				}
+			}
+			normalize_u8_f32_scalar(in + i, out + i, count - i, scale, bias, channels);
+		}
+#endif
+	}
+
+	FrameBatcher::FrameBatcher(FFMpegMedia_Ptr media, TensorOptions options) : options(options), reader(media, get_reader_options(options)) {
+		this->options.batch_size = std::max(this->options.batch_size, 1);
+		this->options.width = std::max(this->options.width, 1);
+		this->options.height = std::max(this->options.height, 1);
+
+		for (int channel = 0; channel < 3; channel++) {
+			float stddev = this->options.stddev[channel] != 0 ? this->options.stddev[channel] : 1;
+			scale[channel] = 1 / (255 * stddev);
+			bias[channel] = -this->options.mean[channel] / stddev;
+		}
+
+		batch.reserve(this->options.batch_size);
+		int threads = this->options.threads > 0 ? this->options.threads : std::thread::hardware_concurrency();
+		threads = std::max(1, std::min(threads, this->options.batch_size));
+		for (int i = 0; i < threads; i++) workers.emplace_back(&FrameBatcher::run, this);
+	}
+
+	FrameBatcher::~FrameBatcher() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		condition.notify_all();
+		for (auto& worker : workers) worker.join();
+	}
+
+	size_t FrameBatcher::get_frame_size() {
+		size_t values = (size_t) options.width * options.height * 3;
+		return options.type == TensorType::TENSOR_TYPE_FLOAT32 ? values * sizeof(float) : values;
+	}
+
+	int FrameBatcher::next_batch(void* tensor) {
+		std::vector<double> times;
+		return next_batch(tensor, times);
+	}
+
+	int FrameBatcher::next_batch(void* tensor, std::vector<double>& times) {
+		times.clear();
+		if (!tensor) {
+			error = "No tensor to fill";
+			return 0;
+		}
+
+		// Each frame goes to the workers as soon as it's decoded
+		DecodedFrame frame;
+		size_t frame_size = get_frame_size();
+		while ((int) times.size() < options.batch_size && reader.next(frame)) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				batch.push_back(Job{frame.frame, static_cast<uint8_t*>(tensor) + times.size() * frame_size});
+			}
+			condition.notify_one();
+			times.push_back(frame.time);
+		}
+		frame.frame.reset();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done_condition.wait(lock, [this]() { return done_jobs == batch.size(); });
+		int failures = failed;
+		// Hands the frames back to the reader
+		batch.clear();
+		next_job = 0;
+		done_jobs = 0;
+		failed = 0;
+		lock.unlock();
+
+		if (failures) {
+			error = "Unable to convert " + std::to_string(failures) + " of the frames";
+			times.clear();
+			return 0;
+		}
+		if ((int) times.size() < options.batch_size && !reader.is_finished()) {
+			error = reader.get_error();
+			times.clear();
+			return 0;
+		}
+		return times.size();
+	}
+
+	void FrameBatcher::run() {
+		SwsContext* scaler = nullptr;
+		std::vector<uint8_t> scratch;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			condition.wait(lock, [this]() { return quit || next_job < batch.size(); });
+			if (quit) break;
+
+			const Job& job = batch[next_job++];
+			lock.unlock();
+			bool converted = convert(job, scaler, scratch);
+			lock.lock();
+
+			if (!converted) failed++;
+			if (++done_jobs == batch.size()) done_condition.notify_all();
+		}
+
+		sws_freeContext(scaler);
+	}
+
+	bool FrameBatcher::convert(const Job& job, SwsContext*& scaler, std::vector<uint8_t>& scratch) {
+		auto& frame = job.frame;
+		int width = options.width;
+		int height = options.height;
+		size_t plane = (size_t) width * height;
+		bool planar = options.layout == TensorLayout::TENSOR_LAYOUT_NCHW;
+
+		// NCHW is planar RGB, which swscale only writes in GBR order, so the planes are pointed at the right places
+		AVPixelFormat format = planar ? AV_PIX_FMT_GBRP : AV_PIX_FMT_RGB24;
+		scaler = sws_getCachedContext(scaler, frame->get_width(), frame->get_height(), (AVPixelFormat) frame->get_pixel_format(), width, height, format, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		if (!scaler) return false;
+
+		bool normalized = options.type == TensorType::TENSOR_TYPE_FLOAT32;
+		if (normalized) scratch.resize(plane * 3);
+		uint8_t* target = normalized ? scratch.data() : job.destination;
+
+		uint8_t* data[4] = {target, nullptr, nullptr, nullptr};
+		int linesize[4] = {width * 3, 0, 0, 0};
+		if (planar) {
+			data[0] = target + plane;
+			data[1] = target + plane * 2;
+			data[2] = target;
+			linesize[0] = linesize[1] = linesize[2] = width;
+		}
+		sws_scale(scaler, frame->get_data(), frame->get_data_size(), 0, frame->get_height(), data, linesize);
+
+		if (normalized) {
+			float* output = reinterpret_cast<float*>(job.destination);
+			if (planar) {
+				for (int channel = 0; channel < 3; channel++) normalize_u8_f32(target + plane * channel, output + plane * channel, plane, &scale[channel], &bias[channel], 1);
+			} else {
+				normalize_u8_f32(target, output, plane * 3, scale, bias, 3);
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,292 @@
+#include "FrameReader.h"
+
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+namespace jp {
+
+	namespace {
+		/// How many frames one stream may get ahead while waiting for the other. Files interleaved worse than this come out slightly out of order rather than piling up decoded pictures
+		const size_t max_queued_frames = 32;
+
+		/// Allocates a picture whose rows are padded to a multiple of alignment bytes and no further. 0 leaves the padding to libavutil
+		bool allocate_picture(AVFrame* picture, int alignment) {
+			if (alignment <= 0) return av_frame_get_buffer(picture, 0) >= 0;
+
+			int linesize[4];
+			if (av_image_fill_linesizes(linesize, (AVPixelFormat) picture->format, picture->width) < 0) return false;
+			for (int i = 0; i < 4; i++) linesize[i] = (linesize[i] + alignment - 1) / alignment * alignment;
+
+			uint8_t* data[4];
+			int size = av_image_fill_pointers(data, (AVPixelFormat) picture->format, picture->height, nullptr, linesize);
+			if (size < 0) return false;
+			picture->buf[0] = av_buffer_alloc(size);
+			if (!picture->buf[0]) return false;
+
+			av_image_fill_pointers(data, (AVPixelFormat) picture->format, picture->height, picture->buf[0]->data, linesize);
+			for (int i = 0; i < 4; i++) {
+				picture->data[i] = data[i];
+				picture->linesize[i] = linesize[i];
+			}
+			return true;
+		}
+
+		/// Whether the picture's rows are already laid out the way allocate_picture would
+		bool is_aligned(AVFrame* picture, int alignment) {
+			if (alignment <= 0) return true;
+			int linesize[4];
+			if (av_image_fill_linesizes(linesize, (AVPixelFormat) picture->format, picture->width) < 0) return false;
+			for (int i = 0; i < 4 && picture->data[i]; i++) {
+				if (picture->linesize[i] != (linesize[i] + alignment - 1) / alignment * alignment) return false;
+			}
+			return true;
+		}
+	}
+
+	FrameReader::FrameReader(FFMpegMedia_Ptr media, FrameReaderOptions options) : media(media), options(options) {
+		video.type = DecoderType::DECODER_TYPE_VIDEO;
+		audio.type = DecoderType::DECODER_TYPE_AUDIO;
+	}
+
+	FrameReader::~FrameReader() {
+		sws_freeContext(scaler);
+	}
+
+	bool FrameReader::initialize() {
+		if (initialized) return true;
+		if (!media) {
+			error = "No media to read";
+			return false;
+		}
+
+		if (!media->is_parsed()) {
+			if (!options.audio) media->set_audio_enabled(false);
+			if (!media->parse()) {
+				error = media->get_error();
+				return false;
+			}
+		}
+
+		auto demuxer = media->get_demuxer();
+		video.enabled = options.video && demuxer->has_video() && demuxer->get_video_decoder();
+		video.stream = demuxer->get_video_stream();
+		video.decoder = demuxer->get_video_decoder();
+		audio.enabled = options.audio && demuxer->has_audio() && demuxer->get_audio_decoder();
+		audio.stream = demuxer->get_audio_stream();
+		audio.decoder = demuxer->get_audio_decoder();
+		if (!video.enabled && !audio.enabled) {
+			error = "No stream to read";
+			return false;
+		}
+
+		initialized = true;
+		return true;
+	}
+
+	bool FrameReader::next(DecodedFrame& frame) {
+		if (finished || (!initialized && !initialize())) return false;
+
+		while (true) {
+			// A frame can go once every stream that isn't over has one queued, so the earliest of them is known
+			bool waiting = false;
+			bool full = false;
+			for (StreamState* state : {&video, &audio}) {
+				if (!state->enabled) continue;
+				if (state->queue.empty() && !state->flushed) waiting = true;
+				if (state->queue.size() >= max_queued_frames) full = true;
+			}
+			if (waiting && !full) {
+				read_packet();
+				continue;
+			}
+
+			StreamState* earliest = nullptr;
+			for (StreamState* state : {&video, &audio}) {
+				if (!state->enabled || state->queue.empty()) continue;
+				if (!earliest || state->queue.front().first < earliest->queue.front().first) earliest = state;
+			}
+
+			if (!earliest) {
+				// Everything's out but what swresample held back
+				if (resampler && !resampler_flushed) {
+					resampler_flushed = true;
+					if (audio.output.use_count() > 1) audio.output.reset();
+					if (resampler->resample(nullptr, audio.output) > 0) {
+						frame.type = DecoderType::DECODER_TYPE_AUDIO;
+						frame.frame = audio.output;
+						frame.time = audio.last_time + audio.last_duration;
+						return true;
+					}
+				}
+				finished = true;
+				return false;
+			}
+
+			auto entry = earliest->queue.front();
+			earliest->queue.pop_front();
+			frame.type = earliest->type;
+			frame.time = entry.first;
+
+			if (earliest == &video) {
+				if (!sample(entry.first)) continue;
+				return convert_video(entry.second, frame.frame);
+			}
+
+			int samples = convert_audio(entry.second, frame.frame);
+			if (samples < 0) return false;
+			// swresample can keep a whole frame to itself
+			if (samples > 0) return true;
+		}
+	}
+
+	void FrameReader::read_packet() {
+		auto packet = media->get_demuxer()->get_next_packet();
+		if (!packet) {
+			// The end of the media: get the frames the decoders still hold
+			for (StreamState* state : {&video, &audio}) {
+				if (!state->enabled || state->flushed) continue;
+				state->decoded.clear();
+				state->decoder->flush(state->decoded);
+				queue_frames(*state);
+				state->flushed = true;
+			}
+			return;
+		}
+
+		StreamState& state = packet->is_video_packet() ? video : audio;
+		if (!(packet->is_video_packet() || packet->is_audio_packet()) || !state.enabled || state.flushed) return;
+
+		// Like the player, a packet the decoder rejects is skipped
+		state.decoded.clear();
+		state.decoder->decode(packet, state.decoded);
+		queue_frames(state);
+
+		// Cover art is a single picture, waiting for more would hold the audio back until the end
+		if (&state == &video && video.stream->is_attached_pic() && !video.queue.empty()) video.flushed = true;
+	}
+
+	void FrameReader::queue_frames(StreamState& state) {
+		double time_base = state.stream->get_time_base();
+		for (size_t i = 0; i < state.decoded.size(); i++) {
+			auto& frame = state.decoded[i];
+			int64_t timestamp = frame->get_best_effort_timestamp();
+			if (timestamp == AV_NOPTS_VALUE) timestamp = frame->get_presentation_timestamp();
+			double time = timestamp != AV_NOPTS_VALUE ? timestamp * time_base * 1000 : state.last_time + state.last_duration;
+
+			if (state.type == DecoderType::DECODER_TYPE_AUDIO) {
+				state.last_duration = frame->get_sample_rate() ? frame->get_number_of_samples() * 1000.0 / frame->get_sample_rate() : 0;
+			} else if (frame->get_packet_duration() > 0) {
+				state.last_duration = frame->get_packet_duration() * time_base * 1000;
+			} else {
+				state.last_duration = state.stream->get_frame_rate() > 0 ? 1000 / state.stream->get_frame_rate() : 0;
+			}
+			state.last_time = time;
+
+			// The queue keeps the frame, so the buffer allocates another for this slot next time round
+			state.queue.emplace_back(time, frame);
+		}
+		state.decoded.clear();
+	}
+
+	bool FrameReader::convert_video(const FFMpegFrame_Ptr& frame, FFMpegFrame_Ptr& output) {
+		AVFrame* source = frame->internal;
+		AVPixelFormat format = options.pixel_format != AV_PIX_FMT_NONE ? options.pixel_format : (AVPixelFormat) source->format;
+
+		int width = options.width;
+		int height = options.height;
+		if (width <= 0 && height <= 0) {
+			width = source->width;
+			height = source->height;
+		} else if (height <= 0) {
+			height = (int64_t) width * source->height / source->width;
+		} else if (width <= 0) {
+			width = (int64_t) height * source->width / source->height;
+		}
+		width = std::max(width, 1);
+		height = std::max(height, 1);
+
+		bool scale = format != source->format || width != source->width || height != source->height;
+		if (!scale && is_aligned(source, options.alignment)) {
+			output = frame;
+			return true;
+		}
+
+		// The caller's done with the last one, unless it still holds it
+		if (video.output.use_count() > 1) video.output.reset();
+		if (!video.output) video.output.reset(new FFMpegFrame());
+		AVFrame* picture = video.output->internal;
+		if (picture->format != format || picture->width != width || picture->height != height || !av_frame_is_writable(picture)) {
+			av_frame_unref(picture);
+			picture->format = format;
+			picture->width = width;
+			picture->height = height;
+			if (!allocate_picture(picture, options.alignment)) {
+				error = "Unable to allocate a video frame";
+				return false;
+			}
+		}
+
+		if (scale) {
+			scaler = sws_getCachedContext(scaler, source->width, source->height, (AVPixelFormat) source->format, width, height, format, SWS_BILINEAR, nullptr, nullptr, nullptr);
+			if (!scaler) {
+				error = "Unable to convert the video frames";
+				return false;
+			}
+			sws_scale(scaler, source->data, source->linesize, 0, source->height, picture->data, picture->linesize);
+		} else if (av_frame_copy(picture, source) < 0) {
+			error = "Unable to copy the video frame";
+			return false;
+		}
+		av_frame_copy_props(picture, source);
+
+		output = video.output;
+		return true;
+	}
+
+	int FrameReader::convert_audio(const FFMpegFrame_Ptr& frame, FFMpegFrame_Ptr& output) {
+		AVFrame* source = frame->internal;
+		int64_t layout = source->channel_layout ? source->channel_layout : av_get_default_channel_layout(source->channels);
+		AVSampleFormat format = options.sample_format != AV_SAMPLE_FMT_NONE ? options.sample_format : (AVSampleFormat) source->format;
+		int sample_rate = options.sample_rate > 0 ? options.sample_rate : source->sample_rate;
+		int64_t channel_layout = options.channels > 0 && options.channels != source->channels ? av_get_default_channel_layout(options.channels) : layout;
+
+		if (!resampler) {
+			if (format == source->format && sample_rate == source->sample_rate && channel_layout == layout) {
+				output = frame;
+				return source->nb_samples;
+			}
+
+			// Set up from the first frame, which knows its layout better than the stream does
+			resampler.reset(new FFMpegResampler());
+			if (!resampler->initialize(layout, source->sample_rate, (AVSampleFormat) source->format, channel_layout, sample_rate, format)) {
+				error = "Unable to convert the audio frames";
+				return -1;
+			}
+		}
+
+		if (audio.output.use_count() > 1) audio.output.reset();
+		int samples = resampler->resample(frame, audio.output);
+		if (samples < 0) {
+			error = "Unable to convert the audio frames";
+			return samples;
+		}
+		output = audio.output;
+		return samples;
+	}
+
+	bool FrameReader::sample(double time) {
+		if (options.fps <= 0) return true;
+
+		double interval = 1000 / options.fps;
+		// Timestamps rounded to the time base may land just short of their step
+		double slack = std::min(1.0, interval / 2);
+		if (next_sample_time >= 0 && time < next_sample_time - slack) return false;
+
+		if (next_sample_time < 0) next_sample_time = time;
+		while (next_sample_time - slack <= time) next_sample_time += interval;
+		return true;
+	}
+}
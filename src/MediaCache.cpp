@@ -0,0 +1,379 @@
+#include "MediaCache.h"
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace jp {
+
+	namespace {
+		/// "JPMC", then the format version. Bump the version whenever MediaSummary or the entry layout changes, old caches are then ignored
+		const uint32_t cache_magic = 0x434D504A;
+		const uint32_t cache_version = 1;
+		const size_t header_size = 2 * sizeof(uint32_t);
+
+		/// Entries are laid out as: total size (u32), file size (u64), modification time in ns (i64), path, then the summary
+		/// Numbers are stored in the machine's byte order, the cache isn't meant to move between machines
+		struct EntryWriter {
+			std::string data{};
+
+			template<typename T> void put(T value) { data.append(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+			void put_string(const std::string& value) {
+				put<uint32_t>(value.size());
+				data.append(value);
+			}
+		};
+
+		/// Reads an entry back, going bad instead of past the end on damaged data
+		struct EntryReader {
+			const uint8_t* data;
+			size_t size;
+			size_t position{0};
+			bool valid{true};
+
+			template<typename T> T get() {
+				T value{};
+				if (!valid || size - position < sizeof(T)) {
+					valid = false;
+					return value;
+				}
+				memcpy(&value, data + position, sizeof(T));
+				position += sizeof(T);
+				return value;
+			}
+
+			std::string get_string() {
+				uint32_t length = get<uint32_t>();
+				if (!valid || size - position < length) {
+					valid = false;
+					return std::string{};
+				}
+				std::string value(reinterpret_cast<const char*>(data + position), length);
+				position += length;
+				return value;
+			}
+		};
+	}
+
+	bool MediaCache::open(std::string path) {
+		close();
+		std::lock_guard<std::mutex> lock(mutex);
+		this->path = path;
+
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			if (errno == ENOENT) return true;
+			error = "Unable to open media cache " + path + ": " + strerror(errno);
+			return false;
+		}
+
+		struct stat info;
+		if (fstat(fd, &info) < 0) {
+			error = "Unable to read media cache " + path + ": " + strerror(errno);
+			::close(fd);
+			return false;
+		}
+
+		if ((size_t) info.st_size >= header_size) {
+			void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) {
+				error = "Unable to map media cache " + path + ": " + strerror(errno);
+				::close(fd);
+				return false;
+			}
+			mapping = static_cast<const uint8_t*>(data);
+			mapping_size = info.st_size;
+		}
+		// The mapping stays valid without the descriptor
+		::close(fd);
+
+		index_mapping();
+		return true;
+	}
+
+	void MediaCache::index_mapping() {
+		if (!mapping) return;
+
+		EntryReader header{mapping, mapping_size};
+		if (header.get<uint32_t>() != cache_magic || header.get<uint32_t>() != cache_version) {
+			fprintf(stderr, "Media cache %s is from another version, starting over\n", path.c_str());
+			unmap();
+			return;
+		}
+
+		size_t offset = header_size;
+		while (offset < mapping_size) {
+			EntryReader entry{mapping + offset, mapping_size - offset};
+			uint32_t entry_size = entry.get<uint32_t>();
+			entry.get<uint64_t>();
+			entry.get<int64_t>();
+			std::string entry_path = entry.get_string();
+			if (!entry.valid || entry_size < entry.position || entry_size > mapping_size - offset) {
+				fprintf(stderr, "Media cache %s is damaged after %zu entries\n", path.c_str(), mapped_entries.size());
+				break;
+			}
+			mapped_entries[entry_path] = offset;
+			offset += entry_size;
+		}
+	}
+
+	bool MediaCache::save() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (path.empty()) {
+			error = "No media cache file open";
+			return false;
+		}
+
+		std::string temporary_path = path + ".tmp";
+		FILE* file = fopen(temporary_path.c_str(), "wb");
+		if (!file) {
+			error = "Unable to write media cache " + temporary_path + ": " + strerror(errno);
+			return false;
+		}
+
+		bool written = fwrite(&cache_magic, sizeof(cache_magic), 1, file) == 1 && fwrite(&cache_version, sizeof(cache_version), 1, file) == 1;
+		for (auto& entry : mapped_entries) {
+			if (!written) break;
+			if (pending_entries.count(entry.first)) continue;
+			uint32_t entry_size;
+			memcpy(&entry_size, mapping + entry.second, sizeof(entry_size));
+			written = fwrite(mapping + entry.second, 1, entry_size, file) == entry_size;
+		}
+		for (auto& entry : pending_entries) {
+			if (!written) break;
+			written = fwrite(entry.second.data(), 1, entry.second.size(), file) == entry.second.size();
+		}
+
+		// The data has to be on disk before the rename is, or a crash can leave the new name on an empty or truncated file
+		if (written && (fflush(file) != 0 || fsync(fileno(file)) != 0)) written = false;
+		if (fclose(file) != 0) written = false;
+		if (!written || rename(temporary_path.c_str(), path.c_str()) != 0) {
+			error = "Unable to write media cache " + path + ": " + strerror(errno);
+			std::remove(temporary_path.c_str());
+			return false;
+		}
+
+		// Makes the rename itself durable. Some filesystems refuse to sync a directory, the old cache is still whole then so that's not an error
+		size_t separator = path.rfind('/');
+		std::string directory = separator == std::string::npos ? "." : (separator == 0 ? "/" : path.substr(0, separator));
+		int directory_fd = ::open(directory.c_str(), O_RDONLY);
+		if (directory_fd >= 0) {
+			fsync(directory_fd);
+			::close(directory_fd);
+		}
+
+		// Map what was just written, so the pending entries leave memory
+		std::string saved_path = path;
+		unmap();
+		mapped_entries.clear();
+		pending_entries.clear();
+
+		int fd = ::open(saved_path.c_str(), O_RDONLY);
+		struct stat info;
+		if (fd < 0 || fstat(fd, &info) < 0) {
+			error = "Unable to reopen media cache " + saved_path + ": " + strerror(errno);
+			if (fd >= 0) ::close(fd);
+			return false;
+		}
+		void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (data == MAP_FAILED) {
+			error = "Unable to map media cache " + saved_path + ": " + strerror(errno);
+			return false;
+		}
+		mapping = static_cast<const uint8_t*>(data);
+		mapping_size = info.st_size;
+		index_mapping();
+		return true;
+	}
+
+	void MediaCache::close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		unmap();
+		mapped_entries.clear();
+		pending_entries.clear();
+		path.clear();
+	}
+
+	void MediaCache::unmap() {
+		if (mapping) {
+			munmap(const_cast<uint8_t*>(mapping), mapping_size);
+			mapping = nullptr;
+			mapping_size = 0;
+		}
+		mapped_entries.clear();
+	}
+
+	bool MediaCache::find_entry(const std::string& path, const uint8_t*& data, size_t& size) {
+		auto pending = pending_entries.find(path);
+		if (pending != pending_entries.end()) {
+			data = reinterpret_cast<const uint8_t*>(pending->second.data());
+			size = pending->second.size();
+			return true;
+		}
+
+		auto mapped = mapped_entries.find(path);
+		if (mapped == mapped_entries.end()) return false;
+		uint32_t entry_size;
+		memcpy(&entry_size, mapping + mapped->second, sizeof(entry_size));
+		data = mapping + mapped->second;
+		size = entry_size;
+		return true;
+	}
+
+	bool MediaCache::lookup(const std::string& path, MediaSummary& summary) {
+		uint64_t file_size;
+		int64_t modified;
+		if (!get_file_stamp(path, file_size, modified)) return false;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		const uint8_t* data;
+		size_t size;
+		if (!find_entry(path, data, size)) return false;
+
+		MediaSummary cached;
+		uint64_t cached_size;
+		int64_t cached_modified;
+		if (!decode_entry(data, size, cached, cached_size, cached_modified)) return false;
+		if (cached_size != file_size || cached_modified != modified) return false;
+
+		summary = std::move(cached);
+		return true;
+	}
+
+	bool MediaCache::store(const MediaSummary& summary) {
+		uint64_t file_size;
+		int64_t modified;
+		if (!get_file_stamp(summary.path, file_size, modified)) return false;
+
+		std::string entry = encode_entry(summary, file_size, modified);
+		std::lock_guard<std::mutex> lock(mutex);
+		pending_entries[summary.path] = std::move(entry);
+		return true;
+	}
+
+	void MediaCache::remove(const std::string& path) {
+		std::lock_guard<std::mutex> lock(mutex);
+		pending_entries.erase(path);
+		mapped_entries.erase(path);
+	}
+
+	bool MediaCache::get_summary(const std::string& path, MediaSummary& summary, int64_t probe_size) {
+		if (lookup(path, summary)) return true;
+
+		// Probing runs without the lock, so other threads can look entries up meanwhile
+		FFMpegIOContext_Ptr context{new FFMpegIOContext()};
+		if (!context->open(path, OpenMode::OPEN_MODE_READ)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			error = context->get_error();
+			return false;
+		}
+
+		FFMpegMedia media(context);
+		if (!media.probe(probe_size)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			error = media.get_error();
+			return false;
+		}
+
+		summary = media.get_summary();
+		store(summary);
+		return true;
+	}
+
+	size_t MediaCache::size() {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t count = pending_entries.size();
+		for (auto& entry : mapped_entries) {
+			if (!pending_entries.count(entry.first)) count++;
+		}
+		return count;
+	}
+
+	bool MediaCache::get_file_stamp(const std::string& path, uint64_t& size, int64_t& modified) {
+		struct stat info;
+		if (stat(path.c_str(), &info) < 0) return false;
+		size = info.st_size;
+#ifdef __APPLE__
+		modified = (int64_t) info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+		modified = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+		return true;
+	}
+
+	std::string MediaCache::encode_entry(const MediaSummary& summary, uint64_t file_size, int64_t modified) {
+		EntryWriter writer;
+		// The size goes in once the entry is complete
+		writer.put<uint32_t>(0);
+		writer.put<uint64_t>(file_size);
+		writer.put<int64_t>(modified);
+		writer.put_string(summary.path);
+
+		writer.put<uint64_t>(summary.duration);
+		writer.put<uint64_t>(summary.bitrate);
+
+		writer.put<uint8_t>(summary.has_audio);
+		writer.put<int32_t>(summary.sample_rate);
+		writer.put<int32_t>(summary.channels);
+		writer.put<uint64_t>(summary.channel_layout);
+		writer.put<int32_t>(summary.sample_format);
+
+		writer.put<uint8_t>(summary.has_video);
+		writer.put<int32_t>(summary.width);
+		writer.put<int32_t>(summary.height);
+		writer.put<int32_t>(summary.pixel_format);
+		writer.put<double>(summary.frame_rate);
+		writer.put<uint8_t>(summary.attached_pic);
+		writer.put<int32_t>(summary.keyframes);
+
+		writer.put<uint32_t>(summary.metadata.size());
+		for (auto& tag : summary.metadata) {
+			writer.put_string(tag.first);
+			writer.put_string(tag.second);
+		}
+
+		uint32_t entry_size = writer.data.size();
+		memcpy(&writer.data[0], &entry_size, sizeof(entry_size));
+		return writer.data;
+	}
+
+	bool MediaCache::decode_entry(const uint8_t* data, size_t size, MediaSummary& summary, uint64_t& file_size, int64_t& modified) {
+		EntryReader reader{data, size};
+		reader.get<uint32_t>();
+		file_size = reader.get<uint64_t>();
+		modified = reader.get<int64_t>();
+		summary.path = reader.get_string();
+
+		summary.duration = reader.get<uint64_t>();
+		summary.bitrate = reader.get<uint64_t>();
+
+		summary.has_audio = reader.get<uint8_t>();
+		summary.sample_rate = reader.get<int32_t>();
+		summary.channels = reader.get<int32_t>();
+		summary.channel_layout = reader.get<uint64_t>();
+		summary.sample_format = static_cast<AVSampleFormat>(reader.get<int32_t>());
+
+		summary.has_video = reader.get<uint8_t>();
+		summary.width = reader.get<int32_t>();
+		summary.height = reader.get<int32_t>();
+		summary.pixel_format = static_cast<AVPixelFormat>(reader.get<int32_t>());
+		summary.frame_rate = reader.get<double>();
+		summary.attached_pic = reader.get<uint8_t>();
+		summary.keyframes = reader.get<int32_t>();
+
+		uint32_t tags = reader.get<uint32_t>();
+		summary.metadata.clear();
+		for (uint32_t i = 0; i < tags && reader.valid; i++) {
+			std::string key = reader.get_string();
+			std::string value = reader.get_string();
+			summary.metadata[key] = value;
+		}
+		return reader.valid;
+	}
+}
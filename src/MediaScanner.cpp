@@ -0,0 +1,141 @@
+#include "MediaScanner.h"
+
+namespace jp {
+
+	MediaScanner::MediaScanner(ScannerOptions options) : options(options) {}
+
+	MediaScanner::~MediaScanner() {
+		cancel();
+		wait();
+	}
+
+	bool MediaScanner::scan(std::vector<std::string> paths, ScanCallback callback) {
+		if (scanning) return false;
+		// Threads of a scan that finished on its own
+		wait();
+
+		this->paths = std::move(paths);
+		this->callback = callback;
+		next_path = 0;
+		completed = 0;
+		cancelled = false;
+		opened_files.clear();
+
+		int io_threads = options.io_threads > 0 ? options.io_threads : 4;
+		int cpu_threads = options.cpu_threads > 0 ? options.cpu_threads : (int) std::thread::hardware_concurrency();
+		if (cpu_threads < 1) cpu_threads = 1;
+		queue_capacity = cpu_threads * 2;
+		io_running = io_threads;
+		cpu_running = cpu_threads;
+
+		scanning = true;
+		for (int i = 0; i < io_threads; i++) io_workers.emplace_back(&MediaScanner::io_func, this);
+		for (int i = 0; i < cpu_threads; i++) cpu_workers.emplace_back(&MediaScanner::cpu_func, this);
+		return true;
+	}
+
+	void MediaScanner::wait() {
+		for (auto& worker : io_workers) worker.join();
+		for (auto& worker : cpu_workers) worker.join();
+		io_workers.clear();
+		cpu_workers.clear();
+		scanning = false;
+	}
+
+	void MediaScanner::cancel() {
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		cancelled = true;
+		// Files opened but not probed yet are dropped, closing them
+		opened_files.clear();
+		queue_filled.notify_all();
+		queue_drained.notify_all();
+	}
+
+	void MediaScanner::io_func() {
+		std::vector<uint8_t> buffer(options.probe_size > 0 ? options.probe_size : 64 * 1024);
+
+		while (!cancelled) {
+			size_t index = next_path++;
+			if (index >= paths.size()) break;
+
+			if (cache) {
+				ScanResult result;
+				result.index = index;
+				if (cache->lookup(paths[index], result.summary)) {
+					result.success = true;
+					report(result);
+					continue;
+				}
+			}
+
+			FFMpegIOContext_Ptr context{new FFMpegIOContext()};
+			if (!context->open(paths[index], OpenMode::OPEN_MODE_READ)) {
+				ScanResult result;
+				result.index = index;
+				result.summary.path = paths[index];
+				result.error = context->get_error();
+				report(result);
+				continue;
+			}
+
+			// Reading the headers here leaves them in the page cache, so the probe doesn't wait on the disk
+			context->read(buffer.data(), buffer.size());
+			context->seek(0, SEEK_SET);
+
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_drained.wait(lock, [this]() { return opened_files.size() < queue_capacity || cancelled; });
+			if (cancelled) break;
+			opened_files.push_back(OpenedFile{index, context});
+			queue_filled.notify_one();
+		}
+
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (--io_running == 0) queue_filled.notify_all();
+	}
+
+	void MediaScanner::cpu_func() {
+		while (true) {
+			OpenedFile file;
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				queue_filled.wait(lock, [this]() { return !opened_files.empty() || io_running == 0 || cancelled; });
+				if (opened_files.empty()) break;
+				file = std::move(opened_files.front());
+				opened_files.pop_front();
+				queue_drained.notify_one();
+			}
+
+			ScanResult result;
+			result.index = file.index;
+			FFMpegMedia media(file.context);
+			if (media.probe(options.probe_size)) {
+				result.success = true;
+				result.summary = media.get_summary();
+				if (cache) cache->store(result.summary);
+			} else {
+				result.summary.path = paths[file.index];
+				result.error = media.get_error();
+			}
+			report(result);
+		}
+
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (--cpu_running == 0) scanning = false;
+	}
+
+	void MediaScanner::report(ScanResult& result) {
+		std::lock_guard<std::mutex> lock(callback_mutex);
+		if (callback) callback(result);
+		completed++;
+	}
+
+	std::vector<ScanResult> MediaScanner::scan_all(const std::vector<std::string>& paths, ScannerOptions options) {
+		std::vector<ScanResult> results(paths.size());
+		MediaScanner scanner(options);
+		scanner.scan(paths, [&results](const ScanResult& result) {
+			results[result.index] = result;
+		});
+		scanner.wait();
+		return results;
+	}
+}
@@ -0,0 +1,290 @@
+#include "NullOutput.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+namespace jp {
+
+	void OutputCounters::record_fetch(uint64_t time) {
+		fetch_time += time;
+		uint64_t longest = max_fetch_time.load(std::memory_order_relaxed);
+		while (time > longest && !max_fetch_time.compare_exchange_weak(longest, time)) {}
+	}
+
+	void OutputCounters::start(int64_t time) {
+		int64_t stopped = 0;
+		started.compare_exchange_strong(stopped, time);
+	}
+
+	void OutputCounters::stop(int64_t time) {
+		int64_t since = started.exchange(0);
+		if (since) elapsed += time - since;
+	}
+
+	OutputStats OutputCounters::get_stats(int64_t time) {
+		OutputStats stats;
+		stats.frames = frames;
+		stats.dropped = dropped;
+		stats.samples = samples;
+		stats.bytes = bytes;
+		stats.underruns = underruns;
+		stats.fetch_time = fetch_time;
+		stats.max_fetch_time = max_fetch_time;
+		int64_t since = started;
+		stats.elapsed = elapsed + (since ? time - since : 0);
+		return stats;
+	}
+
+	void OutputCounters::reset() {
+		frames = 0;
+		dropped = 0;
+		samples = 0;
+		bytes = 0;
+		underruns = 0;
+		fetch_time = 0;
+		max_fetch_time = 0;
+		elapsed = 0;
+		// Keep running from now if playing
+		int64_t since = started;
+		if (since) started = IAudioOutput::get_monotonic_time();
+	}
+
+	bool NullAudioOutput::initialize() {
+		release();
+
+		format.sample_rate = preferred_format.sample_rate ? preferred_format.sample_rate : media_player->get_sample_rate();
+		format.channels = preferred_format.channels ? preferred_format.channels : media_player->get_channels();
+		format.channel_layout = preferred_format.channel_layout ? preferred_format.channel_layout : av_get_default_channel_layout(format.channels);
+		format.sample_format = preferred_format.sample_format != AV_SAMPLE_FMT_NONE ? av_get_packed_sample_fmt(preferred_format.sample_format) : AV_SAMPLE_FMT_FLT;
+		if (format.sample_rate <= 0 || format.channels <= 0) {
+			error = "No audio format to consume";
+			return false;
+		}
+
+		// Nothing sits between handing samples over and "hearing" them
+		device_latency = 0;
+		clear_clock();
+		finished = false;
+		buffering = false;
+		quit = false;
+		worker = std::thread(&NullAudioOutput::run, this);
+		return true;
+	}
+
+	bool NullAudioOutput::play() {
+		if (is_playing) return false;
+		counters.start(get_monotonic_time());
+		is_playing = true;
+		condition.notify_all();
+		return true;
+	}
+
+	bool NullAudioOutput::pause() {
+		if (!is_playing) return false;
+		is_playing = false;
+		counters.stop(get_monotonic_time());
+		freeze_clock_locked();
+		return true;
+	}
+
+	bool NullAudioOutput::stop() {
+		is_playing = false;
+		counters.stop(get_monotonic_time());
+		freeze_clock_locked();
+		return true;
+	}
+
+	void NullAudioOutput::freeze_clock_locked() {
+		// Wakes run from pacing, then waits out a frame it's publishing, so the clock only has one writer
+		condition.notify_all();
+		std::lock_guard<std::mutex> lock(mutex);
+		freeze_clock();
+	}
+
+	void NullAudioOutput::release() {
+		quit = true;
+		is_playing = false;
+		condition.notify_all();
+		{
+			std::lock_guard<std::mutex> finish_lock(finish_mutex);
+			finish_condition.notify_all();
+		}
+		if (worker.joinable()) worker.join();
+		counters.stop(get_monotonic_time());
+	}
+
+	void NullAudioOutput::reset() {
+		// Waits out a frame being fetched
+		std::lock_guard<std::mutex> lock(mutex);
+		clear_clock();
+		finished = false;
+		paced_samples = 0;
+		pace_start = 0;
+	}
+
+	bool NullAudioOutput::wait_until_finished(int64_t timeout) {
+		std::unique_lock<std::mutex> lock(finish_mutex);
+		return finish_condition.wait_for(lock, std::chrono::milliseconds(timeout), [this]() { return finished || quit; }) && finished;
+	}
+
+	void NullAudioOutput::run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!quit) {
+			if (!is_playing) {
+				pace_start = 0;
+				// play doesn't take the lock (the player calls it from its callbacks), so don't rely on the notification alone
+				condition.wait_for(lock, std::chrono::milliseconds(10));
+				continue;
+			}
+
+			int64_t fetch_start = get_monotonic_time();
+			auto frame = media_player->get_next_audio_frame();
+			int64_t now = get_monotonic_time();
+			counters.record_fetch(now - fetch_start);
+
+			if (!frame) {
+				if (media_player->get_current_media()->get_demuxer()->is_finished()) {
+					std::lock_guard<std::mutex> finish_lock(finish_mutex);
+					finished = true;
+					finish_condition.notify_all();
+				} else {
+					counters.record_underrun();
+				}
+				condition.wait_for(lock, std::chrono::milliseconds(1));
+				continue;
+			}
+			finished = false;
+
+			int samples = frame->get_number_of_samples();
+			counters.record_frame(av_samples_get_buffer_size(nullptr, format.channels, samples, format.sample_format, 1), samples);
+
+			double duration = samples * 1000.0 / format.sample_rate;
+			if (frame->get_presentation_timestamp() != AV_NOPTS_VALUE) {
+				double start_pts = frame->get_presentation_timestamp() * media_player->get_current_media()->get_demuxer()->get_audio_stream()->get_time_base() * 1000.0;
+				bool realtime = pacing == OutputPacing::OUTPUT_PACING_REALTIME;
+				// Unpaced, the frame is "heard" the moment it's taken
+				publish_clock(realtime ? start_pts : start_pts + duration, now, start_pts + duration, realtime);
+				media_player->set_last_audio_pts(start_pts > 0 ? start_pts : 0);
+			}
+
+			if (pacing == OutputPacing::OUTPUT_PACING_REALTIME) {
+				// Paced from the start rather than frame by frame, so sleeping late doesn't add up
+				if (!pace_start) {
+					pace_start = now;
+					paced_samples = 0;
+				}
+				paced_samples += samples;
+				int64_t due = pace_start + (int64_t) (paced_samples * 1000000 / format.sample_rate);
+				condition.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::microseconds(due)), [this]() { return quit || !is_playing; });
+			}
+		}
+	}
+
+	bool NullVideoOutput::initialize() {
+		if (initialized) return true;
+		buffering = false;
+		finished = false;
+		quit = false;
+		pace_offset = -1;
+		worker = std::thread(&NullVideoOutput::run, this);
+		initialized = true;
+		return true;
+	}
+
+	bool NullVideoOutput::play() {
+		if (!initialized && !initialize()) return false;
+		if (!playing) counters.start(IAudioOutput::get_monotonic_time());
+		playing = true;
+		condition.notify_all();
+		return true;
+	}
+
+	bool NullVideoOutput::pause() {
+		playing = false;
+		counters.stop(IAudioOutput::get_monotonic_time());
+		return true;
+	}
+
+	bool NullVideoOutput::stop() {
+		return pause();
+	}
+
+	void NullVideoOutput::release() {
+		quit = true;
+		playing = false;
+		condition.notify_all();
+		{
+			std::lock_guard<std::mutex> finish_lock(finish_mutex);
+			finish_condition.notify_all();
+		}
+		if (worker.joinable()) worker.join();
+		initialized = false;
+		counters.stop(IAudioOutput::get_monotonic_time());
+	}
+
+	void NullVideoOutput::reset() {
+		std::lock_guard<std::mutex> lock(mutex);
+		finished = false;
+		pace_offset = -1;
+	}
+
+	bool NullVideoOutput::wait_until_finished(int64_t timeout) {
+		std::unique_lock<std::mutex> lock(finish_mutex);
+		return finish_condition.wait_for(lock, std::chrono::milliseconds(timeout), [this]() { return finished || quit; }) && finished;
+	}
+
+	void NullVideoOutput::run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!quit) {
+			if (!playing) {
+				pace_offset = -1;
+				condition.wait_for(lock, std::chrono::milliseconds(10));
+				continue;
+			}
+
+			int64_t fetch_start = IAudioOutput::get_monotonic_time();
+			auto frame = player->get_next_video_frame();
+			int64_t now = IAudioOutput::get_monotonic_time();
+			counters.record_fetch(now - fetch_start);
+
+			auto media = player->get_current_media();
+			auto stream = media->get_demuxer()->get_video_stream();
+			if (!frame) {
+				if (media->get_demuxer()->is_finished() || stream->is_attached_pic()) {
+					std::lock_guard<std::mutex> finish_lock(finish_mutex);
+					finished = true;
+					finish_condition.notify_all();
+				} else {
+					counters.record_underrun();
+				}
+				condition.wait_for(lock, std::chrono::milliseconds(1));
+				continue;
+			}
+			finished = false;
+
+			double pts = frame->get_presentation_timestamp() * stream->get_time_base() * 1000;
+			if (pacing == OutputPacing::OUTPUT_PACING_REALTIME && !stream->is_attached_pic()) {
+				double wait = 0;
+				if (player->is_audio_enabled()) {
+					// The same sync as SDLVideoOutput: drop frames more than 30ms late, wait for the audio when ahead
+					double diff = player->get_audio_clock() - pts;
+					if (diff > 30) {
+						counters.record_drop();
+						continue;
+					}
+					wait = -diff;
+				} else {
+					if (pace_offset < 0) pace_offset = now / 1000.0 - pts;
+					wait = pace_offset + pts - now / 1000.0;
+				}
+				if (wait > 0) {
+					condition.wait_for(lock, std::chrono::microseconds((int64_t) (std::min(wait, 1000.0) * 1000)), [this]() { return quit || !playing; });
+				}
+			}
+
+			if (!stream->is_attached_pic()) player->set_last_video_pts(frame->get_presentation_timestamp());
+			counters.record_frame(av_image_get_buffer_size((AVPixelFormat) frame->get_pixel_format(), frame->get_width(), frame->get_height(), 1), 0);
+		}
+	}
+}
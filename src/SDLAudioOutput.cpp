@@ -1,29 +1,91 @@
 #include "SDLAudioOutput.h"
 
 namespace jp {
+	/// SDL sample format for a packed FFmpeg sample format, 0 if SDL can't play it
+	static SDL_AudioFormat to_sdl_format(AVSampleFormat format) {
+		switch (av_get_packed_sample_fmt(format)) {
+			case AV_SAMPLE_FMT_U8: return AUDIO_U8;
+			case AV_SAMPLE_FMT_S16: return AUDIO_S16SYS;
+			case AV_SAMPLE_FMT_S32: return AUDIO_S32SYS;
+			case AV_SAMPLE_FMT_FLT: return AUDIO_F32SYS;
+			default: return 0;
+		}
+	}
+
+	static AVSampleFormat from_sdl_format(SDL_AudioFormat format) {
+		switch (format) {
+			case AUDIO_U8: return AV_SAMPLE_FMT_U8;
+			case AUDIO_S16SYS: return AV_SAMPLE_FMT_S16;
+			case AUDIO_S32SYS: return AV_SAMPLE_FMT_S32;
+			case AUDIO_F32SYS: return AV_SAMPLE_FMT_FLT;
+			default: return AV_SAMPLE_FMT_NONE;
+		}
+	}
+
 	bool SDLAudioOutput::initialize() {
 
-		if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+		// Opening again (e.g. for the next media) replaces the device
+		release();
+
+		// Counted by SDL, so each output's release only drops its own reference
+		if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
 			error = "Unable to initialize the SDL2 audio subsystem";
 			return false;
 		}
+		subsystem_initialized = true;
+
+		SDL_AudioFormat requested_format = to_sdl_format(preferred_format.sample_format);
 
-		spec.freq = media_player->get_sample_rate();
+		spec.freq = preferred_format.sample_rate ? preferred_format.sample_rate : media_player->get_sample_rate();
 		spec.callback = SDLAudioOutput::audio_callback;
 		spec.userdata = this;
-		spec.channels = media_player->get_channels();
-		spec.format = AUDIO_S16;
+		spec.channels = preferred_format.channels ? preferred_format.channels : media_player->get_channels();
+		spec.format = requested_format ? requested_format : AUDIO_F32SYS;
 		spec.silence = 0;
+
+		int samples = 1;
+		while (samples < period_size && samples < 32768) samples <<= 1;
+		spec.samples = samples;
 		
 		SDL_AudioSpec gotten;
+		const char* name = device_name.empty() ? nullptr : device_name.c_str();
+
+		// Let the device pick whatever rate, channels and format it likes best, the player converts to that in one go. The period size stays ours
+		device = SDL_OpenAudioDevice(name, 0, &spec, &gotten, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE | SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+		if (device && from_sdl_format(gotten.format) == AV_SAMPLE_FMT_NONE) {
+			// A format we can't produce (e.g. non-native endianness), make SDL convert from ours instead
+			SDL_CloseAudioDevice(device);
+			device = SDL_OpenAudioDevice(name, 0, &spec, &gotten, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+		}
 
-		if (SDL_OpenAudio(&spec, &gotten) < 0) {
-			error = "Unable to open audio output!";
+		if (!device) {
+			error = std::string("Unable to open audio output! ") + SDL_GetError();
+			release();
 			return false;
 		}
+
+		gotten.callback = spec.callback;
+		gotten.userdata = spec.userdata;
+		spec = gotten;
+
+		format.sample_rate = spec.freq;
+		format.channels = spec.channels;
+		format.channel_layout = av_get_default_channel_layout(spec.channels);
+		format.sample_format = from_sdl_format(spec.format);
+
+		// SDL2 can't tell how much the hardware buffers behind it, but it always holds the period it asked for last while we fill the next one
+		device_latency = spec.samples * 1000.0 / spec.freq;
+		fifo_end_pts = -1;
+		clear_clock();
         
-        fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_S16, gotten.channels, 1);
-        if (!fifo) return false;
+		fprintf(stderr, "Audio output %u: %d Hz, %d channels, %s, %d frame periods\n", device, format.sample_rate, format.channels, av_get_sample_fmt_name(format.sample_format), spec.samples);
+        
+        // Room for a few periods up front, so the callback doesn't grow it
+        fifo = av_audio_fifo_alloc(format.sample_format, format.channels, spec.samples * 4);
+        if (!fifo) {
+        	release();
+        	return false;
+        }
         
         buffering = false;
 
@@ -33,33 +95,63 @@ namespace jp {
 	bool SDLAudioOutput::play() {
 		if (is_playing) return false;
 		is_playing = true;
-		SDL_PauseAudio(0);
+		SDL_PauseAudioDevice(device, 0);
 		return true;
 	}
 
 	bool SDLAudioOutput::pause() {
 		if (!is_playing) return false;
 		is_playing = false;
-		SDL_PauseAudio(1);
+		SDL_PauseAudioDevice(device, 1);
+		// The callback is the clock's only other writer
+		SDL_LockAudioDevice(device);
+		freeze_clock();
+		SDL_UnlockAudioDevice(device);
 		return true;
 	}
 
 	bool SDLAudioOutput::stop() {
-		SDL_PauseAudio(1);
+		SDL_PauseAudioDevice(device, 1);
+		SDL_LockAudioDevice(device);
+		freeze_clock();
+		SDL_UnlockAudioDevice(device);
 		// Clear the internal queue
 		return true;
 	}
 
 	void SDLAudioOutput::release() {
-		SDL_CloseAudio();
-        SDL_Quit();
+		// Closing waits for a running callback, after that nothing touches the fifo
+		if (device) SDL_CloseAudioDevice(device);
+		device = 0;
+		is_playing = false;
+
+		av_audio_fifo_free(fifo);
+		fifo = nullptr;
+
+		if (subsystem_initialized) SDL_QuitSubSystem(SDL_INIT_AUDIO);
+		subsystem_initialized = false;
+	}
+
+	std::vector<std::string> SDLAudioOutput::get_devices() {
+		std::vector<std::string> devices;
+		if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) return devices;
+
+		int count = SDL_GetNumAudioDevices(0);
+		for (int i = 0; i < count; i++) {
+			const char* name = SDL_GetAudioDeviceName(i, 0);
+			if (name) devices.push_back(name);
+		}
+
+		SDL_QuitSubSystem(SDL_INIT_AUDIO);
+		return devices;
 	}
 
 	void SDLAudioOutput::audio_callback(void* opaque, uint8_t* buffer, int len) {
-        SDL_memset(buffer, 0, len);
 		auto* output = reinterpret_cast<SDLAudioOutput*>(opaque);
+		int64_t now = get_monotonic_time();
+        SDL_memset(buffer, output->spec.silence, len);
         
-        int samples = len / output->spec.channels / output->spec.channels;
+        int samples = len / (output->spec.channels * av_get_bytes_per_sample(output->format.sample_format));
         
         while (av_audio_fifo_size(output->fifo) < samples) {
             auto frame = output->media_player->get_next_audio_frame();
@@ -77,11 +169,29 @@ namespace jp {
             
             av_audio_fifo_write(output->fifo, (void**)frame->get_data(), frame->get_number_of_samples());
             
-			// Set the last audio presentation time in milliseconds
-            output->media_player->set_last_audio_pts(frame->get_presentation_timestamp() * (output->media_player->get_current_media()->get_demuxer()->get_audio_stream()->get_time_base() * 1000.0));
+            // Track where the fifo ends in media time. Frames without a timestamp carry on from the one before
+            double duration = frame->get_number_of_samples() * 1000.0 / output->spec.freq;
+            if (frame->get_presentation_timestamp() != AV_NOPTS_VALUE) {
+                output->fifo_end_pts = frame->get_presentation_timestamp() * (output->media_player->get_current_media()->get_demuxer()->get_audio_stream()->get_time_base() * 1000.0) + duration;
+            } else if (output->fifo_end_pts >= 0) {
+                output->fifo_end_pts += duration;
+            }
         }
         
+        // Media time of the first sample handed over now
+        double start_pts = output->fifo_end_pts - av_audio_fifo_size(output->fifo) * 1000.0 / output->spec.freq;
+        
         int read = av_audio_fifo_read(output->fifo, (void**)&buffer, samples);
         output->total_samples_written += read;
+        
+        if (output->fifo_end_pts >= 0) {
+            // That sample is heard once the device has played what it already holds, so that's the media time being heard right now
+            double latency = output->get_latency();
+            double heard = start_pts - latency;
+            output->publish_clock(heard, now, start_pts + read * 1000.0 / output->spec.freq, true);
+            
+            // Set the last audio presentation time in milliseconds
+            output->media_player->set_last_audio_pts(heard > 0 ? heard : 0);
+        }
 	}
 }
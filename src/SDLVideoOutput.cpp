@@ -6,11 +6,19 @@ namespace jp {
 
 SDLVideoOutput::SDLVideoOutput(std::shared_ptr<FFMpegMediaPlayer> player) : IVideoOutput(player), video_frame_queue(100) {}
 
+SDLVideoOutput::~SDLVideoOutput() {
+    release();
+}
+
 bool SDLVideoOutput::initialize() {
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+    // Initializing again (e.g. for the next media) replaces the window
+    release();
+    
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) {
         error = "Unable to initialize SDL2";
         return false;
     }
+    subsystem_initialized = true;
     
     if (TTF_Init() < 0) {
         error = "Unable to initialize TTF Rendering engine";
@@ -49,11 +57,8 @@ bool SDLVideoOutput::initialize() {
     stop_thread = false;
     buffering = true;
     
-    std::thread buffer_thread = std::thread(&SDLVideoOutput::buffer_data, this);
-    buffer_thread.detach();
-    
-    std::thread player_thread = std::thread(&SDLVideoOutput::playback_func, this);
-    player_thread.detach();
+    buffer_thread = std::thread(&SDLVideoOutput::buffer_data, this);
+    player_thread = std::thread(&SDLVideoOutput::playback_func, this);
     
     if (!player->is_audio_enabled()) {
         sync_to_audio = false; // We do not sync to audio
@@ -68,22 +73,24 @@ void SDLVideoOutput::playback_func() {
     while (!stop_thread) {
         // Just stay here and do nothing if we're not currently playing
         std::unique_lock<std::mutex> lock(player_mutex);
-        while (!playing) {
+        while (!playing && !stop_thread) {
             player_condition.wait(lock);
             fprintf(stderr, "Said to play\n");
         }
+        if (stop_thread) break;
         
         FFMpegFrame_Ptr frame;
-        while (!video_frame_queue.try_dequeue(frame)) {
+        while (!video_frame_queue.try_dequeue(frame) && !stop_thread) {
             fprintf(stderr, "Couldn't dequeue video frame!\n");
             buffering = true;
             player->buffering_changed();
 
-            while (buffering) {
+            while (buffering && !stop_thread) {
                 frame_queue_condition.notify_all();
                 player_condition.wait(lock);
             }
         }
+        if (stop_thread) break;
 
         frame_queue_condition.notify_all();
         
@@ -94,7 +101,7 @@ void SDLVideoOutput::playback_func() {
             
             if (!player->get_current_media()->get_demuxer()->get_video_stream()->is_attached_pic()) {
                 if (sync_to_audio) {
-                    auto last_audio_pts = player->get_last_audio_pts();
+                    auto last_audio_pts = player->get_audio_clock();
                     
                     // This is where the synchronization happens
                     auto diff = last_audio_pts - pts;
@@ -171,7 +178,7 @@ void SDLVideoOutput::buffer_data() {
         std::unique_lock<std::mutex> lock(frame_queue_mutex);
         FFMpegFrame_Ptr frame = player->get_next_video_frame();
         if (frame) {
-            while (!video_frame_queue.try_enqueue(frame)) {
+            while (!video_frame_queue.try_enqueue(frame) && !stop_thread) {
                 if (buffering) {
                     buffering = false;
                     player_condition.notify_all();
@@ -218,13 +225,44 @@ bool SDLVideoOutput::stop() {
     return true;
 }
 void SDLVideoOutput::release() {
+    // Also after an initialize that failed half way, or never ran (fast start creates the window on the first play)
+    if (!initialized && !subsystem_initialized) return;
     fprintf(stderr, "Released called on the video output!\n");
-    reset();
+    
     stop_thread = true;
-    SDL_DestroyWindow(window);
-    SDL_DestroyTexture(texture);
-    SDL_DestroyRenderer(renderer);
-    SDL_Quit();
+    playing = false;
+    {
+        // Taken so a thread can't miss the wake up between checking stop_thread and waiting
+        std::lock_guard<std::mutex> lock(player_mutex);
+        player_condition.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(frame_queue_mutex);
+        frame_queue_condition.notify_all();
+    }
+    if (buffer_thread.joinable()) buffer_thread.join();
+    if (player_thread.joinable()) player_thread.join();
+    
+    if (initialized) reset();
+    
+    // The player releases us when it switches media, the next play creates the window again
+    initialized = false;
+    if (sub_texture) SDL_DestroyTexture(sub_texture);
+    if (texture) SDL_DestroyTexture(texture);
+    if (renderer) SDL_DestroyRenderer(renderer);
+    if (window) SDL_DestroyWindow(window);
+    sub_texture = nullptr;
+    texture = nullptr;
+    renderer = nullptr;
+    window = nullptr;
+    sws_freeContext(context);
+    context = nullptr;
+    if (font) TTF_CloseFont(font);
+    font = nullptr;
+    last_subs.clear();
+    // Only our reference, other players may still be using SDL
+    if (subsystem_initialized) SDL_QuitSubSystem(SDL_INIT_VIDEO);
+    subsystem_initialized = false;
 }
 void SDLVideoOutput::reset() {
     clear_buffer();
@@ -0,0 +1,249 @@
+#include "SampleConversion.h"
+#include "CpuDispatch.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(JP_X86_DISPATCH)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace jp {
+
+void s16_to_f32(const int16_t* in, float* out, size_t count) {
+    get_kernels().s16_to_f32(in, out, count);
+}
+
+void f32_to_s16(const float* in, int16_t* out, size_t count) {
+    get_kernels().f32_to_s16(in, out, count);
+}
+
+namespace simd {
+
+void s16_to_f32_scalar(const int16_t* in, float* out, size_t count) {
+    const float scale = 1.0f / 32768.0f;
+    for (size_t i = 0; i < count; i++) {
+        out[i] = in[i] * scale;
+    }
+}
+
+void f32_to_s16_scalar(const float* in, int16_t* out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = (int16_t) lrintf(std::min(32767.0f, std::max(-32768.0f, in[i] * 32768.0f)));
+    }
+}
+
+#if defined(JP_X86_DISPATCH)
+JP_TARGET("sse2") void s16_to_f32_sse2(const int16_t* in, float* out, size_t count) {
+    size_t i = 0;
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        // Sign extend to 32 bits by moving each sample to the top half and shifting it back down
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    s16_to_f32_scalar(in + i, out + i, count - i);
+}
+
+JP_TARGET("sse4.1") void s16_to_f32_sse41(const int16_t* in, float* out, size_t count) {
+    size_t i = 0;
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(samples)), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(samples, 8))), scale));
+    }
+    s16_to_f32_scalar(in + i, out + i, count - i);
+}
+
+JP_TARGET("sse2") void f32_to_s16_sse2(const float* in, int16_t* out, size_t count) {
+    size_t i = 0;
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 max = _mm_set1_ps(32767.0f);
+    const __m128 min = _mm_set1_ps(-32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        // Clamp before converting, out of range floats convert to INT_MIN
+        __m128 lo = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), min), max);
+        __m128 hi = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale), min), max);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+    }
+    f32_to_s16_scalar(in + i, out + i, count - i);
+}
+
+JP_TARGET("avx2") void s16_to_f32_avx2(const int16_t* in, float* out, size_t count) {
+    size_t i = 0;
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(lo)), scale));
+        _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(hi)), scale));
+    }
+    s16_to_f32_scalar(in + i, out + i, count - i);
+}
+
+JP_TARGET("avx2") void f32_to_s16_avx2(const float* in, int16_t* out, size_t count) {
+    size_t i = 0;
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 max = _mm256_set1_ps(32767.0f);
+    const __m256 min = _mm256_set1_ps(-32768.0f);
+    for (; i + 16 <= count; i += 16) {
+        __m256 lo = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), min), max);
+        __m256 hi = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale), min), max);
+        // The pack works per 128 bit lane, put the quarters back in order
+        __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    f32_to_s16_scalar(in + i, out + i, count - i);
+}
+
+JP_TARGET("avx512f") void s16_to_f32_avx512(const int16_t* in, float* out, size_t count) {
+    size_t i = 0;
+    const __m512 scale = _mm512_set1_ps(1.0f / 32768.0f);
+    for (; i + 16 <= count; i += 16) {
+        __m256i samples = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(samples)), scale));
+    }
+    s16_to_f32_scalar(in + i, out + i, count - i);
+}
+
+JP_TARGET("avx512f") void f32_to_s16_avx512(const float* in, int16_t* out, size_t count) {
+    size_t i = 0;
+    const __m512 scale = _mm512_set1_ps(32768.0f);
+    const __m512 max = _mm512_set1_ps(32767.0f);
+    const __m512 min = _mm512_set1_ps(-32768.0f);
+    for (; i + 16 <= count; i += 16) {
+        __m512 values = _mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(_mm512_loadu_ps(in + i), scale), min), max);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm512_cvtsepi32_epi16(_mm512_cvtps_epi32(values)));
+    }
+    f32_to_s16_scalar(in + i, out + i, count - i);
+}
+#endif
+
+}
+
+void interleave_f32(const float* const* in, float* out, size_t frames, int channels) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (channels == 2) {
+        for (; i + 4 <= frames; i += 4) {
+            __m128 left = _mm_loadu_ps(in[0] + i);
+            __m128 right = _mm_loadu_ps(in[1] + i);
+            _mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(left, right));
+            _mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(left, right));
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        for (int channel = 0; channel < channels; channel++) {
+            out[i * channels + channel] = in[channel][i];
+        }
+    }
+}
+
+void interleave_s16(const int16_t* const* in, int16_t* out, size_t frames, int channels) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (channels == 2) {
+        for (; i + 8 <= frames; i += 8) {
+            __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in[0] + i));
+            __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in[1] + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2), _mm_unpacklo_epi16(left, right));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2 + 8), _mm_unpackhi_epi16(left, right));
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        for (int channel = 0; channel < channels; channel++) {
+            out[i * channels + channel] = in[channel][i];
+        }
+    }
+}
+
+void deinterleave_f32(const float* in, float* const* out, size_t frames, int channels) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (channels == 2) {
+        for (; i + 4 <= frames; i += 4) {
+            __m128 a = _mm_loadu_ps(in + i * 2);
+            __m128 b = _mm_loadu_ps(in + i * 2 + 4);
+            _mm_storeu_ps(out[0] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(out[1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        for (int channel = 0; channel < channels; channel++) {
+            out[channel][i] = in[i * channels + channel];
+        }
+    }
+}
+
+void deinterleave_s16(const int16_t* in, int16_t* const* out, size_t frames, int channels) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (channels == 2) {
+        for (; i + 8 <= frames; i += 8) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 2));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 2 + 8));
+            // Left samples are the low halves of each 32 bit pair, right samples the high halves
+            __m128i left = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+            __m128i right = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out[0] + i), left);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out[1] + i), right);
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        for (int channel = 0; channel < channels; channel++) {
+            out[channel][i] = in[i * channels + channel];
+        }
+    }
+}
+
+template <AVSampleFormat In, AVSampleFormat Out>
+static SampleConverter select_channels(int channels) {
+    switch (channels) {
+        case 1: return &convert_samples<In, Out, 1>;
+        case 2: return &convert_samples<In, Out, 2>;
+        case 6: return &convert_samples<In, Out, 6>;
+        default: return &convert_samples<In, Out, 0>;
+    }
+}
+
+template <AVSampleFormat In>
+static SampleConverter select_output(AVSampleFormat output, int channels) {
+    switch (output) {
+        case AV_SAMPLE_FMT_S16: return select_channels<In, AV_SAMPLE_FMT_S16>(channels);
+        case AV_SAMPLE_FMT_S16P: return select_channels<In, AV_SAMPLE_FMT_S16P>(channels);
+        case AV_SAMPLE_FMT_S32: return select_channels<In, AV_SAMPLE_FMT_S32>(channels);
+        case AV_SAMPLE_FMT_S32P: return select_channels<In, AV_SAMPLE_FMT_S32P>(channels);
+        case AV_SAMPLE_FMT_FLT: return select_channels<In, AV_SAMPLE_FMT_FLT>(channels);
+        case AV_SAMPLE_FMT_FLTP: return select_channels<In, AV_SAMPLE_FMT_FLTP>(channels);
+        case AV_SAMPLE_FMT_DBL: return select_channels<In, AV_SAMPLE_FMT_DBL>(channels);
+        case AV_SAMPLE_FMT_DBLP: return select_channels<In, AV_SAMPLE_FMT_DBLP>(channels);
+        default: return nullptr;
+    }
+}
+
+SampleConverter get_sample_converter(AVSampleFormat input, AVSampleFormat output, int channels) {
+    if (channels <= 0) return nullptr;
+    
+    switch (input) {
+        case AV_SAMPLE_FMT_S16: return select_output<AV_SAMPLE_FMT_S16>(output, channels);
+        case AV_SAMPLE_FMT_S16P: return select_output<AV_SAMPLE_FMT_S16P>(output, channels);
+        case AV_SAMPLE_FMT_S32: return select_output<AV_SAMPLE_FMT_S32>(output, channels);
+        case AV_SAMPLE_FMT_S32P: return select_output<AV_SAMPLE_FMT_S32P>(output, channels);
+        case AV_SAMPLE_FMT_FLT: return select_output<AV_SAMPLE_FMT_FLT>(output, channels);
+        case AV_SAMPLE_FMT_FLTP: return select_output<AV_SAMPLE_FMT_FLTP>(output, channels);
+        case AV_SAMPLE_FMT_DBL: return select_output<AV_SAMPLE_FMT_DBL>(output, channels);
+        case AV_SAMPLE_FMT_DBLP: return select_output<AV_SAMPLE_FMT_DBLP>(output, channels);
+        default: return nullptr;
+    }
+}
+
+}
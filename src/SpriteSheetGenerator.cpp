@@ -0,0 +1,205 @@
+#include "SpriteSheetGenerator.h"
+#include "MediaCache.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace jp {
+
+	namespace {
+		/// WebVTT timestamps are HH:MM:SS.mmm
+		std::string format_vtt_time(uint64_t time) {
+			char buffer[32];
+			snprintf(buffer, sizeof(buffer), "%02" PRIu64 ":%02" PRIu64 ":%02" PRIu64 ".%03" PRIu64, time / 3600000, time / 60000 % 60, time / 1000 % 60, time % 1000);
+			return buffer;
+		}
+	}
+
+	SpriteSheetGenerator::SpriteSheetGenerator(SpriteSheetOptions options) : options(options) {
+		if (this->options.format == ThumbnailFormat::THUMBNAIL_FORMAT_RGB24) this->options.format = ThumbnailFormat::THUMBNAIL_FORMAT_PNG;
+		if (this->options.tiles < 1) this->options.tiles = 1;
+		if (this->options.columns < 1) this->options.columns = 1;
+	}
+
+	std::string SpriteSheetGenerator::get_cache_key(const std::string& path) {
+		uint64_t size;
+		int64_t modified;
+		if (!MediaCache::get_file_stamp(path, size, modified)) return std::string{};
+
+		std::string identity = path + "|" + std::to_string(size) + "|" + std::to_string(modified) + "|" + std::to_string(options.tiles) + "|" + std::to_string(options.columns) + "|" +
+				std::to_string(options.tile_width) + "|" + std::to_string(options.tile_height) + "|" + std::to_string((int) options.format) + "|" + std::to_string(options.quality);
+
+		// FNV-1a, which is plenty to tell files apart in a cache directory
+		uint64_t hash = 14695981039346656037ULL;
+		for (unsigned char c : identity) {
+			hash ^= c;
+			hash *= 1099511628211ULL;
+		}
+		char key[17];
+		snprintf(key, sizeof(key), "%016" PRIx64, hash);
+		return key;
+	}
+
+	bool SpriteSheetGenerator::generate(const std::string& path, SpriteSheet& sheet) {
+		sheet = SpriteSheet{};
+		std::string key = get_cache_key(path);
+		if (key.empty()) {
+			error = "Path doesn't exist: " + path;
+			return false;
+		}
+
+		std::string image_name = key + (options.format == ThumbnailFormat::THUMBNAIL_FORMAT_JPEG ? ".jpg" : ".png");
+		sheet.image_path = options.cache_directory + "/" + image_name;
+		sheet.index_path = options.cache_directory + "/" + key + ".vtt";
+
+		// The index is written last, so a sheet with an index is complete
+		uint64_t image_size;
+		int64_t image_modified;
+		if (MediaCache::get_file_stamp(sheet.image_path, image_size, image_modified) && load_index(sheet.index_path, sheet.tiles)) {
+			sheet.cached = true;
+			return true;
+		}
+
+		FFMpegIOContext_Ptr context{new FFMpegIOContext()};
+		if (!context->open(path, OpenMode::OPEN_MODE_READ)) {
+			error = context->get_error();
+			return false;
+		}
+		FFMpegMedia media(context);
+		if (!media.probe()) {
+			error = media.get_error();
+			return false;
+		}
+		if (!media.has_video()) {
+			error = "No video stream found.";
+			return false;
+		}
+
+		std::vector<uint64_t> keyframes = media.get_demuxer()->get_keyframe_times();
+		uint64_t duration = media.get_duration();
+		if (duration == 0 && !keyframes.empty()) duration = keyframes.back();
+		std::vector<uint64_t> times = pick_times(keyframes, duration, options.tiles);
+
+		ThumbnailOptions thumbnail_options;
+		thumbnail_options.width = options.tile_width;
+		thumbnail_options.height = options.tile_height;
+		thumbnail_options.format = ThumbnailFormat::THUMBNAIL_FORMAT_RGB24;
+		thumbnail_options.threads = options.threads;
+
+		// A few missing pictures still make a usable sheet, so failures only matter if nothing came out
+		ThumbnailExtractor extractor(path, thumbnail_options);
+		std::vector<Thumbnail> thumbnails;
+		extractor.extract(times, thumbnails);
+
+		// Two steps can land on the same keyframe when the index has none between them
+		std::vector<const Thumbnail*> pictures;
+		for (auto& thumbnail : thumbnails) {
+			if (!thumbnail.is_valid()) continue;
+			if (!pictures.empty() && (thumbnail.time <= pictures.back()->time || thumbnail.width != pictures[0]->width || thumbnail.height != pictures[0]->height)) continue;
+			pictures.push_back(&thumbnail);
+		}
+		if (pictures.empty()) {
+			error = extractor.get_error();
+			return false;
+		}
+
+		int tile_width = pictures[0]->width;
+		int tile_height = pictures[0]->height;
+		int columns = std::min<int>(options.columns, pictures.size());
+		int rows = (pictures.size() + columns - 1) / columns;
+		int sheet_width = tile_width * columns;
+		int sheet_height = tile_height * rows;
+
+		std::vector<uint8_t> pixels((size_t) sheet_width * sheet_height * 3, 0);
+		for (size_t i = 0; i < pictures.size(); i++) {
+			SpriteTile tile;
+			tile.x = (i % columns) * tile_width;
+			tile.y = (i / columns) * tile_height;
+			tile.width = tile_width;
+			tile.height = tile_height;
+			tile.start_time = i == 0 ? 0 : pictures[i]->time;
+			tile.end_time = i + 1 < pictures.size() ? pictures[i + 1]->time : std::max(duration, pictures[i]->time + 1);
+			sheet.tiles.push_back(tile);
+
+			for (int row = 0; row < tile_height; row++) {
+				memcpy(&pixels[((size_t) (tile.y + row) * sheet_width + tile.x) * 3], &pictures[i]->data[(size_t) row * tile_width * 3], (size_t) tile_width * 3);
+			}
+		}
+
+		ThumbnailOptions image_options;
+		image_options.format = options.format;
+		image_options.quality = options.quality;
+		std::vector<uint8_t> image;
+		if (!ThumbnailExtractor::encode_image(pixels.data(), sheet_width, sheet_height, image_options, image)) {
+			error = "Unable to encode the sprite sheet";
+			return false;
+		}
+
+		std::string index = "WEBVTT\n\n";
+		for (auto& tile : sheet.tiles) {
+			index += format_vtt_time(tile.start_time) + " --> " + format_vtt_time(tile.end_time) + "\n";
+			index += image_name + "#xywh=" + std::to_string(tile.x) + "," + std::to_string(tile.y) + "," + std::to_string(tile.width) + "," + std::to_string(tile.height) + "\n\n";
+		}
+
+		if (!write_file(sheet.image_path, image.data(), image.size()) || !write_file(sheet.index_path, index.data(), index.size())) {
+			error = "Unable to write the sprite sheet to " + options.cache_directory;
+			return false;
+		}
+		return true;
+	}
+
+	std::vector<uint64_t> SpriteSheetGenerator::pick_times(const std::vector<uint64_t>& keyframes, uint64_t duration, int count) {
+		std::vector<uint64_t> times;
+		for (int i = 0; i < count; i++) {
+			// The middle of each step
+			uint64_t target = duration * (2 * i + 1) / (2 * count);
+			if (keyframes.empty()) {
+				times.push_back(target);
+				continue;
+			}
+
+			auto next = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+			if (next == keyframes.end() || (next != keyframes.begin() && target - *(next - 1) <= *next - target)) --next;
+			if (times.empty() || times.back() != *next) times.push_back(*next);
+		}
+		return times;
+	}
+
+	bool SpriteSheetGenerator::load_index(const std::string& index_path, std::vector<SpriteTile>& tiles) {
+		std::ifstream index(index_path);
+		std::string line;
+		if (!std::getline(index, line) || line.compare(0, 6, "WEBVTT") != 0) return false;
+
+		tiles.clear();
+		while (std::getline(index, line)) {
+			unsigned start[4], end[4];
+			if (sscanf(line.c_str(), "%u:%u:%u.%u --> %u:%u:%u.%u", &start[0], &start[1], &start[2], &start[3], &end[0], &end[1], &end[2], &end[3]) != 8) continue;
+
+			SpriteTile tile;
+			tile.start_time = ((uint64_t) start[0] * 3600 + start[1] * 60 + start[2]) * 1000 + start[3];
+			tile.end_time = ((uint64_t) end[0] * 3600 + end[1] * 60 + end[2]) * 1000 + end[3];
+
+			if (!std::getline(index, line)) return false;
+			size_t fragment = line.find("#xywh=");
+			if (fragment == std::string::npos || sscanf(line.c_str() + fragment, "#xywh=%d,%d,%d,%d", &tile.x, &tile.y, &tile.width, &tile.height) != 4) return false;
+			tiles.push_back(tile);
+		}
+		return !tiles.empty();
+	}
+
+	bool SpriteSheetGenerator::write_file(const std::string& path, const void* data, size_t size) {
+		std::string temporary_path = path + ".tmp";
+		FILE* file = fopen(temporary_path.c_str(), "wb");
+		if (!file) return false;
+		bool written = fwrite(data, 1, size, file) == size;
+		if (fclose(file) != 0) written = false;
+		if (!written || rename(temporary_path.c_str(), path.c_str()) != 0) {
+			remove(temporary_path.c_str());
+			return false;
+		}
+		return true;
+	}
+}
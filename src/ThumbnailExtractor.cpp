@@ -0,0 +1,272 @@
+#include "ThumbnailExtractor.h"
+
+#include <algorithm>
+#include <numeric>
+#include <thread>
+
+extern "C" {
+	#include <libavutil/imgutils.h>
+}
+
+namespace jp {
+
+	ThumbnailExtractor::ThumbnailExtractor(std::string path, ThumbnailOptions options) : path(path), options(options) {}
+
+	bool ThumbnailExtractor::extract(const std::vector<uint64_t>& times, std::vector<Thumbnail>& thumbnails) {
+		thumbnails.assign(times.size(), Thumbnail{});
+		error.clear();
+		if (times.empty()) return true;
+
+		std::vector<size_t> order(times.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&times](size_t a, size_t b) { return times[a] < times[b]; });
+
+		size_t workers = options.threads > 0 ? options.threads : std::thread::hardware_concurrency();
+		workers = std::max<size_t>(1, std::min(workers, times.size()));
+
+		std::vector<std::string> errors(workers);
+		std::vector<std::thread> threads;
+		for (size_t worker = 0; worker < workers; worker++) {
+			size_t first = times.size() * worker / workers;
+			size_t last = times.size() * (worker + 1) / workers;
+			threads.emplace_back([&, worker, first, last]() {
+				extract_range(path, options, times, order, first, last, thumbnails, errors[worker]);
+			});
+		}
+		for (auto& thread : threads) thread.join();
+
+		for (auto& worker_error : errors) {
+			if (!worker_error.empty()) {
+				error = worker_error;
+				return false;
+			}
+		}
+		for (auto& thumbnail : thumbnails) {
+			if (!thumbnail.is_valid()) {
+				error = thumbnail.error;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool ThumbnailExtractor::extract_every(uint64_t interval, std::vector<Thumbnail>& thumbnails) {
+		if (interval == 0) {
+			error = "The thumbnail interval can't be 0";
+			return false;
+		}
+
+		FFMpegIOContext_Ptr context{new FFMpegIOContext()};
+		if (!context->open(path, OpenMode::OPEN_MODE_READ)) {
+			error = context->get_error();
+			return false;
+		}
+		FFMpegMedia media(context);
+		if (!media.probe()) {
+			error = media.get_error();
+			return false;
+		}
+
+		std::vector<uint64_t> times;
+		for (uint64_t time = 0; time < media.get_duration(); time += interval) times.push_back(time);
+		if (times.empty()) times.push_back(0);
+		return extract(times, thumbnails);
+	}
+
+	bool ThumbnailExtractor::extract_range(const std::string& path, const ThumbnailOptions& options, const std::vector<uint64_t>& times, const std::vector<size_t>& order, size_t first, size_t last, std::vector<Thumbnail>& thumbnails, std::string& error) {
+		for (size_t i = first; i < last; i++) {
+			thumbnails[order[i]].requested_time = times[order[i]];
+			thumbnails[order[i]].format = options.format;
+		}
+
+		FFMpegIOContext_Ptr context{new FFMpegIOContext()};
+		if (!context->open(path, OpenMode::OPEN_MODE_READ)) {
+			error = context->get_error();
+			return false;
+		}
+
+		FFMpegMedia media(context);
+		media.set_audio_enabled(false);
+		// One keyframe at a time leaves codec threads nothing to overlap, the workers are the parallelism
+		media.set_threading_policy(DecoderType::DECODER_TYPE_VIDEO, DecoderThreadingPolicy{DecoderThreadType::THREAD_TYPE_NONE, 1});
+		if (!media.parse()) {
+			error = media.get_error();
+			return false;
+		}
+
+		auto demuxer = media.get_demuxer();
+		auto decoder = demuxer->get_video_decoder();
+		auto stream = demuxer->get_video_stream();
+		decoder->set_keyframes_only(true);
+
+		int64_t start_time = stream->get_start_time() != AV_NOPTS_VALUE ? stream->get_start_time() : 0;
+		double time_base = stream->get_time_base();
+
+		bool encoded = options.format != ThumbnailFormat::THUMBNAIL_FORMAT_RGB24;
+		AVPixelFormat output_format = options.format == ThumbnailFormat::THUMBNAIL_FORMAT_JPEG ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_RGB24;
+
+		SwsContext* scaler = nullptr;
+		AVCodecContext* encoder = nullptr;
+		AVFrame* picture = av_frame_alloc();
+		AVPacket* packet_out = av_packet_alloc();
+		FFMpegFrameBuffer frames;
+
+		for (size_t i = first; i < last; i++) {
+			Thumbnail& thumbnail = thumbnails[order[i]];
+
+			if (!demuxer->seek_to_keyframe(thumbnail.requested_time)) {
+				thumbnail.error = "Unable to seek to " + std::to_string(thumbnail.requested_time) + "ms";
+				continue;
+			}
+			decoder->reset_buffers();
+			frames.clear();
+
+			// Flushing after each keyframe gets its picture out right away, instead of after the packets a reordering decoder waits for
+			while (frames.empty()) {
+				auto packet = demuxer->get_next_packet();
+				if (!packet) break;
+				if (!packet->is_video_packet() || !packet->is_keyframe()) continue;
+				decoder->decode(packet, frames);
+				if (frames.empty()) decoder->flush(frames);
+				decoder->reset_buffers();
+			}
+			if (frames.empty()) {
+				thumbnail.error = "No keyframe decoded near " + std::to_string(thumbnail.requested_time) + "ms";
+				continue;
+			}
+
+			auto frame = frames[0];
+			int64_t timestamp = frame->get_best_effort_timestamp();
+			if (timestamp != AV_NOPTS_VALUE && timestamp > start_time) thumbnail.time = (timestamp - start_time) * time_base * 1000;
+
+			int width, height;
+			get_output_size(options, frame->get_width(), frame->get_height(), width, height);
+			scaler = sws_getCachedContext(scaler, frame->get_width(), frame->get_height(), (AVPixelFormat) frame->get_pixel_format(), width, height, output_format, SWS_BILINEAR, nullptr, nullptr, nullptr);
+			if (!scaler) {
+				thumbnail.error = "Unable to scale the picture";
+				continue;
+			}
+			thumbnail.width = width;
+			thumbnail.height = height;
+
+			if (!encoded) {
+				// Straight into the thumbnail, rows packed with no padding
+				thumbnail.data.resize((size_t) width * height * 3);
+				uint8_t* data[4] = {thumbnail.data.data(), nullptr, nullptr, nullptr};
+				int linesize[4] = {width * 3, 0, 0, 0};
+				sws_scale(scaler, frame->get_data(), frame->get_data_size(), 0, frame->get_height(), data, linesize);
+				continue;
+			}
+
+			if (picture->width != width || picture->height != height) {
+				av_frame_unref(picture);
+				picture->format = output_format;
+				picture->width = width;
+				picture->height = height;
+				if (av_frame_get_buffer(picture, 0) < 0) {
+					thumbnail.error = "Unable to allocate the picture";
+					continue;
+				}
+				if (encoder) avcodec_free_context(&encoder);
+			}
+			sws_scale(scaler, frame->get_data(), frame->get_data_size(), 0, frame->get_height(), picture->data, picture->linesize);
+
+			if (!encoder) encoder = open_encoder(options, width, height);
+			if (!encoder) {
+				thumbnail.error = "Unable to open the image encoder";
+				continue;
+			}
+			picture->quality = encoder->global_quality;
+
+			// Image encoders hand back one packet per picture straight away
+			if (avcodec_send_frame(encoder, picture) < 0 || avcodec_receive_packet(encoder, packet_out) < 0) {
+				thumbnail.error = "Unable to encode the picture";
+				continue;
+			}
+			thumbnail.data.assign(packet_out->data, packet_out->data + packet_out->size);
+			av_packet_unref(packet_out);
+		}
+
+		sws_freeContext(scaler);
+		avcodec_free_context(&encoder);
+		av_frame_free(&picture);
+		av_packet_free(&packet_out);
+		return true;
+	}
+
+	bool ThumbnailExtractor::encode_image(const uint8_t* data, int width, int height, const ThumbnailOptions& options, std::vector<uint8_t>& output) {
+		ThumbnailOptions encode_options = options;
+		if (encode_options.format == ThumbnailFormat::THUMBNAIL_FORMAT_RGB24) encode_options.format = ThumbnailFormat::THUMBNAIL_FORMAT_PNG;
+		bool jpeg = encode_options.format == ThumbnailFormat::THUMBNAIL_FORMAT_JPEG;
+
+		AVCodecContext* encoder = open_encoder(encode_options, width, height);
+		if (!encoder) return false;
+
+		AVFrame* picture = av_frame_alloc();
+		AVPacket* packet = av_packet_alloc();
+		picture->format = encoder->pix_fmt;
+		picture->width = width;
+		picture->height = height;
+		picture->quality = encoder->global_quality;
+
+		bool encoded = av_frame_get_buffer(picture, 0) >= 0;
+		if (encoded) {
+			const uint8_t* source[4] = {data, nullptr, nullptr, nullptr};
+			int source_linesize[4] = {width * 3, 0, 0, 0};
+			if (jpeg) {
+				SwsContext* converter = sws_getContext(width, height, AV_PIX_FMT_RGB24, width, height, AV_PIX_FMT_YUVJ420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+				encoded = converter != nullptr;
+				if (converter) sws_scale(converter, source, source_linesize, 0, height, picture->data, picture->linesize);
+				sws_freeContext(converter);
+			} else {
+				av_image_copy(picture->data, picture->linesize, source, source_linesize, AV_PIX_FMT_RGB24, width, height);
+			}
+		}
+
+		encoded = encoded && avcodec_send_frame(encoder, picture) >= 0 && avcodec_receive_packet(encoder, packet) >= 0;
+		if (encoded) output.assign(packet->data, packet->data + packet->size);
+
+		av_packet_free(&packet);
+		av_frame_free(&picture);
+		avcodec_free_context(&encoder);
+		return encoded;
+	}
+
+	void ThumbnailExtractor::get_output_size(const ThumbnailOptions& options, int width, int height, int& output_width, int& output_height) {
+		output_width = options.width;
+		output_height = options.height;
+		if (output_width <= 0 && output_height <= 0) {
+			output_width = width;
+			output_height = height;
+		} else if (output_height <= 0) {
+			output_height = (int64_t) output_width * height / width;
+		} else if (output_width <= 0) {
+			output_width = (int64_t) output_height * width / height;
+		}
+		output_width = std::max(output_width, 1);
+		output_height = std::max(output_height, 1);
+	}
+
+	AVCodecContext* ThumbnailExtractor::open_encoder(const ThumbnailOptions& options, int width, int height) {
+		bool jpeg = options.format == ThumbnailFormat::THUMBNAIL_FORMAT_JPEG;
+		AVCodec* codec = avcodec_find_encoder(jpeg ? AV_CODEC_ID_MJPEG : AV_CODEC_ID_PNG);
+		if (!codec) return nullptr;
+
+		AVCodecContext* encoder = avcodec_alloc_context3(codec);
+		if (!encoder) return nullptr;
+		encoder->width = width;
+		encoder->height = height;
+		encoder->pix_fmt = jpeg ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_RGB24;
+		encoder->time_base = AVRational{1, 25};
+		if (jpeg) {
+			encoder->flags |= AV_CODEC_FLAG_QSCALE;
+			encoder->global_quality = FF_QP2LAMBDA * std::min(std::max(options.quality, 2), 31);
+		}
+
+		if (avcodec_open2(encoder, codec, nullptr) < 0) {
+			avcodec_free_context(&encoder);
+			return nullptr;
+		}
+		return encoder;
+	}
+}
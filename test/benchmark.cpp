@@ -0,0 +1,527 @@
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <random>
+#include "FFMpegMedia.h"
+#include "FFMpegIOContext.h"
+#include "FFMpegResampler.h"
+#include "CpuDispatch.h"
+#include "SampleConversion.h"
+#include "NullOutput.h"
+#include "FrameReader.h"
+#include "FrameBatcher.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static double elapsed_ms(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+/// Reads every packet of the decoder's stream into memory, so the decode benchmarks don't measure the demuxer
+static std::vector<jp::FFMpegPacket_Ptr> read_packets(jp::FFMpegMedia_Ptr& media, bool video) {
+    std::vector<jp::FFMpegPacket_Ptr> packets;
+    auto demuxer = media->get_demuxer();
+    demuxer->reset();
+    while (auto packet = demuxer->get_next_packet()) {
+        if (video ? packet->is_video_packet() : packet->is_audio_packet()) {
+            packets.push_back(packet);
+        }
+    }
+    demuxer->reset();
+    return packets;
+}
+
+static void bench_decode(jp::FFMpegMedia_Ptr& media, bool video, int iterations) {
+    auto decoder = video ? media->get_demuxer()->get_video_decoder() : media->get_demuxer()->get_audio_decoder();
+    if (!decoder) return;
+
+    auto packets = read_packets(media, video);
+    if (packets.empty()) return;
+
+    fprintf(stderr, "\n%s decoder: %s, %zu packets\n", video ? "Video" : "Audio", decoder->get_name().c_str(), packets.size());
+
+    // Batches of 16 packets, prepared up front so the timing only covers decoding
+    std::vector<std::vector<jp::FFMpegPacket_Ptr>> batches;
+    for (size_t i = 0; i < packets.size(); i += 16) {
+        batches.emplace_back(packets.begin() + i, packets.begin() + std::min(packets.size(), i + 16));
+    }
+
+    double vector_ms = 0, buffer_ms = 0, batch_ms = 0;
+    size_t vector_frames = 0, buffer_frames = 0, batch_frames = 0;
+    jp::FFMpegFrameBuffer output;
+
+    for (int i = 0; i < iterations; i++) {
+        decoder->reset_buffers();
+        auto start = bench_clock::now();
+        for (auto& packet : packets) {
+            vector_frames += decoder->decode(packet).size();
+        }
+        vector_frames += decoder->flush().size();
+        vector_ms += elapsed_ms(start);
+
+        decoder->reset_buffers();
+        start = bench_clock::now();
+        for (auto& packet : packets) {
+            output.clear();
+            buffer_frames += decoder->decode(packet, output);
+        }
+        output.clear();
+        buffer_frames += decoder->flush(output);
+        buffer_ms += elapsed_ms(start);
+
+        decoder->reset_buffers();
+        start = bench_clock::now();
+        for (auto& batch : batches) {
+            output.clear();
+            batch_frames += decoder->decode(batch, output);
+        }
+        output.clear();
+        batch_frames += decoder->flush(output);
+        batch_ms += elapsed_ms(start);
+    }
+
+    decoder->reset_buffers();
+
+    fprintf(stderr, "  vector API: %8.2f ms/iteration, %.3f us/packet (%zu frames)\n", vector_ms / iterations, vector_ms * 1000 / (iterations * packets.size()), vector_frames / iterations);
+    fprintf(stderr, "  buffer API: %8.2f ms/iteration, %.3f us/packet (%zu frames)\n", buffer_ms / iterations, buffer_ms * 1000 / (iterations * packets.size()), buffer_frames / iterations);
+    fprintf(stderr, "  batch API:  %8.2f ms/iteration, %.3f us/packet (%zu frames)\n", batch_ms / iterations, batch_ms * 1000 / (iterations * packets.size()), batch_frames / iterations);
+}
+
+/// Opens the file from scratch and decodes up to the first frame of each stream, with the default and the fast start options
+static void bench_startup(const char* path, int iterations) {
+    const char* names[] = {"default", "fast start"};
+    jp::StartupOptions options[] = {jp::StartupOptions{}, jp::StartupOptions::fast()};
+
+    fprintf(stderr, "\nStartup\n");
+    for (int mode = 0; mode < 2; mode++) {
+        jp::StartupTimings total;
+        double first_frame_ms = 0;
+
+        for (int i = 0; i < iterations; i++) {
+            auto start = bench_clock::now();
+            jp::FFMpegIOContext_Ptr io_context{new jp::FFMpegIOContext()};
+            if (!io_context->open(path, jp::OpenMode::OPEN_MODE_READ)) return;
+
+            jp::FFMpegMedia_Ptr media{new jp::FFMpegMedia(io_context)};
+            media->set_startup_options(options[mode]);
+            if (!media->parse()) return;
+
+            auto timings = media->get_startup_timings();
+            total.open_input += timings.open_input;
+            total.find_stream_info += timings.find_stream_info;
+            total.open_decoders += timings.open_decoders;
+
+            // Decode until the first frame of every stream
+            bool audio_pending = media->has_audio(), video_pending = media->has_video();
+            jp::FFMpegFrameBuffer output;
+            while (audio_pending || video_pending) {
+                auto packet = media->get_demuxer()->get_next_packet();
+                if (!packet) break;
+                bool audio = packet->is_audio_packet();
+                if (!(audio ? audio_pending : packet->is_video_packet() && video_pending)) continue;
+
+                output.clear();
+                auto decoder = audio ? media->get_demuxer()->get_audio_decoder() : media->get_demuxer()->get_video_decoder();
+                if (decoder->decode(packet, output) > 0) (audio ? audio_pending : video_pending) = false;
+            }
+            first_frame_ms += elapsed_ms(start);
+        }
+
+        fprintf(stderr, "  %-10s open %6.2f ms, stream info %6.2f ms, decoders %6.2f ms, first frames after %7.2f ms\n", names[mode],
+                total.open_input / (1000.0 * iterations), total.find_stream_info / (1000.0 * iterations), total.open_decoders / (1000.0 * iterations), first_frame_ms / iterations);
+    }
+}
+
+/// Plays the file through the whole player pipeline (decoders, filter graphs, clock) into the null outputs, as fast as it goes
+static void bench_pipeline(const char* path) {
+    jp::FFMpegIOContext_Ptr io_context{new jp::FFMpegIOContext()};
+    if (!io_context->open(path, jp::OpenMode::OPEN_MODE_READ)) return;
+    jp::FFMpegMedia_Ptr media{new jp::FFMpegMedia(io_context)};
+    if (!media->parse()) return;
+
+    jp::FFMpegMediaPlayer_Ptr media_player{new jp::FFMpegMediaPlayer()};
+    jp::NullAudioOutput_Ptr audio_output{new jp::NullAudioOutput(media_player)};
+    jp::NullVideoOutput_Ptr video_output{new jp::NullVideoOutput(media_player)};
+    media_player->set_audio_output(audio_output);
+    media_player->set_video_output(video_output);
+    if (media_player->set_media(media) != jp::MediaResult::RESULT_SUCCESS || media_player->play() != jp::MediaResult::RESULT_SUCCESS) return;
+
+    // An hour is well past anything worth benchmarking
+    if (media->has_audio()) audio_output->wait_until_finished(3600000);
+    if (media->has_video()) video_output->wait_until_finished(3600000);
+    media_player->stop();
+
+    fprintf(stderr, "\nPipeline\n");
+    const char* names[] = {"audio", "video"};
+    jp::OutputStats stats[] = {audio_output->get_stats(), video_output->get_stats()};
+    for (int i = 0; i < 2; i++) {
+        if (!stats[i].frames) continue;
+        fprintf(stderr, "  %-5s %8lu frames, %7.1f fps, %9.2f MB, fetch %7.1f us avg %8lu us max, %lu underruns\n", names[i], (unsigned long) stats[i].frames, stats[i].get_fps(),
+                stats[i].bytes / (1024.0 * 1024.0), stats[i].get_average_fetch_time(), (unsigned long) stats[i].max_fetch_time, (unsigned long) stats[i].underruns);
+    }
+}
+
+/// Pulls every frame out with a FrameReader, as the decoder gives them and converted to packed RGB24 video and float audio
+static void bench_reader(const char* path) {
+    const char* names[] = {"decoded", "converted"};
+
+    fprintf(stderr, "\nFrame reader\n");
+    for (int mode = 0; mode < 2; mode++) {
+        jp::FFMpegIOContext_Ptr io_context{new jp::FFMpegIOContext()};
+        if (!io_context->open(path, jp::OpenMode::OPEN_MODE_READ)) return;
+        jp::FFMpegMedia_Ptr media{new jp::FFMpegMedia(io_context)};
+
+        jp::FrameReaderOptions options;
+        if (mode == 1) {
+            options.pixel_format = AV_PIX_FMT_RGB24;
+            options.alignment = 1;
+            options.sample_format = AV_SAMPLE_FMT_FLT;
+        }
+        jp::FrameReader reader(media, options);
+
+        auto start = bench_clock::now();
+        jp::DecodedFrame frame;
+        uint64_t counts[2] = {0, 0};
+        while (reader.next(frame)) counts[frame.type == jp::DecoderType::DECODER_TYPE_VIDEO]++;
+        double ms = elapsed_ms(start);
+        if (!reader.is_finished()) {
+            fprintf(stderr, "  %-10s failed: %s\n", names[mode], reader.get_error().c_str());
+            continue;
+        }
+
+        fprintf(stderr, "  %-10s %8lu video frames, %8lu audio frames in %8.1f ms, %7.1f video fps\n", names[mode], (unsigned long) counts[1], (unsigned long) counts[0], ms,
+                ms > 0 ? counts[1] * 1000.0 / ms : 0);
+    }
+}
+
+/// Decodes the file into batches of 8 normalised 224x224 float frames, in both layouts
+static void bench_batcher(const char* path) {
+    const char* names[] = {"NCHW", "NHWC"};
+
+    fprintf(stderr, "\nFrame batcher\n");
+    for (int mode = 0; mode < 2; mode++) {
+        jp::FFMpegIOContext_Ptr io_context{new jp::FFMpegIOContext()};
+        if (!io_context->open(path, jp::OpenMode::OPEN_MODE_READ)) return;
+        jp::FFMpegMedia_Ptr media{new jp::FFMpegMedia(io_context)};
+
+        jp::TensorOptions options;
+        options.layout = mode ? jp::TensorLayout::TENSOR_LAYOUT_NHWC : jp::TensorLayout::TENSOR_LAYOUT_NCHW;
+        jp::FrameBatcher batcher(media, options);
+        std::vector<uint8_t> tensor(batcher.get_tensor_size());
+
+        auto start = bench_clock::now();
+        uint64_t frames = 0;
+        int count;
+        while ((count = batcher.next_batch(tensor.data())) > 0) frames += count;
+        double ms = elapsed_ms(start);
+        if (!batcher.is_finished()) {
+            fprintf(stderr, "  %s failed: %s\n", names[mode], batcher.get_error().c_str());
+            continue;
+        }
+
+        fprintf(stderr, "  %s %8lu frames in %8.1f ms, %7.1f fps\n", names[mode], (unsigned long) frames, ms, ms > 0 ? frames * 1000.0 / ms : 0);
+    }
+}
+
+/// Compares reading a file's info with a full parse and with a header probe
+static void bench_probe(const char* path, int iterations) {
+    double parse_ms = 0, probe_ms = 0;
+    for (int i = 0; i < iterations; i++) {
+        for (int mode = 0; mode < 2; mode++) {
+            auto start = bench_clock::now();
+            jp::FFMpegIOContext_Ptr io_context{new jp::FFMpegIOContext()};
+            if (!io_context->open(path, jp::OpenMode::OPEN_MODE_READ)) return;
+
+            jp::FFMpegMedia_Ptr media{new jp::FFMpegMedia(io_context)};
+            if (!(mode ? media->probe() : media->parse())) return;
+            (mode ? probe_ms : parse_ms) += elapsed_ms(start);
+        }
+    }
+
+    fprintf(stderr, "\nMedia info\n  parse %7.2f ms, probe %7.2f ms\n", parse_ms / iterations, probe_ms / iterations);
+}
+
+/// Times converting ten seconds of stereo audio in 1024 sample chunks with swresample and with FFMpegResampler
+static void bench_convert(AVSampleFormat in_format, AVSampleFormat out_format, int iterations) {
+    const int sample_rate = 48000;
+    const int chunk = 1024;
+    const int total = sample_rate * 10;
+    const int64_t layout = AV_CH_LAYOUT_STEREO;
+
+    // A sine at -6dB, so the integer conversions don't clip
+    std::vector<float> left(total), right(total);
+    for (int i = 0; i < total; i++) {
+        left[i] = 0.5f * sinf(i * 0.01f);
+        right[i] = 0.5f * cosf(i * 0.01f);
+    }
+
+    // Lay the input out in in_format
+    size_t in_bytes = av_get_bytes_per_sample(in_format);
+    bool in_planar = av_sample_fmt_is_planar(in_format);
+    std::vector<std::vector<uint8_t>> input(in_planar ? 2 : 1, std::vector<uint8_t>(total * 2 * in_bytes));
+    for (int i = 0; i < total; i++) {
+        for (int channel = 0; channel < 2; channel++) {
+            float value = channel ? right[i] : left[i];
+            uint8_t* target = in_planar ? input[channel].data() + i * in_bytes : input[0].data() + (i * 2 + channel) * in_bytes;
+            if (av_get_packed_sample_fmt(in_format) == AV_SAMPLE_FMT_S16) {
+                *reinterpret_cast<int16_t*>(target) = (int16_t) (value * 32767);
+            } else {
+                *reinterpret_cast<float*>(target) = value;
+            }
+        }
+    }
+
+    size_t out_bytes = av_get_bytes_per_sample(out_format);
+    std::vector<std::vector<uint8_t>> output(2, std::vector<uint8_t>(chunk * 2 * out_bytes + 256));
+
+    SwrContext* swr = swr_alloc_set_opts(nullptr, layout, out_format, sample_rate, layout, in_format, sample_rate, 0, nullptr);
+    if (!swr || swr_init(swr) < 0) {
+        fprintf(stderr, "Couldn't open swresample for %s -> %s\n", av_get_sample_fmt_name(in_format), av_get_sample_fmt_name(out_format));
+        swr_free(&swr);
+        return;
+    }
+
+    jp::FFMpegResampler resampler;
+    resampler.initialize(layout, sample_rate, in_format, layout, sample_rate, out_format);
+
+    auto run = [&](bool ours) {
+        auto start = bench_clock::now();
+        for (int n = 0; n < iterations; n++) {
+            for (int offset = 0; offset + chunk <= total; offset += chunk) {
+                const uint8_t* in[2];
+                for (int plane = 0; plane < (int) input.size(); plane++) {
+                    in[plane] = input[plane].data() + offset * in_bytes * (in_planar ? 1 : 2);
+                }
+                uint8_t* out[2] = {output[0].data(), output[1].data()};
+                if (ours) {
+                    resampler.convert(out, chunk, in, chunk);
+                } else {
+                    swr_convert(swr, out, chunk, in, chunk);
+                }
+            }
+        }
+        return elapsed_ms(start);
+    };
+
+    double swr_ms = run(false);
+    double ours_ms = run(true);
+
+    fprintf(stderr, "  %-4s -> %-4s swresample: %7.2f ms, FFMpegResampler%s: %7.2f ms (%.1fx)\n", av_get_sample_fmt_name(in_format), av_get_sample_fmt_name(out_format),
+            swr_ms / iterations, resampler.is_fast_path() ? " (fast path)" : "", ours_ms / iterations, swr_ms / ours_ms);
+
+    swr_free(&swr);
+}
+
+static void bench_resample(int iterations) {
+    fprintf(stderr, "\nSame rate conversion, 10s of 48kHz stereo per iteration\n");
+    bench_convert(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, iterations);
+    bench_convert(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT, iterations);
+    bench_convert(AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLT, iterations);
+    bench_convert(AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S16, iterations);
+    bench_convert(AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16P, iterations);
+}
+
+/// Counts where a kernel's output is further than tolerance (relative, at least 1) from the reference, and prints the first one
+template <typename T>
+static size_t count_mismatches(const char* kernel, const char* variant, const std::vector<T>& expected, const std::vector<T>& actual, double tolerance) {
+    size_t mismatches = 0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        double difference = std::fabs((double) expected[i] - (double) actual[i]);
+        if (difference <= tolerance * std::max(1.0, std::fabs((double) expected[i]))) continue;
+        if (!mismatches++) fprintf(stderr, "  %s %s: sample %zu is %.9g, scalar gives %.9g\n", kernel, variant, i, (double) actual[i], (double) expected[i]);
+    }
+    return mismatches;
+}
+
+/// Checks every kernel variant this CPU can run, and the template sample conversions, against the scalar kernels
+/// The input is random with the edge cases up front: full scale, past full scale and exact .5 ties after scaling to S16. The odd length runs the tails too
+static bool check_kernels() {
+    const size_t count = 4099;
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> float_range(-1.25f, 1.25f);
+    std::uniform_int_distribution<int> short_range(-32768, 32767);
+
+    std::vector<float> floats(count);
+    std::vector<int16_t> shorts(count);
+    std::vector<uint8_t> bytes(count);
+    for (size_t i = 0; i < count; i++) {
+        floats[i] = float_range(random);
+        shorts[i] = (int16_t) short_range(random);
+        bytes[i] = (uint8_t) random();
+    }
+
+    const float float_edges[] = {0.0f, -0.0f, 1.0f, -1.0f, 1.5f, -1.5f, 100.0f, -100.0f, 32767.0f / 32768, 32767.5f / 32768, -32768.5f / 32768,
+            0.5f / 32768, -0.5f / 32768, 1.5f / 32768, -1.5f / 32768, 2.5f / 32768, -2.5f / 32768, 100.5f / 32768, -12345.5f / 32768};
+    const int16_t short_edges[] = {0, 1, -1, 3, -3, 32767, -32768, 32766, -32767, 12345, -12345};
+    std::copy(std::begin(float_edges), std::end(float_edges), floats.begin());
+    std::copy(std::begin(short_edges), std::end(short_edges), shorts.begin());
+    const float scale[3] = {1 / (255 * 0.229f), 1 / (255 * 0.224f), 1 / (255 * 0.225f)};
+    const float bias[3] = {-0.485f / 0.229f, -0.456f / 0.224f, -0.406f / 0.225f};
+
+    auto reference = jp::get_kernel_table(jp::CpuLevel::SCALAR);
+    size_t mismatches = 0;
+
+    fprintf(stderr, "Kernel parity against scalar, %zu samples\n", count);
+    for (jp::CpuLevel level : {jp::CpuLevel::SSE2, jp::CpuLevel::SSE4_1, jp::CpuLevel::AVX2, jp::CpuLevel::AVX512}) {
+        if (level > jp::get_detected_cpu_level()) break;
+        auto kernels = jp::get_kernel_table(level);
+        const std::string name = jp::get_cpu_level_name(level);
+        size_t before = mismatches;
+
+        // Gains that land S16 samples on .5 ties (0.5, 1.5) and past full scale (3)
+        for (float gain : {0.5f, 1.5f, 3.0f, 0.7f}) {
+            std::vector<float> expected_f32 = floats, actual_f32 = floats;
+            reference.gain_f32(expected_f32.data(), count, gain);
+            kernels.gain_f32(actual_f32.data(), count, gain);
+            mismatches += count_mismatches("gain_f32", name.c_str(), expected_f32, actual_f32, 0);
+
+            std::vector<int16_t> expected_s16 = shorts, actual_s16 = shorts;
+            reference.gain_s16(expected_s16.data(), count, gain);
+            kernels.gain_s16(actual_s16.data(), count, gain);
+            mismatches += count_mismatches("gain_s16", name.c_str(), expected_s16, actual_s16, 0);
+        }
+
+        std::vector<float> expected_f32(count), actual_f32(count);
+        reference.s16_to_f32(shorts.data(), expected_f32.data(), count);
+        kernels.s16_to_f32(shorts.data(), actual_f32.data(), count);
+        mismatches += count_mismatches("s16_to_f32", name.c_str(), expected_f32, actual_f32, 0);
+
+        std::vector<int16_t> expected_s16(count), actual_s16(count);
+        reference.f32_to_s16(floats.data(), expected_s16.data(), count);
+        kernels.f32_to_s16(floats.data(), actual_s16.data(), count);
+        mismatches += count_mismatches("f32_to_s16", name.c_str(), expected_s16, actual_s16, 0);
+
+        // The wider variants may fuse the multiply and add, which rounds once instead of twice
+        for (int channels : {1, 3}) {
+            reference.normalize_u8_f32(bytes.data(), expected_f32.data(), count, scale, bias, channels);
+            kernels.normalize_u8_f32(bytes.data(), actual_f32.data(), count, scale, bias, channels);
+            mismatches += count_mismatches("normalize_u8_f32", name.c_str(), expected_f32, actual_f32, 1e-6);
+        }
+
+        fprintf(stderr, "  %-8s %s\n", name.c_str(), mismatches == before ? "ok" : "MISMATCH");
+    }
+
+    // The template conversions must round like the packed kernels: FLTP to S16 and S16 to FLTP, stereo and a runtime channel count
+    for (int channels : {2, 3}) {
+        size_t frames = count / channels;
+        std::vector<int16_t> expected_s16(frames * channels), actual_s16(frames * channels);
+        reference.f32_to_s16(floats.data(), expected_s16.data(), frames * channels);
+
+        std::vector<std::vector<float>> planes(channels, std::vector<float>(frames));
+        std::vector<const uint8_t*> in(channels);
+        for (int channel = 0; channel < channels; channel++) {
+            for (size_t i = 0; i < frames; i++) planes[channel][i] = floats[i * channels + channel];
+            in[channel] = reinterpret_cast<const uint8_t*>(planes[channel].data());
+        }
+        uint8_t* out[1] = {reinterpret_cast<uint8_t*>(actual_s16.data())};
+        jp::get_sample_converter(AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, channels)(in.data(), out, (int) frames, channels);
+        size_t found = count_mismatches("fltp_to_s16", std::to_string(channels).c_str(), expected_s16, actual_s16, 0);
+
+        std::vector<float> packed_f32(frames * channels);
+        reference.s16_to_f32(shorts.data(), packed_f32.data(), frames * channels);
+
+        std::vector<std::vector<float>> split(channels, std::vector<float>(frames));
+        std::vector<uint8_t*> split_planes(channels);
+        for (int channel = 0; channel < channels; channel++) split_planes[channel] = reinterpret_cast<uint8_t*>(split[channel].data());
+        const uint8_t* packed[1] = {reinterpret_cast<const uint8_t*>(shorts.data())};
+        jp::get_sample_converter(AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP, channels)(packed, split_planes.data(), (int) frames, channels);
+        for (int channel = 0; channel < channels; channel++) {
+            std::vector<float> expected_f32(frames);
+            for (size_t i = 0; i < frames; i++) expected_f32[i] = packed_f32[i * channels + channel];
+            found += count_mismatches("s16_to_fltp", std::to_string(channels).c_str(), expected_f32, split[channel], 0);
+        }
+
+        fprintf(stderr, "  %d channel template conversions %s\n", channels, found ? "MISMATCH" : "ok");
+        mismatches += found;
+    }
+
+    if (mismatches) fprintf(stderr, "%zu samples differ from the scalar kernels\n", mismatches);
+    return mismatches == 0;
+}
+
+/// Runs every variant of every dispatched kernel this CPU can run over the same buffer
+static void bench_kernels(int iterations) {
+    const size_t count = 1 << 20;
+    const int repeats = 20 * iterations;
+
+    std::vector<float> floats(count);
+    std::vector<int16_t> shorts(count);
+    for (size_t i = 0; i < count; i++) {
+        floats[i] = 0.5f * sinf(i * 0.01f);
+        shorts[i] = (int16_t) (floats[i] * 32767);
+    }
+    std::vector<float> float_out(count);
+    std::vector<int16_t> short_out(count);
+    std::vector<uint8_t> bytes(count);
+    for (size_t i = 0; i < count; i++) bytes[i] = (uint8_t) (i * 37);
+    const float scale[3] = {1 / (255 * 0.229f), 1 / (255 * 0.224f), 1 / (255 * 0.225f)};
+    const float bias[3] = {-0.485f / 0.229f, -0.456f / 0.224f, -0.406f / 0.225f};
+
+    fprintf(stderr, "\nKernels, %zu samples x %d, ms per pass (detected %s, bound %s)\n", count, repeats,
+            jp::get_cpu_level_name(jp::get_detected_cpu_level()).c_str(), jp::get_cpu_level_name(jp::get_cpu_level()).c_str());
+    fprintf(stderr, "  %-8s %10s %10s %10s %10s %10s\n", "level", "gain_f32", "gain_s16", "s16_f32", "f32_s16", "u8_f32");
+
+    for (jp::CpuLevel level : {jp::CpuLevel::SCALAR, jp::CpuLevel::SSE2, jp::CpuLevel::SSE4_1, jp::CpuLevel::AVX2, jp::CpuLevel::AVX512}) {
+        if (level > jp::get_detected_cpu_level()) break;
+        auto kernels = jp::get_kernel_table(level);
+
+        auto time = [&](std::function<void()> pass) {
+            auto start = bench_clock::now();
+            for (int i = 0; i < repeats; i++) pass();
+            return elapsed_ms(start) / repeats;
+        };
+
+        // Gains alternate around 1 so the buffers neither blow up nor fade out
+        double gain_f32 = time([&]() { kernels.gain_f32(floats.data(), count, 1.001f); kernels.gain_f32(floats.data(), count, 0.999f); }) / 2;
+        double gain_s16 = time([&]() { kernels.gain_s16(shorts.data(), count, 0.999f); kernels.gain_s16(shorts.data(), count, 1.001f); }) / 2;
+        double s16_f32 = time([&]() { kernels.s16_to_f32(shorts.data(), float_out.data(), count); });
+        double f32_s16 = time([&]() { kernels.f32_to_s16(floats.data(), short_out.data(), count); });
+        // Interleaved RGB, the NHWC case
+        double u8_f32 = time([&]() { kernels.normalize_u8_f32(bytes.data(), float_out.data(), count / 3 * 3, scale, bias, 3); });
+
+        fprintf(stderr, "  %-8s %10.3f %10.3f %10.3f %10.3f %10.3f\n", jp::get_cpu_level_name(level).c_str(), gain_f32, gain_s16, s16_f32, f32_s16, u8_f32);
+    }
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 2 ? std::max(1, atoi(argv[2])) : 3;
+
+    // Timing kernels that give the wrong answer is pointless
+    if (!check_kernels()) return 1;
+
+    bench_kernels(iterations);
+    bench_resample(iterations);
+
+    // The rest needs real media
+    if (argc < 2) {
+        fprintf(stderr, "\nUsage: %s <media file> [iterations]\n", argv[0]);
+        return 0;
+    }
+
+    bench_startup(argv[1], iterations);
+    bench_probe(argv[1], iterations);
+    bench_pipeline(argv[1]);
+    bench_reader(argv[1]);
+    bench_batcher(argv[1]);
+
+    jp::FFMpegIOContext_Ptr io_context{new jp::FFMpegIOContext()};
+    if (!io_context->open(argv[1], jp::OpenMode::OPEN_MODE_READ)) {
+        fprintf(stderr, "IO Context couldn't open the file!\n");
+        return -1;
+    }
+
+    jp::FFMpegMedia_Ptr media{new jp::FFMpegMedia(io_context)};
+    if (!media->parse()) {
+        fprintf(stderr, "Could not parse media! Reason: %s\n", media->get_error().c_str());
+        return -1;
+    }
+
+    bench_decode(media, false, iterations);
+    bench_decode(media, true, iterations);
+
+    return 0;
+}